@@ -9,6 +9,12 @@
 #define _SIPLOG_INTERNAL_H_
 
 #define SIPLOG_DEFAULT_PATH	"/var/log/sip.log"
+#define SIPLOG_DEFAULT_IDX_DIR	"/var/log/siplog.idx"
+#define SIPLOG_NLEVELS		(SIPLOG_CRIT + 1)
+
+struct siplog_dedup;
+struct siplog_flightrec;
+struct siplog_lbuf;
 
 struct loginfo
 {
@@ -20,28 +26,61 @@ struct loginfo
     int         flags;
     int         call_id_global;
     pid_t       pid;
+    struct siplog_dedup *dedup;
+    struct siplog_flightrec *flightrec;
 };
 
 typedef int    (*siplog_bend_open_t)(struct loginfo *);
-typedef void   (*siplog_bend_write_t)(struct loginfo *, const char *, const char *,
-				      const char *, const char *, va_list);
+typedef void   (*siplog_bend_write_t)(struct loginfo *, int, const char *,
+				      const char *, const char *, const char *,
+				      va_list);
+typedef void   (*siplog_bend_writev_t)(struct loginfo *, int, const char *,
+				       const char *, const struct iovec *, int);
+typedef char  *(*siplog_bend_reserve_t)(struct loginfo *, int, const char *,
+					const char *, size_t, void **);
+typedef void   (*siplog_bend_commit_t)(struct loginfo *, void *, size_t);
+typedef void   (*siplog_bend_abandon_t)(struct loginfo *, void *);
 typedef void   (*siplog_bend_close_t)(struct loginfo *);
 typedef void   (*siplog_bend_hbeat_t)(struct loginfo *);
+typedef void   (*siplog_bend_writeb_t)(struct loginfo *, int, const char *,
+				       struct siplog_lbuf *);
+typedef int    (*siplog_bend_hint_t)(struct loginfo *, int *);
 
 struct bend
 {
     siplog_bend_open_t  open;
     siplog_bend_write_t write;
+    siplog_bend_writev_t writev;
+    /* Optional, siplog_reserve() uses a buffer of its own if not set */
+    siplog_bend_reserve_t reserve;
+    siplog_bend_commit_t commit;
+    siplog_bend_abandon_t abandon;
     siplog_bend_close_t close;
     siplog_bend_hbeat_t hbeat;
+    /* Takes a line that is formatted already, needed to be a fan-out sink */
+    siplog_bend_writeb_t writeb;
+    /* Optional, see siplog_hbeat_hint() */
+    siplog_bend_hint_t hint;
     int			free_after_close;
     const char          *name;
 };
 
 char *siplog_timeToStr(struct timeval *, char *);
+int siplog_level_byname(const char *);
+struct bend *siplog_bend_byname(const char *);
 void siplog_free(struct loginfo *);
 off_t siplog_lockf(int);
 void siplog_unlockf(int, off_t);
+void siplog_closef(int);
+const char *siplog_index_dir(void);
+const char *siplog_logfile_path(void);
 void siplog_update_index(const char *, int, off_t, size_t);
+void siplog_update_tsindex(int, off_t);
+size_t siplog_iov_flatten(char *, size_t, const struct iovec *, int);
+int siplog_format_line(char *, size_t, struct loginfo *, const char *,
+  const char *, const char *, va_list);
+void siplog_iwrite_va(int, siplog_t, const char *, const char *, va_list);
+void siplog_writev_common(int, struct loginfo *, const char *,
+  const struct iovec *, int, const void *);
 
 #endif /* _SIPLOG_INTERNAL_H_ */
@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+#ifndef _SIPLOG_COLLECTOR_H_
+#define _SIPLOG_COLLECTOR_H_
+
+#define SIPLOG_COLLECTOR_DEFAULT_SOCK	"/var/run/siplog.sock"
+#define SIPLOG_COLLECTOR_MAGIC		0x53504c31	/* "SPL1" */
+#define SIPLOG_COLLECTOR_BATCH		64
+#define SIPLOG_COLLECTOR_MAXMSG		(64 * 1024)
+
+/*
+ * Every datagram sent to the collector starts with this header, followed
+ * by path_len bytes of the log file path, idx_len bytes of the index id
+ * (0 if the record is not to be indexed) and the formatted log line,
+ * newline included, which takes the rest of the datagram. None of the
+ * strings are NUL-terminated. Header fields are in the host byte order,
+ * since both ends are on the same box.
+ */
+struct siplog_collector_hdr {
+    uint32_t magic;
+    uint16_t path_len;
+    uint16_t idx_len;
+};
+
+#endif /* _SIPLOG_COLLECTOR_H_ */
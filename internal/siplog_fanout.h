@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+#ifndef _SIPLOG_FANOUT_H_
+#define _SIPLOG_FANOUT_H_
+
+/* Most sinks a single handle can fan out to */
+#define SIPLOG_FANOUT_MAX	8
+
+/*
+ * Complete line, prefix and trailing newline included, formatted once by
+ * a fan-out handle and shared by all of its sinks. Sinks that write it out
+ * later take a reference of their own. Also used for the contents of the
+ * flight recorder, which is handed over to the backend in one go.
+ */
+struct siplog_lbuf {
+    int refcnt;
+    int flags;
+    size_t size;
+    size_t len;
+    char data[];
+};
+
+/* Lines replayed from the flight recorder, not to be dropped */
+#define SIPLOG_LBUF_REPLAY	0x1
+
+struct bend;
+
+extern struct bend siplog_fanout_bend;
+
+int siplog_fanout_spec(const char *);
+struct siplog_lbuf *siplog_lbuf_alloc(size_t);
+struct siplog_lbuf *siplog_lbuf_grow(struct siplog_lbuf *, size_t);
+void siplog_lbuf_hold(struct siplog_lbuf *);
+void siplog_lbuf_release(struct siplog_lbuf *);
+
+#endif /* _SIPLOG_FANOUT_H_ */
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+#ifndef _SIPLOG_FLIGHTREC_H_
+#define _SIPLOG_FLIGHTREC_H_
+
+#define SIPLOG_FLIGHTREC_DEFAULT	(64 * 1024)
+/* Longest message that is kept in the ring, the rest is truncated */
+#define SIPLOG_FLIGHTREC_MSG_LEN	1024
+
+struct siplog_flightrec;
+
+typedef void (*siplog_flightrec_cb_t)(void *, const char *, const char *,
+  const char *);
+
+size_t siplog_flightrec_size(int);
+struct siplog_flightrec *siplog_flightrec_alloc(size_t);
+void siplog_flightrec_free(struct siplog_flightrec *);
+void siplog_flightrec_record(struct siplog_flightrec *, const char *,
+  const char *, const char *, const char *, va_list);
+int siplog_flightrec_drain(struct siplog_flightrec *, siplog_flightrec_cb_t,
+  void *);
+
+#endif /* _SIPLOG_FLIGHTREC_H_ */
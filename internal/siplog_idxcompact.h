@@ -0,0 +1,13 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+#ifndef _SIPLOG_IDXCOMPACT_H_
+#define _SIPLOG_IDXCOMPACT_H_
+
+int siplog_index_compact(const char *, unsigned long long);
+void siplog_index_compact_bg(unsigned long long);
+
+#endif /* _SIPLOG_IDXCOMPACT_H_ */
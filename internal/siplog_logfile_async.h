@@ -9,11 +9,25 @@
 #define _SIPLOG_LOGFILE_ASYNC_H_
 
 struct loginfo;
+struct siplog_lbuf;
 
 int siplog_logfile_async_open(struct loginfo *);
-void siplog_logfile_async_write(struct loginfo *, const char *, const char *,
-  const char *, const char *, va_list);
+void siplog_logfile_async_write(struct loginfo *, int, const char *,
+  const char *, const char *, const char *, va_list);
+void siplog_logfile_async_writev(struct loginfo *, int, const char *,
+  const char *, const struct iovec *, int);
+char *siplog_logfile_async_reserve(struct loginfo *, int, const char *,
+  const char *, size_t, void **);
+void siplog_logfile_async_commit(struct loginfo *, void *, size_t);
+void siplog_logfile_async_abandon(struct loginfo *, void *);
 void siplog_logfile_async_close(struct loginfo *);
 void siplog_logfile_async_hbeat(struct loginfo *);
+void siplog_logfile_async_writeb(struct loginfo *, int, const char *,
+  struct siplog_lbuf *);
+
+int siplog_collector_open(struct loginfo *);
+int siplog_stderr_async_open(struct loginfo *);
+
+int siplog_queue_depth(void);
 
 #endif
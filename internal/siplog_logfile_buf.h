@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+#ifndef _SIPLOG_LOGFILE_BUF_H_
+#define _SIPLOG_LOGFILE_BUF_H_
+
+struct loginfo;
+struct siplog_lbuf;
+
+int siplog_logfile_buf_open(struct loginfo *);
+void siplog_logfile_buf_write(struct loginfo *, int, const char *,
+  const char *, const char *, const char *, va_list);
+void siplog_logfile_buf_writev(struct loginfo *, int, const char *,
+  const char *, const struct iovec *, int);
+void siplog_logfile_buf_writeb(struct loginfo *, int, const char *,
+  struct siplog_lbuf *);
+void siplog_logfile_buf_close(struct loginfo *);
+void siplog_logfile_buf_hbeat(struct loginfo *);
+int siplog_logfile_buf_hint(struct loginfo *, int *);
+
+#endif /* _SIPLOG_LOGFILE_BUF_H_ */
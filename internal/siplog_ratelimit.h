@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+#ifndef _SIPLOG_RATELIMIT_H_
+#define _SIPLOG_RATELIMIT_H_
+
+/* Longest message that is still considered for duplicate suppression */
+#define SIPLOG_DEDUP_MSG_LEN	1024
+
+struct siplog_dedup;
+
+int siplog_rl_check(int, const void *, int64_t *);
+
+int siplog_dedup_enabled(int);
+struct siplog_dedup *siplog_dedup_alloc(void);
+void siplog_dedup_free(struct siplog_dedup *);
+int siplog_dedup_check(struct siplog_dedup *, int, const char *, size_t,
+  const char *, int64_t *);
+int64_t siplog_dedup_flush(struct siplog_dedup *);
+
+#endif /* _SIPLOG_RATELIMIT_H_ */
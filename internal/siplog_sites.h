@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+#ifndef _SIPLOG_SITES_INTERNAL_H_
+#define _SIPLOG_SITES_INTERNAL_H_
+
+/* What the line being logged from a tagged call site has cost so far */
+struct siplog_site_acct {
+    int active;
+    int emitted;	/* got as far as a backend */
+    size_t bytes;
+    int64_t fmt_ns;
+};
+
+extern __thread struct siplog_site_acct siplog_site_acct;
+
+int64_t siplog_site_clock(void);
+void siplog_site_formatted(int64_t, int);
+void siplog_site_emittedv(const struct iovec *, int);
+
+#endif /* _SIPLOG_SITES_INTERNAL_H_ */
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+#ifndef _SIPLOG_SITETAB_H_
+#define _SIPLOG_SITETAB_H_
+
+#include <stdint.h>
+
+#define SIPLOG_SITETAB_NBUCKETS_LOG2	12
+#define SIPLOG_SITETAB_NBUCKETS		(1 << SIPLOG_SITETAB_NBUCKETS_LOG2)
+
+/* What the entries of a table start with */
+struct siplog_sitetab_ent {
+    uint64_t magic;
+    const char *fname;
+    int linen;
+    const char *funcn;
+    struct siplog_sitetab_ent *next;
+};
+
+struct siplog_sitetab {
+    uint64_t magic;
+    struct siplog_sitetab_ent *buckets[SIPLOG_SITETAB_NBUCKETS];
+};
+
+#define SIPLOG_SITETAB_INITIALIZER(m)	{.magic = (m)}
+
+#define SIPLOG_SITETAB_FOREACH(tp, ep, bucket) \
+    for ((bucket) = -1, (ep) = siplog_sitetab_next((tp), NULL, &(bucket)); \
+      (ep) != NULL; (ep) = siplog_sitetab_next((tp), (ep), &(bucket)))
+
+void siplog_sitetab_init(struct siplog_sitetab *, struct siplog_sitetab_ent *,
+  const char *, int, const char *);
+struct siplog_sitetab_ent *siplog_sitetab_find(struct siplog_sitetab *,
+  const char *, int, const char *);
+struct siplog_sitetab_ent *siplog_sitetab_insert(struct siplog_sitetab *,
+  struct siplog_sitetab_ent *);
+struct siplog_sitetab_ent *siplog_sitetab_next(struct siplog_sitetab *,
+  struct siplog_sitetab_ent *, int *);
+
+#endif /* _SIPLOG_SITETAB_H_ */
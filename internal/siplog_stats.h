@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+#ifndef _SIPLOG_STATS_H_
+#define _SIPLOG_STATS_H_
+
+/* Segment of a process is named SIPLOG_STATS_PREFIX followed by its pid */
+#define SIPLOG_STATS_PREFIX	"siplog."
+#define SIPLOG_STATS_MAGIC	0x54535053	/* "SPST" */
+#define SIPLOG_STATS_VERSION	1
+#define SIPLOG_STATS_APP_LEN	32
+
+/*
+ * Layout of the shared memory segment. Everything but the header is only
+ * consistent when seq is even and stays the same across the read, the
+ * publisher makes it odd while updating.
+ */
+struct siplog_stats_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    int32_t pid;
+    char app[SIPLOG_STATS_APP_LEN];
+    int64_t updated;		/* wall clock, ns */
+    uint64_t lines[SIPLOG_NLEVELS];
+    uint64_t drops[SIPLOG_NLEVELS];
+    uint64_t bytes;
+    int64_t qdepth;		/* records waiting for the async worker */
+    int64_t lag_last;		/* how long they have been waiting, ns */
+    int64_t lag_max;
+    uint64_t idx_appends;
+    int64_t idx_ns_total;
+    int64_t idx_ns_max;
+    int64_t memdeb_live;	/* -1 if not built with memory debugging */
+    int64_t memdeb_peak;
+};
+
+struct timespec;
+
+void siplog_stats_init(const char *);
+int siplog_stats_enabled(void);
+void siplog_stats_line(int);
+void siplog_stats_bytes(size_t);
+void siplog_stats_lag(const struct timespec *);
+void siplog_stats_index(const struct timespec *);
+void siplog_stats_publish(int);
+
+#endif /* _SIPLOG_STATS_H_ */
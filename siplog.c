@@ -7,22 +7,80 @@
 
 #define _FILE_OFFSET_BITS  64
 
+#include <sys/param.h>
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "siplog.h"
 #include "internal/_siplog.h"
+#include "internal/siplog_fanout.h"
+#include "internal/siplog_flightrec.h"
 #include "internal/siplog_logfile_async.h"
+#include "internal/siplog_logfile_buf.h"
+#include "internal/siplog_ratelimit.h"
+#include "internal/siplog_sites.h"
+#include "internal/siplog_stats.h"
 
 #define assert(x) {if (!(x)) abort();}
 
+/* Size of the per-thread buffer siplog_reserve() falls back to */
+#define SIPLOG_RESV_BUF_LEN	(8 * 1024)
+/* Lines the logfile backend formats without going to the heap */
+#define SIPLOG_LINE_BUF_LEN	(8 * 1024)
+/* Initial size of the block the flight recorder is replayed into */
+#define SIPLOG_REPLAY_LEN	(8 * 1024)
+
+/* Reservation made by siplog_reserve() on this thread, if any */
+struct siplog_resv {
+    struct loginfo *lp;
+    int level;
+    const void *site;	/* rate limiter key it has been checked with */
+    struct siplog_lbuf *replay;	/* flight recorder to go out with it */
+    void *cookie;	/* backend's, NULL if buf is ours */
+    char *buf;
+    size_t size;
+    const char *idx_id;
+    char tstamp[64];
+};
+
+/* Flight recorder being replayed, see siplog_replay_block() */
+struct siplog_replay {
+    struct loginfo *lp;
+    struct siplog_lbuf *lb;
+};
+
+/* fcntl(2) locks don't exclude threads of the same process, this does */
+static pthread_mutex_t siplog_lockf_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Time index entry is added every that many KB or ms of the log file */
+#define SIPLOG_TSINDEX_KB	256
+#define SIPLOG_TSINDEX_MS	1000
+
+/* Time index state, protected by siplog_lockf_mutex */
+static struct {
+    int inited;
+    off_t every_bytes;
+    int64_t every_ms;
+    off_t last_offset;
+    int64_t last_ms;
+} siplog_tsindex = {.last_offset = -1};
+
+static __thread struct siplog_resv siplog_resv;
+/* Replay that the lines logged via a handle are being appended to */
+static __thread struct siplog_replay siplog_replaying;
+static __thread char siplog_resv_buf[SIPLOG_RESV_BUF_LEN];
+
 static struct
 {
     const char *descr;
@@ -37,25 +95,91 @@ static struct
 };
 
 static int    siplog_stderr_open(struct loginfo *);
-static void   siplog_stderr_write(struct loginfo *, const char *, const char *,
-				  const char *, const char *, va_list);
+static void   siplog_stderr_write(struct loginfo *, int, const char *,
+				  const char *, const char *, const char *,
+				  va_list);
+static void   siplog_stderr_writev(struct loginfo *, int, const char *,
+				   const char *, const struct iovec *, int);
+static void   siplog_stderr_writeb(struct loginfo *, int, const char *,
+				   struct siplog_lbuf *);
 static void   siplog_stderr_close(struct loginfo *);
 static int    siplog_logfile_open(struct loginfo *);
-static void   siplog_logfile_write(struct loginfo *, const char *, const char *,
-		    		   const char *, const char *, va_list);
+static void   siplog_logfile_write(struct loginfo *, int, const char *,
+				   const char *, const char *, const char *,
+				   va_list);
+static void   siplog_logfile_writev(struct loginfo *, int, const char *,
+				    const char *, const struct iovec *, int);
+static void   siplog_logfile_writeb(struct loginfo *, int, const char *,
+				    struct siplog_lbuf *);
 static void   siplog_logfile_close(struct loginfo *);
 
 static struct bend bends[] = {
     {.open = siplog_stderr_open, .write = siplog_stderr_write,
-      .close = siplog_stderr_close, .free_after_close = 1, .name = "stderr"},
+      .writev = siplog_stderr_writev, .close = siplog_stderr_close,
+      .writeb = siplog_stderr_writeb, .free_after_close = 1,
+      .name = "stderr"},
     {.open = siplog_logfile_open, .write = siplog_logfile_write,
-      .close = siplog_logfile_close, .free_after_close = 1, .name = "logfile"},
+      .writev = siplog_logfile_writev, .close = siplog_logfile_close,
+      .writeb = siplog_logfile_writeb, .free_after_close = 1,
+      .name = "logfile"},
     {.open = siplog_logfile_async_open, .write = siplog_logfile_async_write,
+      .writev = siplog_logfile_async_writev,
+      .reserve = siplog_logfile_async_reserve,
+      .commit = siplog_logfile_async_commit,
+      .abandon = siplog_logfile_async_abandon,
+      .writeb = siplog_logfile_async_writeb,
       .close = siplog_logfile_async_close, .free_after_close = 0,
       .name = "logfile_async", .hbeat = siplog_logfile_async_hbeat},
+    {.open = siplog_collector_open, .write = siplog_logfile_async_write,
+      .writev = siplog_logfile_async_writev,
+      .reserve = siplog_logfile_async_reserve,
+      .commit = siplog_logfile_async_commit,
+      .abandon = siplog_logfile_async_abandon,
+      .writeb = siplog_logfile_async_writeb,
+      .close = siplog_logfile_async_close, .free_after_close = 0,
+      .name = "collector", .hbeat = siplog_logfile_async_hbeat},
+    {.open = siplog_stderr_async_open, .write = siplog_logfile_async_write,
+      .writev = siplog_logfile_async_writev,
+      .reserve = siplog_logfile_async_reserve,
+      .commit = siplog_logfile_async_commit,
+      .abandon = siplog_logfile_async_abandon,
+      .writeb = siplog_logfile_async_writeb,
+      .close = siplog_logfile_async_close, .free_after_close = 0,
+      .name = "stderr_async", .hbeat = siplog_logfile_async_hbeat},
+    {.open = siplog_logfile_buf_open, .write = siplog_logfile_buf_write,
+      .writev = siplog_logfile_buf_writev,
+      .writeb = siplog_logfile_buf_writeb,
+      .close = siplog_logfile_buf_close, .free_after_close = 1,
+      .name = "logfile_buffered", .hbeat = siplog_logfile_buf_hbeat,
+      .hint = siplog_logfile_buf_hint},
     {.open = NULL, .write = NULL, .close = NULL, .name = NULL}
 };
 
+int
+siplog_level_byname(const char *descr)
+{
+    int i;
+
+    for (i = 0; levels[i].descr != NULL; i++) {
+        if (strcmp(descr, levels[i].descr) == 0)
+            return (levels[i].level);
+    }
+    return (-1);
+}
+
+/* Backend that SIPLOG_BEND refers to by a given name, NULL if none */
+struct bend *
+siplog_bend_byname(const char *name)
+{
+    int i;
+
+    for (i = 0; bends[i].name != NULL; i++) {
+        if (strcmp(name, bends[i].name) == 0)
+            return (&bends[i]);
+    }
+    return (NULL);
+}
+
 char *
 siplog_timeToStr(struct timeval *tvp, char *buf)
 {
@@ -93,18 +217,108 @@ siplog_stderr_open(struct loginfo *lp)
 }
 
 static void
-siplog_stderr_write(struct loginfo *lp, const char *tstamp,
+siplog_stderr_write(struct loginfo *lp, int level __attribute__ ((unused)),
+  const char *tstamp,
   const char *estr, const char *unused __attribute__ ((unused)),
   const char *fmt, va_list ap)
 {
     FILE *f;
+    int64_t start;
+    int len;
 
     f = (FILE *)lp->private;
-    fprintf(f, "%s/%s/%s[%d]: ", tstamp, lp->call_id, lp->app, lp->pid);
-    vfprintf(f, fmt, ap);
+    start = siplog_site_acct.active ? siplog_site_clock() : 0;
+    len = fprintf(f, "%s/%s/%s[%d]: ", tstamp, lp->call_id, lp->app, lp->pid);
+    len += vfprintf(f, fmt, ap);
     if (estr != NULL)
-	fprintf(f, ": %s", estr);
-    fprintf(f, "\n");
+	len += fprintf(f, ": %s", estr);
+    len += fprintf(f, "\n");
+    if (siplog_site_acct.active)
+        siplog_site_formatted(start, len);
+    if (len > 0)
+        siplog_stats_bytes(len);
+}
+
+/*
+ * Copy up to size - 1 bytes of the iovec array into buf and NUL-terminate
+ * it. Returns the total length of the data in the array.
+ */
+size_t
+siplog_iov_flatten(char *buf, size_t size, const struct iovec *iov, int iovcnt)
+{
+    size_t len, n;
+    int i;
+
+    len = 0;
+    for (i = 0; i < iovcnt; i++) {
+        if (len < size - 1) {
+            n = MIN(iov[i].iov_len, size - 1 - len);
+            memcpy(buf + len, iov[i].iov_base, n);
+        }
+        len += iov[i].iov_len;
+    }
+    buf[MIN(len, size - 1)] = '\0';
+    return (len);
+}
+
+/*
+ * Put the line prefix, caller's data and the trailing newline together into
+ * v, which has to have room for iovcnt + 2 entries. Returns the number of
+ * entries used, total length of the line is stored into nbytes.
+ */
+static int
+siplog_iov_line(struct iovec *v, char *prefix, size_t psize,
+  struct loginfo *lp, const char *tstamp, const struct iovec *iov, int iovcnt,
+  size_t *nbytes)
+{
+    static char nl[] = "\n";
+    int i, r;
+
+    r = snprintf(prefix, psize, "%s/%s/%s[%d]: ", tstamp, lp->call_id,
+      lp->app, lp->pid);
+    if (r < 0)
+        r = 0;
+    v[0].iov_base = prefix;
+    v[0].iov_len = MIN((size_t)r, psize - 1);
+    *nbytes = v[0].iov_len + 1;
+    for (i = 0; i < iovcnt; i++) {
+        v[i + 1] = iov[i];
+        *nbytes += iov[i].iov_len;
+    }
+    v[i + 1].iov_base = nl;
+    v[i + 1].iov_len = 1;
+    return (iovcnt + 2);
+}
+
+static void
+siplog_stderr_writev(struct loginfo *lp, int level __attribute__ ((unused)),
+  const char *tstamp,
+  const char *unused __attribute__ ((unused)), const struct iovec *iov,
+  int iovcnt)
+{
+    struct iovec v[SIPLOG_IOV_MAX + 2];
+    char prefix[512];
+    size_t nbytes;
+    FILE *f;
+    int n;
+
+    f = (FILE *)lp->private;
+    n = siplog_iov_line(v, prefix, sizeof(prefix), lp, tstamp, iov, iovcnt,
+      &nbytes);
+    fflush(f);
+    writev(fileno(f), v, n);
+    siplog_stats_bytes(nbytes);
+}
+
+static void
+siplog_stderr_writeb(struct loginfo *lp, int level __attribute__ ((unused)),
+  const char *idx_id __attribute__ ((unused)), struct siplog_lbuf *lb)
+{
+    FILE *f;
+
+    f = (FILE *)lp->private;
+    fflush(f);
+    write(fileno(f), lb->data, lb->len);
 }
 
 static void
@@ -114,8 +328,20 @@ siplog_stderr_close(struct loginfo *lp __attribute__ ((unused)))
     /* Nothing to do here */
 }
 
-void
-siplog_update_index(const char *idx_id, int fd, off_t offset, size_t nbytes)
+/* Directory with the call-id indices, one per log file named by its inode */
+const char *
+siplog_index_dir(void)
+{
+    const char *cp;
+
+    cp = getenv("SIPLOG_INDEX_DIR");
+    if (cp == NULL)
+        cp = SIPLOG_DEFAULT_IDX_DIR;
+    return (cp);
+}
+
+static void
+siplog_index_append(const char *idx_id, int fd, off_t offset, size_t nbytes)
 {
     struct stat st;
     int res, idxfile;
@@ -124,7 +350,8 @@ siplog_update_index(const char *idx_id, int fd, off_t offset, size_t nbytes)
     res = fstat(fd, &st);
     if (res == -1)
         return;
-    asprintf(&fname, "/var/log/siplog.idx/%llu", (long long unsigned)st.st_ino);
+    asprintf(&fname, "%s/%llu", siplog_index_dir(),
+      (long long unsigned)st.st_ino);
     if (fname == NULL)
         return;
     idxfile = open(fname, O_CREAT | O_APPEND | O_WRONLY, 0644);
@@ -142,56 +369,269 @@ siplog_update_index(const char *idx_id, int fd, off_t offset, size_t nbytes)
     free(outbuf);
 }
 
+void
+siplog_update_index(const char *idx_id, int fd, off_t offset, size_t nbytes)
+{
+    struct timespec start;
+    int timed;
+
+    /* Lines that are not about any call in particular aren't indexed */
+    if (idx_id == NULL || idx_id[0] == '\0')
+        return;
+    timed = siplog_stats_enabled();
+    if (timed)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    siplog_index_append(idx_id, fd, offset, nbytes);
+    if (timed)
+        siplog_stats_index(&start);
+}
+
+static void
+siplog_tsindex_init(void)
+{
+    const char *cp;
+    char *ep;
+    long kb, ms;
+
+    kb = SIPLOG_TSINDEX_KB;
+    ms = SIPLOG_TSINDEX_MS;
+    cp = getenv("SIPLOG_TSINDEX");
+    if (cp != NULL) {
+        kb = strtol(cp, &ep, 10);
+        ms = (*ep == ':') ? strtol(ep + 1, NULL, 10) : 0;
+    }
+    siplog_tsindex.every_bytes = (kb > 0) ? (off_t)kb * 1024 : 0;
+    siplog_tsindex.every_ms = (ms > 0) ? ms : 0;
+    siplog_tsindex.inited = 1;
+}
+
+/*
+ * Sparse index of the log file by time, "<ino>.ts" next to the call-id
+ * index, with lines of "<ms> <offset>", ms being the wall clock when the
+ * line at offset is appended. Text timestamps have no year and are out of
+ * order across processes, but appends are serialized by the file lock, so
+ * in here both go up and all lines before offset have been written by ms.
+ * Called with siplog_lockf() held, right after the line has been written.
+ */
+void
+siplog_update_tsindex(int fd, off_t offset)
+{
+    struct timespec ts;
+    struct stat st;
+    char *fname, buf[64];
+    int64_t now;
+    int idxfile, len;
+
+    if (!siplog_tsindex.inited)
+        siplog_tsindex_init();
+    if (siplog_tsindex.every_bytes == 0 && siplog_tsindex.every_ms == 0)
+        return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    /* Going back means another file or the same one after rotation */
+    if (siplog_tsindex.last_offset >= 0 &&
+      offset >= siplog_tsindex.last_offset &&
+      (siplog_tsindex.every_bytes == 0 ||
+      offset - siplog_tsindex.last_offset < siplog_tsindex.every_bytes) &&
+      (siplog_tsindex.every_ms == 0 ||
+      now - siplog_tsindex.last_ms < siplog_tsindex.every_ms))
+        return;
+    siplog_tsindex.last_offset = offset;
+    siplog_tsindex.last_ms = now;
+
+    if (fstat(fd, &st) == -1)
+        return;
+    asprintf(&fname, "%s/%llu.ts", siplog_index_dir(),
+      (long long unsigned)st.st_ino);
+    if (fname == NULL)
+        return;
+    idxfile = open(fname, O_CREAT | O_APPEND | O_WRONLY, 0644);
+    free(fname);
+    if (idxfile < 0)
+        return;
+    len = snprintf(buf, sizeof(buf), "%lld %llu\n", (long long)now,
+      (long long unsigned)offset);
+    write(idxfile, buf, len);
+    close(idxfile);
+}
+
 static int
-siplog_logfile_open(struct loginfo *lp)
+siplog_format_line0(char *buf, size_t size, struct loginfo *lp,
+  const char *tstamp, const char *estr, const char *fmt, va_list ap)
+{
+    size_t len;
+    int r;
+
+    r = snprintf(buf, size, "%s/%s/%s[%d]: ", tstamp, lp->call_id, lp->app,
+      lp->pid);
+    if (r < 0)
+        return (-1);
+    len = r;
+    r = vsnprintf(buf + MIN(len, size), size - MIN(len, size), fmt, ap);
+    if (r < 0)
+        return (-1);
+    len += r;
+    if (estr != NULL) {
+        r = snprintf(buf + MIN(len, size), size - MIN(len, size), ": %s",
+          estr);
+        if (r < 0)
+            return (-1);
+        len += r;
+    }
+    if (len + 2 <= size) {
+        buf[len] = '\n';
+        buf[len + 1] = '\0';
+    } else {
+        /* message was truncated */
+        buf[size - 2] = '\n';
+        buf[size - 1] = '\0';
+    }
+    return (len + 1);
+}
+
+/*
+ * Format a complete line into buf, truncating it if necessary but always
+ * keeping the trailing newline. Returns length of the complete line, which
+ * is more than size - 1 if it has been truncated, or -1 on error. Lines
+ * from the call sites that are accounted for get timed.
+ */
+int
+siplog_format_line(char *buf, size_t size, struct loginfo *lp,
+  const char *tstamp, const char *estr, const char *fmt, va_list ap)
+{
+    int64_t start;
+    int len;
+
+    if (!siplog_site_acct.active)
+        return (siplog_format_line0(buf, size, lp, tstamp, estr, fmt, ap));
+    start = siplog_site_clock();
+    len = siplog_format_line0(buf, size, lp, tstamp, estr, fmt, ap);
+    siplog_site_formatted(start, len);
+    return (len);
+}
+
+const char *
+siplog_logfile_path(void)
 {
     const char *cp;
 
     cp = getenv("SIPLOG_LOGFILE_FILE");
     if (cp == NULL)
-	cp = SIPLOG_DEFAULT_PATH;
+        cp = SIPLOG_DEFAULT_PATH;
+    return (cp);
+}
+
+static int
+siplog_logfile_open(struct loginfo *lp)
+{
+    int fd;
 
     if ((lp->flags & LF_REOPEN) == 0) {
-        lp->private = (void *)fopen(cp, "a");
-        if (lp->private == NULL)
+        fd = open(siplog_logfile_path(), O_CREAT | O_APPEND | O_WRONLY, 0666);
+        if (fd == -1)
             return -1;
+        lp->private = (void *)(intptr_t)fd;
     }
     return 0;
 }
 
+static int
+siplog_logfile_fd(struct loginfo *lp)
+{
+
+    if ((lp->flags & LF_REOPEN) == 0)
+        return ((int)(intptr_t)lp->private);
+    return (open(siplog_logfile_path(), O_CREAT | O_APPEND | O_WRONLY, 0666));
+}
+
+/* Append a complete line to the file and index it */
 static void
-siplog_logfile_write(struct loginfo *lp, const char *tstamp,
-  const char *estr, const char *idx_id, const char *fmt, va_list ap)
+siplog_logfile_put(struct loginfo *lp, const char *idx_id, const char *buf,
+  size_t len)
 {
-    FILE *f;
     off_t offset;
-    size_t nbytes;
+    int fd;
 
-    if ((lp->flags & LF_REOPEN) == 0) {
-	f = (FILE *)lp->private;
-    } else {
-	const char *cp;
+    fd = siplog_logfile_fd(lp);
+    if (fd == -1)
+        return;
+    offset = siplog_lockf(fd);
+    write(fd, buf, len);
+    siplog_update_tsindex(fd, offset);
+    siplog_unlockf(fd, offset);
+    siplog_update_index(idx_id, fd, offset, len);
+    if ((lp->flags & LF_REOPEN) != 0)
+        siplog_closef(fd);
+}
 
-	cp = getenv("SIPLOG_LOGFILE_FILE");
-	if (cp == NULL)
-	    cp = SIPLOG_DEFAULT_PATH;
+/*
+ * The line is formatted into a per-thread buffer first, a heap one if it
+ * doesn't fit, so that it goes out with a single write(2) and the file
+ * lock is only held for as long as that takes.
+ */
+static void
+siplog_logfile_write(struct loginfo *lp, int level __attribute__ ((unused)),
+  const char *tstamp, const char *estr, const char *idx_id, const char *fmt,
+  va_list ap)
+{
+    static __thread char lbuf[SIPLOG_LINE_BUF_LEN];
+    char *buf;
+    va_list aq;
+    int len;
 
-	f = fopen(cp, "a");
-	if (f == NULL)
-	    return;
+    buf = lbuf;
+    va_copy(aq, ap);
+    len = siplog_format_line(buf, sizeof(lbuf), lp, tstamp, estr, fmt, aq);
+    va_end(aq);
+    if (len < 0)
+        return;
+    if ((size_t)len >= sizeof(lbuf)) {
+        buf = malloc(len + 1);
+        if (buf == NULL) {
+            /* Settle for what has fit */
+            buf = lbuf;
+            len = sizeof(lbuf) - 1;
+        } else {
+            len = siplog_format_line(buf, len + 1, lp, tstamp, estr, fmt, ap);
+        }
     }
-    offset = siplog_lockf(fileno(f));
-    nbytes = fprintf(f, "%s/%s/%s[%d]: ", tstamp, lp->call_id, lp->app,
-      lp->pid);
-    nbytes += vfprintf(f, fmt, ap);
-    if (estr != NULL)
-	nbytes += fprintf(f, ": %s", estr);
-    nbytes += fprintf(f, "\n");
-    fflush(f);
-    siplog_unlockf(fileno(f), offset);
-    siplog_update_index(idx_id, fileno(f), offset, nbytes);
+    siplog_logfile_put(lp, idx_id, buf, len);
+    siplog_stats_bytes(len);
+    if (buf != lbuf)
+        free(buf);
+}
+
+static void
+siplog_logfile_writeb(struct loginfo *lp, int level __attribute__ ((unused)),
+  const char *idx_id, struct siplog_lbuf *lb)
+{
+
+    siplog_logfile_put(lp, idx_id, lb->data, lb->len);
+}
+
+static void
+siplog_logfile_writev(struct loginfo *lp, int level __attribute__ ((unused)),
+  const char *tstamp, const char *idx_id, const struct iovec *iov, int iovcnt)
+{
+    struct iovec v[SIPLOG_IOV_MAX + 2];
+    char prefix[512];
+    off_t offset;
+    size_t nbytes;
+    int fd, n;
+
+    fd = siplog_logfile_fd(lp);
+    if (fd == -1)
+        return;
+    n = siplog_iov_line(v, prefix, sizeof(prefix), lp, tstamp, iov, iovcnt,
+      &nbytes);
+    offset = siplog_lockf(fd);
+    writev(fd, v, n);
+    siplog_update_tsindex(fd, offset);
+    siplog_unlockf(fd, offset);
+    siplog_stats_bytes(nbytes);
+    siplog_update_index(idx_id, fd, offset, nbytes);
     if ((lp->flags & LF_REOPEN) != 0)
-	fclose(f);
+        siplog_closef(fd);
 }
 
 static void
@@ -199,7 +639,7 @@ siplog_logfile_close(struct loginfo *lp)
 {
 
     if ((lp->flags & LF_REOPEN) == 0)
-        fclose((FILE *)lp->private);
+        siplog_closef((int)(intptr_t)lp->private);
 }
 
 siplog_t
@@ -207,7 +647,9 @@ siplog_open(const char *app, const char *call_id, int flags)
 {
     int i;
     struct loginfo *lp;
+    struct bend *bp;
     const char *el, *sb;
+    size_t frsize;
 
     lp = malloc(sizeof(*lp));
     if (lp == NULL)
@@ -232,14 +674,14 @@ siplog_open(const char *app, const char *call_id, int flags)
 	free(lp);
 	return NULL;
     }
+    siplog_stats_init(lp->app);
 
     lp->bend = &(bends[0]);
     sb = getenv("SIPLOG_BEND");
-    for (i = 0; sb != NULL && bends[i].name != NULL; i++) {
-        if (strcmp(sb, bends[i].name) == 0) {
-            lp->bend = &(bends[i]);
-            break;
-        }
+    if (sb != NULL && siplog_fanout_spec(sb)) {
+        lp->bend = &siplog_fanout_bend;
+    } else if (sb != NULL && (bp = siplog_bend_byname(sb)) != NULL) {
+        lp->bend = bp;
     }
 
     lp->level = SIPLOG_DBUG;
@@ -252,6 +694,15 @@ siplog_open(const char *app, const char *call_id, int flags)
         }
     }
 
+    frsize = siplog_flightrec_size(flags);
+    if (frsize > 0) {
+        lp->flightrec = siplog_flightrec_alloc(frsize);
+        if (lp->flightrec == NULL) {
+            siplog_free(lp);
+            return NULL;
+        }
+    }
+
     /* Detect uninitialized access */
     lp->private = (void *)0x1;
     lp->pid = getpid();
@@ -282,21 +733,684 @@ siplog_set_level(siplog_t handle, int level)
     return oldlevel;
 } 
 
+static void siplog_replay_vprintf(struct siplog_lbuf **, struct loginfo *,
+  const char *, const char *, const char *, va_list);
+static void siplog_replay_appendv(struct siplog_lbuf **, struct loginfo *,
+  const char *, const struct iovec *, int);
+
+/*
+ * Pass the line on to the backend, unless a flight recorder replay is
+ * under way for the handle, in which case it goes into the same block.
+ */
+static void
+siplog_bend_vwrite(struct loginfo *lp, int level, const char *tstamp,
+  const char *estr, const char *idx_id, const char *fmt, va_list ap)
+{
+
+    if (siplog_replaying.lp == lp) {
+        siplog_replay_vprintf(&siplog_replaying.lb, lp, tstamp, estr, fmt,
+          ap);
+        return;
+    }
+    lp->bend->write(lp, level, tstamp, estr, idx_id, fmt, ap);
+}
+
+static void
+siplog_bend_writev(struct loginfo *lp, int level, const char *tstamp,
+  const char *idx_id, const struct iovec *iov, int iovcnt)
+{
+
+    if (siplog_replaying.lp == lp) {
+        siplog_replay_appendv(&siplog_replaying.lb, lp, tstamp, iov, iovcnt);
+        return;
+    }
+    lp->bend->writev(lp, level, tstamp, idx_id, iov, iovcnt);
+}
+
+static void
+siplog_bend_printf(struct loginfo *lp, int level, const char *tstamp,
+  const char *estr, const char *idx_id, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    siplog_bend_vwrite(lp, level, tstamp, estr, idx_id, fmt, ap);
+    va_end(ap);
+}
+
+static void
+siplog_report_repeats(struct loginfo *lp, int level, const char *tstamp,
+  const char *idx_id, int64_t nrepeats)
+{
+
+    siplog_bend_printf(lp, level, tstamp, NULL, idx_id,
+      "last message repeated %lld times", (long long)nrepeats);
+}
+
+/*
+ * Duplicate suppression state of the handle, allocated on first use so
+ * that siplog_set_dedup() covers handles opened before it too. NULL if
+ * that's not possible, the line is then logged as is.
+ */
+static struct siplog_dedup *
+siplog_dedup_state(struct loginfo *lp)
+{
+    struct siplog_dedup *dp, *odp;
+
+    dp = __atomic_load_n(&lp->dedup, __ATOMIC_ACQUIRE);
+    if (dp != NULL)
+        return (dp);
+    dp = siplog_dedup_alloc();
+    if (dp == NULL)
+        return (NULL);
+    odp = NULL;
+    if (!__atomic_compare_exchange_n(&lp->dedup, &odp, dp, 0,
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        /* Lost the race to another thread logging via the same handle */
+        siplog_dedup_free(dp);
+        return (odp);
+    }
+    return (dp);
+}
+
+/* Keep a line that is below the level of the handle in its flight recorder */
+static void
+siplog_capture(struct loginfo *lp, const char *estr, const char *idx_id,
+  const char *fmt, va_list ap)
+{
+    char tstamp[64];
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    siplog_timeToStr(&tv, tstamp);
+    siplog_flightrec_record(lp->flightrec, tstamp, estr, idx_id, fmt, ap);
+}
+
+/*
+ * Append a complete line to the block being replayed. Lines that there is
+ * no memory for are left out.
+ */
+static void
+siplog_replay_vprintf(struct siplog_lbuf **lbp, struct loginfo *lp,
+  const char *tstamp, const char *estr, const char *fmt, va_list ap)
+{
+    struct siplog_lbuf *lb, *nlb;
+    va_list aq;
+    size_t room;
+    int len;
+
+    lb = *lbp;
+    for (;;) {
+        room = lb->size - lb->len;
+        va_copy(aq, ap);
+        len = siplog_format_line(lb->data + lb->len, room, lp, tstamp, estr,
+          fmt, aq);
+        va_end(aq);
+        if (len < 0)
+            return;
+        if ((size_t)len < room)
+            break;
+        nlb = siplog_lbuf_grow(lb, MAX(lb->size * 2, lb->len + len + 1));
+        if (nlb == NULL)
+            return;
+        *lbp = lb = nlb;
+    }
+    lb->len += len;
+}
+
+/* Same for the pre-formatted data, prefix and newline are added */
+static void
+siplog_replay_appendv(struct siplog_lbuf **lbp, struct loginfo *lp,
+  const char *tstamp, const struct iovec *iov, int iovcnt)
+{
+    struct siplog_lbuf *lb, *nlb;
+    char prefix[512];
+    size_t plen, dlen;
+    int i, r;
+
+    r = snprintf(prefix, sizeof(prefix), "%s/%s/%s[%d]: ", tstamp,
+      lp->call_id, lp->app, lp->pid);
+    if (r < 0)
+        return;
+    plen = MIN((size_t)r, sizeof(prefix) - 1);
+    dlen = 0;
+    for (i = 0; i < iovcnt; i++)
+        dlen += iov[i].iov_len;
+    lb = *lbp;
+    if (lb->len + plen + dlen + 2 > lb->size) {
+        nlb = siplog_lbuf_grow(lb, MAX(lb->size * 2,
+          lb->len + plen + dlen + 2));
+        if (nlb == NULL)
+            return;
+        *lbp = lb = nlb;
+    }
+    memcpy(lb->data + lb->len, prefix, plen);
+    siplog_iov_flatten(lb->data + lb->len + plen, dlen + 1, iov, iovcnt);
+    lb->data[lb->len + plen + dlen] = '\n';
+    lb->len += plen + dlen + 1;
+}
+
+static void
+siplog_replay_printf(struct siplog_lbuf **lbp, struct loginfo *lp,
+  const char *tstamp, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    siplog_replay_vprintf(lbp, lp, tstamp, NULL, fmt, ap);
+    va_end(ap);
+}
+
+static void
+siplog_replay_one(void *arg, const char *tstamp,
+  const char *idx_id __attribute__ ((unused)), const char *msg)
+{
+    struct siplog_replay *rp;
+
+    rp = (struct siplog_replay *)arg;
+    siplog_replay_printf(&rp->lb, rp->lp, tstamp, "%s", msg);
+}
+
+/*
+ * Empty the flight recorder of the handle into a single block, so that it
+ * goes to the backend as one record: either all of it gets written out or
+ * none, and nothing from other threads gets in between. NULL if there is
+ * nothing to replay.
+ */
+static struct siplog_lbuf *
+siplog_replay_block(struct loginfo *lp)
+{
+    struct siplog_replay r;
+    int active;
+
+    r.lp = lp;
+    r.lb = siplog_lbuf_alloc(SIPLOG_REPLAY_LEN);
+    if (r.lb == NULL)
+        return (NULL);
+    r.lb->flags |= SIPLOG_LBUF_REPLAY;
+    /* Not to be put down to the call site that has triggered the replay */
+    active = siplog_site_acct.active;
+    siplog_site_acct.active = 0;
+    siplog_flightrec_drain(lp->flightrec, siplog_replay_one, &r);
+    siplog_site_acct.active = active;
+    if (r.lb->len == 0) {
+        siplog_lbuf_release(r.lb);
+        return (NULL);
+    }
+    return (r.lb);
+}
+
+/*
+ * Start replaying the flight recorder ahead of a line at ERR or above:
+ * whatever is logged via the handle on this thread from now on up until
+ * siplog_replay_end() goes into the same block, right after the replayed
+ * lines. Returns 0 if there is nothing to replay.
+ */
+static int
+siplog_replay_begin(struct loginfo *lp)
+{
+    struct siplog_lbuf *lb;
+
+    if (lp->flightrec == NULL)
+        return (0);
+    lb = siplog_replay_block(lp);
+    if (lb == NULL)
+        return (0);
+    siplog_replaying.lp = lp;
+    siplog_replaying.lb = lb;
+    return (1);
+}
+
+/*
+ * Hand the block over to the backend as a single record with the level of
+ * the line that has triggered the replay, so that the async ones queue it
+ * on the same lane. Replayed lines are indexed as a whole, under the
+ * call-id of that line.
+ */
+static void
+siplog_replay_end(int level, const char *idx_id)
+{
+    struct siplog_replay r;
+
+    r = siplog_replaying;
+    siplog_replaying.lp = NULL;
+    siplog_replaying.lb = NULL;
+    siplog_stats_bytes(r.lb->len);
+    r.lp->bend->writeb(r.lp, level, idx_id, r.lb);
+    siplog_lbuf_release(r.lb);
+}
+
+static void
+siplog_capture_printf(struct loginfo *lp, const char *idx_id,
+  const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    siplog_capture(lp, NULL, idx_id, fmt, ap);
+    va_end(ap);
+}
+
 void
-siplog_write_va(int level, siplog_t handle, const char *fmt, va_list ap)
+siplog_flightrec_flush(siplog_t handle)
 {
     struct loginfo *lp;
+
+    lp = (struct loginfo *)handle;
+    if (lp == NULL || lp->bend == NULL || lp->flightrec == NULL)
+        return;
+    /* Only lines below the level of the handle end up in the recorder */
+    if (siplog_replay_begin(lp))
+        siplog_replay_end(SIPLOG_DBUG,
+          (lp->call_id_global != 0) ? NULL : lp->call_id);
+}
+
+/*
+ * Common tail of all the siplog_*write*() functions, called once the
+ * level has been checked.
+ */
+static void
+siplog_dispatch(struct loginfo *lp, int level, const char *estr,
+  const char *idx_id, const char *fmt, va_list ap)
+{
+    char tstamp[64];
+    char mbuf[SIPLOG_DEDUP_MSG_LEN];
+    struct timeval tv;
+    struct siplog_dedup *dp;
+    int64_t nsuppressed, nrepeats;
+    va_list aq;
+    int len, replaying;
+
+    replaying = (level >= SIPLOG_ERR && siplog_replay_begin(lp));
+    if (siplog_rl_check(level, fmt, &nsuppressed) == 0)
+        goto out;
+    siplog_stats_line(level);
+    gettimeofday(&tv, NULL);
+    siplog_timeToStr(&tv, tstamp);
+    if (nsuppressed > 0) {
+        siplog_bend_printf(lp, level, tstamp, NULL, idx_id,
+          "libsiplog: %lld message(s) like \"%s\" were rate limited",
+          (long long)nsuppressed, fmt);
+    }
+    if (siplog_dedup_enabled(level) == 0 ||
+      (dp = siplog_dedup_state(lp)) == NULL) {
+        siplog_bend_vwrite(lp, level, tstamp, estr, idx_id, fmt, ap);
+        goto out;
+    }
+    va_copy(aq, ap);
+    len = vsnprintf(mbuf, sizeof(mbuf), fmt, aq);
+    va_end(aq);
+    if (len < 0 || (size_t)len >= sizeof(mbuf)) {
+        /* Too long to bother, log as is */
+        siplog_bend_vwrite(lp, level, tstamp, estr, idx_id, fmt, ap);
+        goto out;
+    }
+    if (siplog_dedup_check(dp, level, mbuf, len, estr, &nrepeats) != 0)
+        goto out;
+    if (nrepeats > 0)
+        siplog_report_repeats(lp, level, tstamp, idx_id, nrepeats);
+    siplog_bend_printf(lp, level, tstamp, estr, idx_id, "%s", mbuf);
+out:
+    if (replaying)
+        siplog_replay_end(level, idx_id);
+}
+
+static void
+siplog_report_suppressed(struct loginfo *lp, int level, const char *tstamp,
+  const char *idx_id, int64_t nsuppressed)
+{
+
+    siplog_bend_printf(lp, level, tstamp, NULL, idx_id,
+      "libsiplog: %lld message(s) from the same call site were rate "
+      "limited", (long long)nsuppressed);
+}
+
+static void siplog_emitv(struct loginfo *, int, const char *, const char *,
+  const struct iovec *, int);
+
+/*
+ * Same as siplog_dispatch(), for the data that comes pre-formatted. The
+ * rate limiter tells call sites apart by the site pointer. Only the lines
+ * that are short enough are checked for duplicates.
+ */
+static void
+siplog_dispatchv(struct loginfo *lp, int level, const char *idx_id,
+  const struct iovec *iov, int iovcnt, const void *site)
+{
     char tstamp[64];
     struct timeval tv;
+    int64_t nsuppressed;
+    int replaying;
+
+    replaying = (level >= SIPLOG_ERR && siplog_replay_begin(lp));
+    if (siplog_rl_check(level, site, &nsuppressed) != 0) {
+        siplog_stats_line(level);
+        gettimeofday(&tv, NULL);
+        siplog_timeToStr(&tv, tstamp);
+        if (nsuppressed > 0)
+            siplog_report_suppressed(lp, level, tstamp, idx_id, nsuppressed);
+        siplog_emitv(lp, level, tstamp, idx_id, iov, iovcnt);
+    }
+    if (replaying)
+        siplog_replay_end(level, idx_id);
+}
+
+/* Pass pre-formatted data on to the backend, dropping duplicates */
+static void
+siplog_emitv(struct loginfo *lp, int level, const char *tstamp,
+  const char *idx_id, const struct iovec *iov, int iovcnt)
+{
+    char mbuf[SIPLOG_DEDUP_MSG_LEN];
+    struct siplog_dedup *dp;
+    int64_t nrepeats;
+    size_t len;
+
+    if (siplog_dedup_enabled(level) != 0 &&
+      (dp = siplog_dedup_state(lp)) != NULL) {
+        len = siplog_iov_flatten(mbuf, sizeof(mbuf), iov, iovcnt);
+        if (len < sizeof(mbuf)) {
+            if (siplog_dedup_check(dp, level, mbuf, len, NULL,
+              &nrepeats) != 0)
+                return;
+            if (nrepeats > 0)
+                siplog_report_repeats(lp, level, tstamp, idx_id, nrepeats);
+        }
+    }
+    if (siplog_site_acct.active)
+        siplog_site_emittedv(iov, iovcnt);
+    siplog_bend_writev(lp, level, tstamp, idx_id, iov, iovcnt);
+}
+
+void
+siplog_writev_common(int level, struct loginfo *lp, const char *idx_id,
+  const struct iovec *iov, int iovcnt, const void *site)
+{
+    char mbuf[SIPLOG_FLIGHTREC_MSG_LEN];
+
+    if (lp == NULL || lp->bend == NULL || iovcnt < 0 ||
+      iovcnt > SIPLOG_IOV_MAX)
+        return;
+    if (level >= lp->level) {
+        siplog_dispatchv(lp, level, idx_id, iov, iovcnt, site);
+    } else if (lp->flightrec != NULL) {
+        siplog_iov_flatten(mbuf, sizeof(mbuf), iov, iovcnt);
+        siplog_capture_printf(lp, idx_id, "%s", mbuf);
+    }
+}
+
+/*
+ * Log data that has already been formatted by the caller, without a
+ * trailing newline. Nothing is parsed, the data is copied into the queue
+ * once or handed over to writev(2) directly, depending on the backend.
+ */
+void
+siplog_writev(int level, siplog_t handle, const struct iovec *iov, int iovcnt)
+{
+    struct loginfo *lp;
+
+    lp = (struct loginfo *)handle;
+    if (lp == NULL)
+        return;
+    siplog_writev_common(level, lp,
+      (lp->call_id_global != 0) ? NULL : lp->call_id, iov, iovcnt,
+      __builtin_return_address(0));
+}
+
+void
+siplog_iwritev(int level, siplog_t handle, const char *idx_id,
+  const struct iovec *iov, int iovcnt)
+{
+
+    siplog_writev_common(level, (struct loginfo *)handle, idx_id, iov, iovcnt,
+      __builtin_return_address(0));
+}
+
+/*
+ * Same as siplog_writev(), except that the rate limiter tells call sites
+ * apart by key instead of the return address, which is the same for all
+ * the lines that go through a common wrapper, e.g. siplog.hpp. Any
+ * pointer that is unique to the call site will do.
+ */
+void
+siplog_kwritev(int level, siplog_t handle, const void *key,
+  const struct iovec *iov, int iovcnt)
+{
+    struct loginfo *lp;
+
+    lp = (struct loginfo *)handle;
+    if (lp == NULL)
+        return;
+    siplog_writev_common(level, lp,
+      (lp->call_id_global != 0) ? NULL : lp->call_id, iov, iovcnt, key);
+}
+
+static void
+siplog_resv_abandon(struct siplog_resv *rp)
+{
+
+    if (rp->cookie != NULL)
+        rp->lp->bend->abandon(rp->lp, rp->cookie);
+    else if (rp->buf != siplog_resv_buf)
+        free(rp->buf);
+    if (rp->replay != NULL) {
+        /* Not the line, but its context still goes out */
+        siplog_replaying.lp = rp->lp;
+        siplog_replaying.lb = rp->replay;
+        rp->replay = NULL;
+        siplog_replay_end(rp->level, rp->idx_id);
+    }
+    rp->lp = NULL;
+}
+
+/*
+ * Reserve room for a line of up to size bytes, to be formatted in place
+ * by the caller and published with siplog_commit(). For the backends that
+ * support it that's the queue item itself, with the prefix already filled
+ * in, otherwise a per-thread buffer. Returns NULL if the line is not going
+ * to be logged, in which case there is nothing to commit.
+ *
+ * Only one reservation per thread can be outstanding: a new one, as well
+ * as siplog_close() of the handle, abandons it, so does siplog_abandon().
+ * A new one for the same handle, level and call site replaces it without
+ * going through the rate limiter again, so that a line that has turned
+ * out not to fit can be retried with more room and is still only counted
+ * once.
+ */
+static char *
+siplog_reserve_common(int level, struct loginfo *lp, size_t size,
+  const void *site)
+{
+    struct siplog_resv *rp;
+    struct siplog_lbuf *replay;
+    struct timeval tv;
     const char *idx_id;
+    int64_t nsuppressed;
+    int below, retry;
+
+    rp = &siplog_resv;
+    retry = 0;
+    replay = NULL;
+    if (rp->lp != NULL) {
+        retry = (rp->lp == lp && rp->level == level && rp->site == site);
+        if (retry) {
+            /* Goes out with the line that replaces this one */
+            replay = rp->replay;
+            rp->replay = NULL;
+        }
+        siplog_resv_abandon(rp);
+    }
+    if (lp == NULL || lp->bend == NULL)
+        return (NULL);
+    below = (level < lp->level);
+    if (below && lp->flightrec == NULL)
+        return (NULL);
+    idx_id = (lp->call_id_global != 0) ? NULL : lp->call_id;
+    nsuppressed = 0;
+    if (replay != NULL) {
+        siplog_replaying.lp = lp;
+        siplog_replaying.lb = replay;
+    } else if (!below && !retry) {
+        if (level >= SIPLOG_ERR)
+            siplog_replay_begin(lp);
+        if (siplog_rl_check(level, site, &nsuppressed) == 0)
+            goto e0;
+    }
+    gettimeofday(&tv, NULL);
+    siplog_timeToStr(&tv, rp->tstamp);
+    if (nsuppressed > 0)
+        siplog_report_suppressed(lp, level, rp->tstamp, idx_id, nsuppressed);
+
+    rp->level = level;
+    rp->site = site;
+    rp->idx_id = idx_id;
+    rp->size = size;
+    rp->cookie = NULL;
+    /* Line that comes with a replay has to go into the same block */
+    if (!below && lp->bend->reserve != NULL && siplog_replaying.lp == NULL &&
+      siplog_dedup_enabled(level) == 0) {
+        rp->buf = lp->bend->reserve(lp, level, rp->tstamp, idx_id, size,
+          &rp->cookie);
+    } else if (size <= sizeof(siplog_resv_buf)) {
+        rp->buf = siplog_resv_buf;
+    } else {
+        rp->buf = malloc(size);
+    }
+    if (rp->buf == NULL)
+        goto e0;
+    /* Kept with the reservation until it's committed or abandoned */
+    rp->replay = siplog_replaying.lb;
+    siplog_replaying.lp = NULL;
+    siplog_replaying.lb = NULL;
+    rp->lp = lp;
+    return (rp->buf);
+e0:
+    if (siplog_replaying.lp != NULL)
+        siplog_replay_end(level, idx_id);
+    return (NULL);
+}
+
+char *
+siplog_reserve(int level, siplog_t handle, size_t size)
+{
 
+    return (siplog_reserve_common(level, (struct loginfo *)handle, size,
+      __builtin_return_address(0)));
+}
+
+/*
+ * Same as siplog_reserve(), with the rate limiter key passed in, see
+ * siplog_kwritev().
+ */
+char *
+siplog_kreserve(int level, siplog_t handle, const void *key, size_t size)
+{
+
+    return (siplog_reserve_common(level, (struct loginfo *)handle, size,
+      key));
+}
+
+/*
+ * Publish len bytes formatted into the buffer returned by the last
+ * siplog_reserve() on this thread, without a trailing newline.
+ */
+void
+siplog_commit(siplog_t handle, size_t len)
+{
+    struct siplog_resv *rp;
+    struct loginfo *lp;
+    struct iovec iov;
+
+    rp = &siplog_resv;
     lp = (struct loginfo *)handle;
-    if (lp == NULL || lp->bend == NULL || level < lp->level)
+    if (lp == NULL || rp->lp != lp)
+        return;
+    rp->lp = NULL;
+    len = MIN(len, rp->size);
+    if (rp->level >= lp->level)
+        siplog_stats_line(rp->level);
+    if (rp->cookie != NULL) {
+        lp->bend->commit(lp, rp->cookie, len);
+        return;
+    }
+    if (rp->replay != NULL) {
+        siplog_replaying.lp = lp;
+        siplog_replaying.lb = rp->replay;
+        rp->replay = NULL;
+    }
+    if (rp->level < lp->level) {
+        siplog_capture_printf(lp, rp->idx_id, "%.*s", (int)len, rp->buf);
+    } else {
+        iov.iov_base = rp->buf;
+        iov.iov_len = len;
+        siplog_emitv(lp, rp->level, rp->tstamp, rp->idx_id, &iov, 1);
+    }
+    if (siplog_replaying.lp != NULL)
+        siplog_replay_end(rp->level, rp->idx_id);
+    if (rp->buf != siplog_resv_buf)
+        free(rp->buf);
+}
+
+void
+siplog_abandon(siplog_t handle)
+{
+
+    if (handle != NULL && siplog_resv.lp == (struct loginfo *)handle)
+        siplog_resv_abandon(&siplog_resv);
+}
+
+/* Report any pending duplicates before the handle goes idle or away */
+static void
+siplog_dedup_report(struct loginfo *lp)
+{
+    char tstamp[64];
+    struct siplog_dedup *dp;
+    struct timeval tv;
+    int64_t nrepeats;
+
+    dp = __atomic_load_n(&lp->dedup, __ATOMIC_ACQUIRE);
+    if (dp == NULL)
+        return;
+    nrepeats = siplog_dedup_flush(dp);
+    if (nrepeats == 0)
         return;
     gettimeofday(&tv, NULL);
     siplog_timeToStr(&tv, tstamp);
+    siplog_report_repeats(lp, SIPLOG_INFO, tstamp,
+      (lp->call_id_global != 0) ? NULL : lp->call_id, nrepeats);
+}
+
+/*
+ * Check if a line with the given level is going to be used by the handle,
+ * either logged or captured by the flight recorder, so that callers can
+ * avoid preparing it otherwise.
+ */
+int
+siplog_enabled(int level, siplog_t handle)
+{
+    struct loginfo *lp;
+
+    lp = (struct loginfo *)handle;
+    if (lp == NULL || lp->bend == NULL)
+        return (0);
+    return (level >= lp->level || lp->flightrec != NULL);
+}
+
+void
+siplog_write_va(int level, siplog_t handle, const char *fmt, va_list ap)
+{
+    struct loginfo *lp;
+    const char *idx_id;
+
+    lp = (struct loginfo *)handle;
+    if (lp == NULL || lp->bend == NULL)
+        return;
     idx_id = (lp->call_id_global != 0) ? NULL : lp->call_id;
-    lp->bend->write(lp, tstamp, NULL, idx_id, fmt, ap);
+    if (level < lp->level) {
+        if (lp->flightrec != NULL)
+            siplog_capture(lp, NULL, idx_id, fmt, ap);
+        return;
+    }
+    siplog_dispatch(lp, level, NULL, idx_id, fmt, ap);
 }
 
 void
@@ -310,20 +1424,29 @@ siplog_write(int level, siplog_t handle, const char *fmt, ...)
 }
 
 void
-siplog_iwrite(int level, siplog_t handle, const char *idx_id, const char *fmt, ...)
+siplog_iwrite_va(int level, siplog_t handle, const char *idx_id,
+  const char *fmt, va_list ap)
 {
     struct loginfo *lp;
-    char tstamp[64];
-    struct timeval tv;
-    va_list ap;
 
     lp = (struct loginfo *)handle;
-    if (lp == NULL || lp->bend == NULL || level < lp->level)
+    if (lp == NULL || lp->bend == NULL)
         return;
-    gettimeofday(&tv, NULL);
-    siplog_timeToStr(&tv, tstamp);
+    if (level < lp->level) {
+        if (lp->flightrec != NULL)
+            siplog_capture(lp, NULL, idx_id, fmt, ap);
+        return;
+    }
+    siplog_dispatch(lp, level, NULL, idx_id, fmt, ap);
+}
+
+void
+siplog_iwrite(int level, siplog_t handle, const char *idx_id, const char *fmt, ...)
+{
+    va_list ap;
+
     va_start(ap, fmt);
-    lp->bend->write(lp, tstamp, NULL, idx_id, fmt, ap);
+    siplog_iwrite_va(level, handle, idx_id, fmt, ap);
     va_end(ap);
 }
 
@@ -331,24 +1454,23 @@ void
 siplog_ewrite_va(int level, siplog_t handle, const char *fmt, va_list ap)
 {
     struct loginfo *lp;
-    char tstamp[64];
     char ebuf[256];
-    struct timeval tv;
     int errno_bak;
     const char *idx_id;
 
     lp = (struct loginfo *)handle;
-    if (lp == NULL || level < lp->level)
+    if (lp == NULL || (level < lp->level && lp->flightrec == NULL))
         return;
     errno_bak = errno;
     if (strerror_r(errno, ebuf, sizeof(ebuf)) != 0) {
 	errno = errno_bak;
 	return;
     }
-    gettimeofday(&tv, NULL);
-    siplog_timeToStr(&tv, tstamp);
     idx_id = (lp->call_id_global != 0) ? NULL : lp->call_id;
-    lp->bend->write(lp, tstamp, ebuf, idx_id, fmt, ap);
+    if (level < lp->level)
+        siplog_capture(lp, ebuf, idx_id, fmt, ap);
+    else
+        siplog_dispatch(lp, level, ebuf, idx_id, fmt, ap);
     errno = errno_bak;
 }
 
@@ -371,6 +1493,9 @@ siplog_close(siplog_t handle)
     lp = (struct loginfo *)handle;
     if (lp == NULL)
         return;
+    siplog_abandon(lp);
+    siplog_dedup_report(lp);
+    siplog_stats_publish(0);
     free_after_close = lp->bend->free_after_close;
     lp->bend->close(lp);
     if (free_after_close) {
@@ -384,28 +1509,61 @@ siplog_hbeat(siplog_t handle)
     struct loginfo *lp;
 
     lp = (struct loginfo *)handle;
-    if (lp == NULL || lp->bend->hbeat == NULL)
+    if (lp == NULL)
+        return;
+    siplog_dedup_report(lp);
+    siplog_stats_publish(0);
+    if (lp->bend->hbeat == NULL)
         return;
     lp->bend->hbeat(lp);
 }
 
+/*
+ * Tell an event loop what it has to watch to call siplog_hbeat() in time
+ * for the backend of the handle: returns a descriptor to poll for input,
+ * -1 if none, and stores the longest it can wait in ms, -1 for no limit,
+ * into timeout.
+ */
+int
+siplog_hbeat_hint(siplog_t handle, int *timeout)
+{
+    struct loginfo *lp;
+
+    lp = (struct loginfo *)handle;
+    *timeout = -1;
+    if (lp == NULL || lp->bend == NULL || lp->bend->hint == NULL)
+        return (-1);
+    return (lp->bend->hint(lp, timeout));
+}
+
 void
 siplog_free(struct loginfo *lp)
 {
 
+    if (lp->dedup != NULL)
+        siplog_dedup_free(lp->dedup);
+    if (lp->flightrec != NULL)
+        siplog_flightrec_free(lp->flightrec);
     free(lp->call_id);
     free(lp->app);
     free(lp);
 }
 
+/*
+ * Lock the whole file against other writers, processes and threads alike,
+ * and return the offset at which the next append is going to land, i.e.
+ * the end of the file, which the offset of the descriptor itself is not
+ * once somebody else has appended to it.
+ */
 off_t
 siplog_lockf(int fd)
 {
     struct flock l;
     int rval;
 
+    pthread_mutex_lock(&siplog_lockf_mutex);
     memset(&l, '\0', sizeof(l));
-    l.l_whence = SEEK_CUR;
+    l.l_whence = SEEK_SET;
     l.l_type = F_WRLCK;
     do {
         rval = fcntl(fd, F_SETLKW, &l);
@@ -413,18 +1571,17 @@ siplog_lockf(int fd)
 #if defined(PEDANTIC)
     assert(rval != -1);
 #endif
-    return lseek(fd, 0, SEEK_CUR);
+    return lseek(fd, 0, SEEK_END);
 }
 
 void
-siplog_unlockf(int fd, off_t offset)
+siplog_unlockf(int fd, off_t offset __attribute__ ((unused)))
 {
     struct flock l;
     int rval;
 
     memset(&l, '\0', sizeof(l));
     l.l_whence = SEEK_SET;
-    l.l_start = offset;
     l.l_type = F_UNLCK;
     do {
         rval = fcntl(fd, F_SETLKW, &l);
@@ -432,4 +1589,19 @@ siplog_unlockf(int fd, off_t offset)
 #if defined(PEDANTIC)
     assert(rval != -1);
 #endif
+    pthread_mutex_unlock(&siplog_lockf_mutex);
+}
+
+/*
+ * Closing any descriptor of a file releases all the locks the process
+ * holds on it, including the one that another thread may have just taken
+ * with siplog_lockf(), so log files are only closed in between.
+ */
+void
+siplog_closef(int fd)
+{
+
+    pthread_mutex_lock(&siplog_lockf_mutex);
+    close(fd);
+    pthread_mutex_unlock(&siplog_lockf_mutex);
 }
@@ -22,8 +22,18 @@ typedef void * siplog_t;
 #define	SIPLOG_ALL	SIPLOG_INFO	/* XXX */
 
 #define LF_REOPEN	1
+#define LF_FLIGHTREC	2
+
+/* Longest iovec array accepted by siplog_writev() and siplog_iwritev() */
+#define SIPLOG_IOV_MAX	64
+
+/* What siplog_sites_dumptop() ranks the call sites by */
+#define SIPLOG_SITES_BYTES	0
+#define SIPLOG_SITES_TIME	1
+#define SIPLOG_SITES_LINES	2
 
 #include <stdarg.h>	/* Needed for the va_list */
+#include <sys/uio.h>	/* Needed for the struct iovec */
 
 #ifdef __cplusplus
 extern "C" {
@@ -32,16 +42,35 @@ extern "C" {
 siplog_t siplog_open(const char *app, const char *call_id, int flags);
 int	 siplog_set_level(siplog_t handle, int level);
 #define	 siplog_get_level(handle) siplog_set_level((handle), -1)
+int	 siplog_enabled(int level, siplog_t handle);
 void	 siplog_write(int level, siplog_t handle, const char *format, ...);
 void	 siplog_write_va(int level, siplog_t handle, const char *format, va_list);
 void	 siplog_ewrite(int level, siplog_t handle, const char *format, ...);
 void	 siplog_ewrite_va(int level, siplog_t handle, const char *format, va_list);
 void	 siplog_iwrite(int level, siplog_t handle, const char *, const char *format, ...);
+void	 siplog_writev(int level, siplog_t handle, const struct iovec *, int);
+void	 siplog_iwritev(int level, siplog_t handle, const char *,
+	     const struct iovec *, int);
+void	 siplog_kwritev(int level, siplog_t handle, const void *key,
+	     const struct iovec *, int);
+char	*siplog_reserve(int level, siplog_t handle, size_t size);
+char	*siplog_kreserve(int level, siplog_t handle, const void *key,
+	     size_t size);
+void	 siplog_commit(siplog_t handle, size_t len);
+void	 siplog_abandon(siplog_t handle);
 void	 siplog_close(siplog_t handle);
 void	 siplog_hbeat(siplog_t handle);
+int	 siplog_hbeat_hint(siplog_t handle, int *timeout);
+int	 siplog_set_ratelimit(int level, int rate, int burst);
+int	 siplog_set_dedup(int level, int onoff);
+void	 siplog_flightrec_flush(siplog_t handle);
+unsigned long siplog_queue_drops(int level);
+int	 siplog_sites_dumptop(int level, siplog_t handle, int topn, int order);
 
 int      siplog_memdeb_dumpstats(int level, siplog_t handle);
+int      siplog_memdeb_dumptop(int level, siplog_t handle, int topn);
 void     siplog_memdeb_setbaseln(void);
+unsigned long siplog_memdeb_setsampling(unsigned long rate);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Header-only C++20 front end to libsiplog.
+ *
+ *   siplog::log log("b2bua", call_id);
+ *   log.dbug("got {} from {}, cseq {:x}", method, peer, cseq);
+ *
+ * Format strings use "{}" placeholders ("{:x}" and "{:X}" for integers,
+ * "{{" and "}}" for literal braces) and are parsed at compile time: wrong
+ * number of arguments, unknown format spec, or an argument that can't be
+ * formatted are all compile errors. Arguments are formatted without any
+ * heap allocations or printf-style parsing straight into the space
+ * reserved with siplog_kreserve(), which for the async backends is the
+ * queue item itself. Lines that turn out not to fit are formatted again
+ * into a reservation of line_max bytes that replaces the first one. Lines
+ * that the handle would drop anyway are not formatted at all. The rate
+ * limiter tells call sites apart by their format strings and only counts
+ * every line once.
+ */
+
+#ifndef _SIPLOG_HPP_
+#define _SIPLOG_HPP_
+
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "siplog.h"
+
+namespace siplog {
+
+/* Longest line the front end formats, anything beyond is truncated */
+inline constexpr std::size_t line_max = 8 * 1024;
+/* How much to reserve in the queue up front */
+inline constexpr std::size_t line_reserve = 2 * 1024;
+
+namespace detail {
+
+class buffer {
+public:
+    buffer(char *buf, std::size_t size) noexcept : buf_(buf), size_(size) {}
+
+    void append(const char *s, std::size_t n) noexcept {
+        if (n > size_ - len_) {
+            n = size_ - len_;
+            overflow_ = true;
+        }
+        std::memcpy(buf_ + len_, s, n);
+        len_ += n;
+    }
+    void append(std::string_view sv) noexcept { append(sv.data(), sv.size()); }
+    void append(char c) noexcept {
+        if (len_ < size_)
+            buf_[len_++] = c;
+        else
+            overflow_ = true;
+    }
+    template <typename T>
+    void append_chars(T v) noexcept {
+        char tmp[128];
+        auto r = std::to_chars(tmp, tmp + sizeof(tmp), v);
+        append(tmp, r.ptr - tmp);
+    }
+    template <typename T>
+    void append_chars(T v, int base, bool upper = false) noexcept {
+        char tmp[128];
+        auto r = std::to_chars(tmp, tmp + sizeof(tmp), v, base);
+        if (upper) {
+            for (char *cp = tmp; cp < r.ptr; cp++) {
+                if (*cp >= 'a' && *cp <= 'f')
+                    *cp -= 'a' - 'A';
+            }
+        }
+        append(tmp, r.ptr - tmp);
+    }
+    const char *data() const noexcept { return buf_; }
+    std::size_t size() const noexcept { return len_; }
+    bool overflow() const noexcept { return overflow_; }
+
+private:
+    char *buf_;
+    std::size_t size_;
+    std::size_t len_ = 0;
+    bool overflow_ = false;
+};
+
+enum class spec { none, hex, hex_upper };
+
+template <typename T>
+using bare_t = std::remove_cvref_t<T>;
+
+template <typename T>
+concept string_like = std::is_convertible_v<const T &, std::string_view> ||
+  std::is_same_v<std::decay_t<T>, const char *> ||
+  std::is_same_v<std::decay_t<T>, char *>;
+
+template <typename T>
+concept integer = std::is_integral_v<T> && !std::is_same_v<T, bool> &&
+  !std::is_same_v<T, char>;
+
+template <typename T>
+concept formattable = string_like<T> || integer<T> ||
+  std::is_floating_point_v<T> || std::is_same_v<T, bool> ||
+  std::is_same_v<T, char> || std::is_enum_v<T> || std::is_pointer_v<T> ||
+  std::is_null_pointer_v<T>;
+
+template <typename T>
+inline constexpr bool takes_hex = integer<T> || std::is_enum_v<T>;
+
+/* Not constexpr on purpose: reaching it from a consteval context fails */
+inline void format_error(const char *) {}
+
+struct placeholder {
+    std::size_t next;       /* where the literal text after it starts */
+    spec sp;
+};
+
+/*
+ * Scan fmt from pos, handing literal text to out(const char *, size_t)
+ * and stopping at the next placeholder. Returns false on end of string.
+ */
+template <typename F>
+constexpr bool
+next_placeholder(std::string_view fmt, std::size_t &pos, placeholder &ph,
+  F &&out)
+{
+    std::size_t start = pos;
+
+    while (pos < fmt.size()) {
+        char c = fmt[pos];
+        if (c == '{' || c == '}') {
+            out(fmt.data() + start, pos - start);
+            if (pos + 1 < fmt.size() && fmt[pos + 1] == c) {
+                out(fmt.data() + pos, 1);
+                pos += 2;
+                start = pos;
+                continue;
+            }
+            if (c == '}')
+                format_error("unmatched '}' in format string");
+            std::size_t end = fmt.find('}', pos);
+            if (end == std::string_view::npos)
+                format_error("unterminated placeholder in format string");
+            std::string_view sv = fmt.substr(pos + 1, end - pos - 1);
+            if (sv.empty())
+                ph.sp = spec::none;
+            else if (sv == ":x")
+                ph.sp = spec::hex;
+            else if (sv == ":X")
+                ph.sp = spec::hex_upper;
+            else
+                format_error("unsupported format spec");
+            ph.next = end + 1;
+            pos = end + 1;
+            return true;
+        }
+        pos++;
+    }
+    out(fmt.data() + start, pos - start);
+    return false;
+}
+
+template <typename... Args>
+consteval void
+check_format(std::string_view fmt)
+{
+    constexpr bool hex_ok[] = {takes_hex<bare_t<Args>>..., false};
+    std::size_t pos = 0, nargs = 0;
+    placeholder ph{};
+
+    while (next_placeholder(fmt, pos, ph, [](const char *, std::size_t) {})) {
+        if (nargs == sizeof...(Args))
+            format_error("more placeholders than arguments");
+        if (ph.sp != spec::none && !hex_ok[nargs])
+            format_error("hex format spec used with non-integer argument");
+        nargs++;
+    }
+    if (nargs != sizeof...(Args))
+        format_error("more arguments than placeholders");
+}
+
+template <typename T>
+void
+format_arg(buffer &b, const T &v, spec sp) noexcept
+{
+    using U = bare_t<T>;
+
+    if constexpr (std::is_same_v<U, bool>) {
+        b.append(v ? std::string_view("true") : std::string_view("false"));
+    } else if constexpr (std::is_same_v<U, char>) {
+        b.append(v);
+    } else if constexpr (std::is_null_pointer_v<U>) {
+        b.append(std::string_view("(null)"));
+    } else if constexpr (std::is_same_v<std::decay_t<U>, const char *> ||
+      std::is_same_v<std::decay_t<U>, char *>) {
+        const char *cp = v;
+        b.append(cp != nullptr ? std::string_view(cp) :
+          std::string_view("(null)"));
+    } else if constexpr (std::is_convertible_v<const U &, std::string_view>) {
+        b.append(std::string_view(v));
+    } else if constexpr (std::is_enum_v<U>) {
+        format_arg(b, static_cast<std::underlying_type_t<U>>(v), sp);
+    } else if constexpr (integer<U>) {
+        if (sp == spec::none)
+            b.append_chars(v);
+        else
+            b.append_chars(v, 16, sp == spec::hex_upper);
+    } else if constexpr (std::is_floating_point_v<U>) {
+        b.append_chars(v);
+    } else if constexpr (std::is_pointer_v<U>) {
+        b.append(std::string_view("0x"));
+        b.append_chars(reinterpret_cast<std::uintptr_t>(v), 16);
+    }
+}
+
+template <typename T>
+void
+format_step(buffer &b, std::string_view fmt, std::size_t &pos, const T &v)
+{
+    placeholder ph{};
+    auto out = [&b](const char *s, std::size_t n) { b.append(s, n); };
+
+    if (next_placeholder(fmt, pos, ph, out))
+        format_arg(b, v, ph.sp);
+}
+
+template <typename... Args>
+void
+format_to(buffer &b, std::string_view fmt, const Args &...args)
+{
+    std::size_t pos = 0;
+    placeholder ph{};
+
+    (format_step(b, fmt, pos, args), ...);
+    next_placeholder(fmt, pos, ph,
+      [&b](const char *s, std::size_t n) { b.append(s, n); });
+}
+
+} /* namespace detail */
+
+template <typename... Args>
+struct basic_format_string {
+    template <typename S>
+      requires std::is_convertible_v<const S &, std::string_view>
+    consteval basic_format_string(const S &s) : str(s) {
+        detail::check_format<Args...>(str);
+    }
+    std::string_view str;
+};
+
+template <typename... Args>
+using format_string = basic_format_string<std::type_identity_t<Args>...>;
+
+class log {
+public:
+    log(const char *app, const char *call_id = nullptr, int flags = 0) noexcept
+      : h_(siplog_open(app, call_id, flags)) {}
+    explicit log(siplog_t h) noexcept : h_(h) {}
+    ~log() { reset(); }
+
+    log(const log &) = delete;
+    log &operator=(const log &) = delete;
+    log(log &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+    log &operator=(log &&o) noexcept {
+        if (this != &o) {
+            reset();
+            h_ = std::exchange(o.h_, nullptr);
+        }
+        return *this;
+    }
+
+    explicit operator bool() const noexcept { return h_ != nullptr; }
+    siplog_t get() const noexcept { return h_; }
+    siplog_t release() noexcept { return std::exchange(h_, nullptr); }
+    void reset() noexcept {
+        if (h_ != nullptr)
+            siplog_close(std::exchange(h_, nullptr));
+    }
+
+    int level() const noexcept { return siplog_get_level(h_); }
+    int level(int lvl) noexcept { return siplog_set_level(h_, lvl); }
+    void hbeat() noexcept { siplog_hbeat(h_); }
+    int hbeat_hint(int &timeout) const noexcept {
+        return siplog_hbeat_hint(h_, &timeout);
+    }
+
+    template <detail::formattable... Args>
+    void write(int lvl, format_string<Args...> fmt, const Args &...args) const {
+        /* Format string is what tells call sites apart */
+        const void *site = fmt.str.data();
+        char *rp = siplog_kreserve(lvl, h_, site, line_reserve);
+        if (rp == nullptr)
+            return;
+        detail::buffer rb(rp, line_reserve);
+        detail::format_to(rb, fmt.str, args...);
+        if (!rb.overflow()) {
+            siplog_commit(h_, rb.size());
+            return;
+        }
+
+        /* Replaces the first one, not rate limited again */
+        rp = siplog_kreserve(lvl, h_, site, line_max);
+        if (rp == nullptr)
+            return;
+        detail::buffer b(rp, line_max);
+        detail::format_to(b, fmt.str, args...);
+        siplog_commit(h_, b.size());
+    }
+
+    template <detail::formattable... Args>
+    void dbug(format_string<Args...> fmt, const Args &...args) const {
+        write(SIPLOG_DBUG, fmt, args...);
+    }
+    template <detail::formattable... Args>
+    void info(format_string<Args...> fmt, const Args &...args) const {
+        write(SIPLOG_INFO, fmt, args...);
+    }
+    template <detail::formattable... Args>
+    void warn(format_string<Args...> fmt, const Args &...args) const {
+        write(SIPLOG_WARN, fmt, args...);
+    }
+    template <detail::formattable... Args>
+    void err(format_string<Args...> fmt, const Args &...args) const {
+        write(SIPLOG_ERR, fmt, args...);
+    }
+    template <detail::formattable... Args>
+    void crit(format_string<Args...> fmt, const Args &...args) const {
+        write(SIPLOG_CRIT, fmt, args...);
+    }
+
+private:
+    siplog_t h_;
+};
+
+} /* namespace siplog */
+
+#endif /* _SIPLOG_HPP_ */
@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Fan-out: a handle that delivers every line to several backends, each
+ * with a level threshold of its own, e.g. WARN and above to stderr and
+ * everything to the log file with
+ *
+ *     SIPLOG_BEND=stderr:WARN,logfile_async:DBUG
+ *
+ * Every sink is a handle of its own behind the scenes. The line is only
+ * formatted once, into a reference counted buffer that is handed over to
+ * the sinks as is: the synchronous ones write it out right away, the
+ * asynchronous ones keep a reference until the worker is done with it.
+ * The buffer is per-thread and gets reused unless a sink still holds it.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "siplog.h"
+#include "internal/_siplog.h"
+#include "internal/siplog_fanout.h"
+#include "internal/siplog_stats.h"
+
+/* Size of the per-thread buffer, longer lines get one of their own */
+#define SIPLOG_LBUF_LEN		(8 * 1024)
+
+struct siplog_fanout {
+    int nsinks;
+    struct loginfo *sinks[SIPLOG_FANOUT_MAX];
+};
+
+static int siplog_fanout_open(struct loginfo *);
+static void siplog_fanout_write(struct loginfo *, int, const char *,
+  const char *, const char *, const char *, va_list);
+static void siplog_fanout_writev(struct loginfo *, int, const char *,
+  const char *, const struct iovec *, int);
+static void siplog_fanout_writeb(struct loginfo *, int, const char *,
+  struct siplog_lbuf *);
+static void siplog_fanout_close(struct loginfo *);
+static void siplog_fanout_hbeat(struct loginfo *);
+static int siplog_fanout_hint(struct loginfo *, int *);
+
+/* Never selected by name, see siplog_fanout_spec() */
+struct bend siplog_fanout_bend = {
+    .open = siplog_fanout_open, .write = siplog_fanout_write,
+    .writev = siplog_fanout_writev, .writeb = siplog_fanout_writeb,
+    .close = siplog_fanout_close,
+    .hbeat = siplog_fanout_hbeat, .hint = siplog_fanout_hint,
+    .free_after_close = 1, .name = "fanout"
+};
+
+static pthread_key_t siplog_lbuf_key;
+static pthread_once_t siplog_lbuf_once = PTHREAD_ONCE_INIT;
+
+/* Check if a SIPLOG_BEND value asks for more than a single plain backend */
+int
+siplog_fanout_spec(const char *spec)
+{
+
+    return (strchr(spec, ',') != NULL || strchr(spec, ':') != NULL);
+}
+
+/* Buffer of its own for up to size bytes, with a reference for the caller */
+struct siplog_lbuf *
+siplog_lbuf_alloc(size_t size)
+{
+    struct siplog_lbuf *lb;
+
+    lb = malloc(sizeof(*lb) + size);
+    if (lb == NULL)
+        return (NULL);
+    lb->refcnt = 1;
+    lb->flags = 0;
+    lb->size = size;
+    lb->len = 0;
+    return (lb);
+}
+
+/*
+ * Make room for size bytes in a buffer from siplog_lbuf_alloc() that
+ * nobody else holds yet. Returns NULL, leaving the buffer as is, if there
+ * is not enough memory.
+ */
+struct siplog_lbuf *
+siplog_lbuf_grow(struct siplog_lbuf *lb, size_t size)
+{
+    struct siplog_lbuf *nlb;
+
+    nlb = realloc(lb, sizeof(*lb) + size);
+    if (nlb == NULL)
+        return (NULL);
+    nlb->size = size;
+    return (nlb);
+}
+
+void
+siplog_lbuf_hold(struct siplog_lbuf *lb)
+{
+
+    __atomic_add_fetch(&lb->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void
+siplog_lbuf_release(struct siplog_lbuf *lb)
+{
+
+    if (__atomic_sub_fetch(&lb->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        free(lb);
+}
+
+static void
+siplog_lbuf_key_init(void)
+{
+
+    pthread_key_create(&siplog_lbuf_key,
+      (void (*)(void *))siplog_lbuf_release);
+}
+
+/*
+ * Get a buffer for a line of up to size bytes, with a reference for the
+ * caller. The per-thread one is only reused once no sink holds it anymore,
+ * otherwise it's left to the last sink to free and replaced.
+ */
+static struct siplog_lbuf *
+siplog_lbuf_get(size_t size)
+{
+    struct siplog_lbuf *lb;
+
+    if (size > SIPLOG_LBUF_LEN)
+        return (siplog_lbuf_alloc(size));
+    pthread_once(&siplog_lbuf_once, siplog_lbuf_key_init);
+    lb = pthread_getspecific(siplog_lbuf_key);
+    if (lb != NULL) {
+        if (__atomic_load_n(&lb->refcnt, __ATOMIC_ACQUIRE) == 1) {
+            lb->refcnt = 2;
+            return (lb);
+        }
+        siplog_lbuf_release(lb);
+    }
+    lb = siplog_lbuf_alloc(SIPLOG_LBUF_LEN);
+    pthread_setspecific(siplog_lbuf_key, lb);
+    if (lb == NULL)
+        return (NULL);
+    lb->refcnt = 2;
+    return (lb);
+}
+
+static int
+siplog_fanout_add(struct siplog_fanout *fp, struct loginfo *lp,
+  struct bend *bp, int level)
+{
+    struct loginfo *slp;
+
+    slp = malloc(sizeof(*slp));
+    if (slp == NULL)
+        return (-1);
+    memset(slp, '\0', sizeof(*slp));
+    slp->app = strdup(lp->app);
+    slp->call_id = strdup(lp->call_id);
+    if (slp->app == NULL || slp->call_id == NULL)
+        goto e0;
+    slp->call_id_global = lp->call_id_global;
+    slp->flags = lp->flags;
+    slp->pid = lp->pid;
+    slp->level = level;
+    slp->bend = bp;
+    slp->private = (void *)0x1;
+    if (bp->open(slp) != 0)
+        goto e0;
+    fp->sinks[fp->nsinks++] = slp;
+    return (0);
+e0:
+    siplog_free(slp);
+    return (-1);
+}
+
+/*
+ * Sinks come from SIPLOG_BEND, as a comma separated list of backends,
+ * each optionally followed by a colon and the lowest level that it takes.
+ * Backends that are unknown or can't be opened are skipped, as is the
+ * case with a plain SIPLOG_BEND, it's stderr if none are left.
+ */
+static int
+siplog_fanout_open(struct loginfo *lp)
+{
+    struct siplog_fanout *fp;
+    struct bend *bp;
+    char *buf, *tok, *last, *lvl;
+    const char *cp;
+    int i, level, minlevel;
+
+    fp = malloc(sizeof(*fp));
+    if (fp == NULL)
+        return (-1);
+    memset(fp, '\0', sizeof(*fp));
+    cp = getenv("SIPLOG_BEND");
+    buf = (cp != NULL) ? strdup(cp) : NULL;
+    for (tok = (buf != NULL) ? strtok_r(buf, ",", &last) : NULL;
+      tok != NULL && fp->nsinks < SIPLOG_FANOUT_MAX;
+      tok = strtok_r(NULL, ",", &last)) {
+        level = SIPLOG_DBUG;
+        lvl = strchr(tok, ':');
+        if (lvl != NULL) {
+            *lvl++ = '\0';
+            level = siplog_level_byname(lvl);
+            if (level < 0)
+                continue;
+        }
+        bp = siplog_bend_byname(tok);
+        if (bp == NULL || bp->writeb == NULL)
+            continue;
+        siplog_fanout_add(fp, lp, bp, level);
+    }
+    free(buf);
+    if (fp->nsinks == 0 && siplog_fanout_add(fp, lp,
+      siplog_bend_byname("stderr"), SIPLOG_DBUG) != 0) {
+        free(fp);
+        return (-1);
+    }
+    lp->private = fp;
+
+    /* Lines that no sink takes are dropped before they get formatted */
+    minlevel = SIPLOG_CRIT;
+    for (i = 0; i < fp->nsinks; i++)
+        minlevel = MIN(minlevel, fp->sinks[i]->level);
+    lp->level = MAX(lp->level, minlevel);
+    return (0);
+}
+
+/* Hand the line over to the sinks that want it, returns the reference */
+static void
+siplog_fanout_deliver(struct loginfo *lp, int level, const char *idx_id,
+  struct siplog_lbuf *lb)
+{
+    struct siplog_fanout *fp;
+    struct loginfo *slp;
+    int i;
+
+    fp = (struct siplog_fanout *)lp->private;
+    for (i = 0; i < fp->nsinks; i++) {
+        slp = fp->sinks[i];
+        if (level >= slp->level)
+            slp->bend->writeb(slp, level, idx_id, lb);
+    }
+    siplog_lbuf_release(lb);
+}
+
+static int
+siplog_fanout_wanted(struct loginfo *lp, int level)
+{
+    struct siplog_fanout *fp;
+    int i;
+
+    fp = (struct siplog_fanout *)lp->private;
+    for (i = 0; i < fp->nsinks; i++) {
+        if (level >= fp->sinks[i]->level)
+            return (1);
+    }
+    return (0);
+}
+
+static void
+siplog_fanout_write(struct loginfo *lp, int level, const char *tstamp,
+  const char *estr, const char *idx_id, const char *fmt, va_list ap)
+{
+    struct siplog_lbuf *lb, *nlb;
+    va_list aq;
+    int len;
+
+    if (!siplog_fanout_wanted(lp, level))
+        return;
+    lb = siplog_lbuf_get(SIPLOG_LBUF_LEN);
+    if (lb == NULL)
+        return;
+    va_copy(aq, ap);
+    len = siplog_format_line(lb->data, lb->size, lp, tstamp, estr, fmt, aq);
+    va_end(aq);
+    if (len < 0) {
+        siplog_lbuf_release(lb);
+        return;
+    }
+    if ((size_t)len >= lb->size) {
+        nlb = siplog_lbuf_get(len + 1);
+        if (nlb != NULL) {
+            siplog_lbuf_release(lb);
+            lb = nlb;
+            len = siplog_format_line(lb->data, lb->size, lp, tstamp, estr,
+              fmt, ap);
+        } else {
+            /* Settle for what has fit */
+            len = lb->size - 1;
+        }
+    }
+    lb->len = len;
+    siplog_stats_bytes(lb->len);
+    siplog_fanout_deliver(lp, level, idx_id, lb);
+}
+
+static void
+siplog_fanout_writev(struct loginfo *lp, int level, const char *tstamp,
+  const char *idx_id, const struct iovec *iov, int iovcnt)
+{
+    struct siplog_lbuf *lb;
+    size_t plen, dlen;
+    char prefix[512];
+    int i, r;
+
+    if (!siplog_fanout_wanted(lp, level))
+        return;
+    r = snprintf(prefix, sizeof(prefix), "%s/%s/%s[%d]: ", tstamp,
+      lp->call_id, lp->app, lp->pid);
+    if (r < 0)
+        return;
+    plen = MIN((size_t)r, sizeof(prefix) - 1);
+    dlen = 0;
+    for (i = 0; i < iovcnt; i++)
+        dlen += iov[i].iov_len;
+    lb = siplog_lbuf_get(MAX(plen + dlen + 2, SIPLOG_LBUF_LEN));
+    if (lb == NULL)
+        return;
+    memcpy(lb->data, prefix, plen);
+    siplog_iov_flatten(lb->data + plen, dlen + 1, iov, iovcnt);
+    lb->data[plen + dlen] = '\n';
+    lb->data[plen + dlen + 1] = '\0';
+    lb->len = plen + dlen + 1;
+    siplog_stats_bytes(lb->len);
+    siplog_fanout_deliver(lp, level, idx_id, lb);
+}
+
+/* Block formatted by the caller, see siplog_replay() */
+static void
+siplog_fanout_writeb(struct loginfo *lp, int level, const char *idx_id,
+  struct siplog_lbuf *lb)
+{
+
+    siplog_lbuf_hold(lb);
+    siplog_fanout_deliver(lp, level, idx_id, lb);
+}
+
+static void
+siplog_fanout_close(struct loginfo *lp)
+{
+    struct siplog_fanout *fp;
+    struct loginfo *slp;
+    int i, free_after_close;
+
+    fp = (struct siplog_fanout *)lp->private;
+    for (i = 0; i < fp->nsinks; i++) {
+        slp = fp->sinks[i];
+        free_after_close = slp->bend->free_after_close;
+        slp->bend->close(slp);
+        if (free_after_close)
+            siplog_free(slp);
+    }
+    free(fp);
+}
+
+static void
+siplog_fanout_hbeat(struct loginfo *lp)
+{
+    struct siplog_fanout *fp;
+    struct loginfo *slp;
+    int i;
+
+    fp = (struct siplog_fanout *)lp->private;
+    for (i = 0; i < fp->nsinks; i++) {
+        slp = fp->sinks[i];
+        if (slp->bend->hbeat != NULL)
+            slp->bend->hbeat(slp);
+    }
+}
+
+/* Soonest of the timeouts, the first descriptor if there are any */
+static int
+siplog_fanout_hint(struct loginfo *lp, int *timeout)
+{
+    struct siplog_fanout *fp;
+    struct loginfo *slp;
+    int i, fd, sfd, stimeout;
+
+    fp = (struct siplog_fanout *)lp->private;
+    fd = -1;
+    *timeout = -1;
+    for (i = 0; i < fp->nsinks; i++) {
+        slp = fp->sinks[i];
+        if (slp->bend->hint == NULL)
+            continue;
+        stimeout = -1;
+        sfd = slp->bend->hint(slp, &stimeout);
+        if (fd == -1)
+            fd = sfd;
+        if (stimeout >= 0 && (*timeout < 0 || stimeout < *timeout))
+            *timeout = stimeout;
+    }
+    return (fd);
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Flight recorder: instead of being thrown away, lines below the level
+ * of the handle are formatted into a bounded per-handle ring in memory.
+ * Once the handle logs something at ERR or above, or the application
+ * calls siplog_flightrec_flush(), the ring is written out ahead of it, so
+ * that failing calls come with their full debug context. It goes to the
+ * backend as a single record together with that line, which the async
+ * ones queue on its lane in an item of its own, so that it's neither
+ * dropped nor waited for when the queue is full. Rings of handles that
+ * never fail are simply discarded on siplog_close().
+ *
+ * Enabled for all handles by setting SIPLOG_FLIGHTREC to the ring size in
+ * bytes, or for a single one by passing LF_FLIGHTREC to siplog_open().
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "siplog.h"
+#include "internal/siplog_flightrec.h"
+
+struct siplog_flightrec {
+    pthread_mutex_t mutex;
+    char *buf;
+    size_t size;
+    size_t head;
+    size_t len;
+};
+
+/* Every record in the ring is this header followed by the three strings */
+struct siplog_flightrec_hdr {
+    uint16_t tlen;
+    uint16_t ilen;
+    uint32_t mlen;
+};
+
+/*
+ * Ring size to use for a handle opened with given flags, 0 if flight
+ * recorder is not to be enabled.
+ */
+size_t
+siplog_flightrec_size(int flags)
+{
+    const char *cp;
+    long size;
+
+    cp = getenv("SIPLOG_FLIGHTREC");
+    if (cp != NULL) {
+        size = atol(cp);
+        if (size > 0)
+            return (size);
+    }
+    if ((flags & LF_FLIGHTREC) != 0)
+        return (SIPLOG_FLIGHTREC_DEFAULT);
+    return (0);
+}
+
+struct siplog_flightrec *
+siplog_flightrec_alloc(size_t size)
+{
+    struct siplog_flightrec *frp;
+
+    frp = malloc(sizeof(*frp));
+    if (frp == NULL)
+        return (NULL);
+    memset(frp, '\0', sizeof(*frp));
+    frp->buf = malloc(size);
+    if (frp->buf == NULL) {
+        free(frp);
+        return (NULL);
+    }
+    frp->size = size;
+    pthread_mutex_init(&frp->mutex, NULL);
+    return (frp);
+}
+
+void
+siplog_flightrec_free(struct siplog_flightrec *frp)
+{
+
+    pthread_mutex_destroy(&frp->mutex);
+    free(frp->buf);
+    free(frp);
+}
+
+static void
+siplog_flightrec_put(struct siplog_flightrec *frp, const void *src, size_t n)
+{
+    size_t off, chunk;
+
+    off = (frp->head + frp->len) % frp->size;
+    chunk = frp->size - off;
+    if (chunk > n)
+        chunk = n;
+    memcpy(frp->buf + off, src, chunk);
+    memcpy(frp->buf, (const char *)src + chunk, n - chunk);
+    frp->len += n;
+}
+
+static void
+siplog_flightrec_get(struct siplog_flightrec *frp, void *dst, size_t n)
+{
+    size_t chunk;
+
+    chunk = frp->size - frp->head;
+    if (chunk > n)
+        chunk = n;
+    memcpy(dst, frp->buf + frp->head, chunk);
+    memcpy((char *)dst + chunk, frp->buf, n - chunk);
+    frp->head = (frp->head + n) % frp->size;
+    frp->len -= n;
+}
+
+static void
+siplog_flightrec_evict(struct siplog_flightrec *frp)
+{
+    struct siplog_flightrec_hdr hdr;
+    size_t rlen;
+
+    siplog_flightrec_get(frp, &hdr, sizeof(hdr));
+    rlen = (size_t)hdr.tlen + hdr.ilen + hdr.mlen;
+    frp->head = (frp->head + rlen) % frp->size;
+    frp->len -= rlen;
+}
+
+void
+siplog_flightrec_record(struct siplog_flightrec *frp, const char *tstamp,
+  const char *estr, const char *idx_id, const char *fmt, va_list ap)
+{
+    struct siplog_flightrec_hdr hdr;
+    char mbuf[SIPLOG_FLIGHTREC_MSG_LEN];
+    size_t rlen;
+    int len;
+
+    len = vsnprintf(mbuf, sizeof(mbuf), fmt, ap);
+    if (len < 0)
+        return;
+    if ((size_t)len >= sizeof(mbuf))
+        len = sizeof(mbuf) - 1;
+    if (estr != NULL && (size_t)len < sizeof(mbuf) - 1) {
+        len += snprintf(mbuf + len, sizeof(mbuf) - len, ": %s", estr);
+        if ((size_t)len >= sizeof(mbuf))
+            len = sizeof(mbuf) - 1;
+    }
+    hdr.tlen = strlen(tstamp);
+    hdr.ilen = (idx_id != NULL) ? strnlen(idx_id, 255) : 0;
+    hdr.mlen = len;
+    rlen = sizeof(hdr) + hdr.tlen + hdr.ilen + hdr.mlen;
+    if (rlen > frp->size)
+        return;
+
+    pthread_mutex_lock(&frp->mutex);
+    while (frp->len + rlen > frp->size)
+        siplog_flightrec_evict(frp);
+    siplog_flightrec_put(frp, &hdr, sizeof(hdr));
+    siplog_flightrec_put(frp, tstamp, hdr.tlen);
+    if (hdr.ilen > 0)
+        siplog_flightrec_put(frp, idx_id, hdr.ilen);
+    siplog_flightrec_put(frp, mbuf, hdr.mlen);
+    pthread_mutex_unlock(&frp->mutex);
+}
+
+/*
+ * Empty the ring, calling cb for every record in it, oldest first.
+ * Records are copied out first, so that the callback is free to do I/O
+ * without holding the lock. Returns number of records processed.
+ */
+int
+siplog_flightrec_drain(struct siplog_flightrec *frp, siplog_flightrec_cb_t cb,
+  void *arg)
+{
+    struct siplog_flightrec_hdr hdr;
+    char tstamp[64], idx_id[256], mbuf[SIPLOG_FLIGHTREC_MSG_LEN];
+    char *copy, *cp, *ep;
+    size_t len;
+    int nrecs;
+
+    pthread_mutex_lock(&frp->mutex);
+    len = frp->len;
+    if (len == 0) {
+        pthread_mutex_unlock(&frp->mutex);
+        return (0);
+    }
+    copy = malloc(len);
+    if (copy == NULL) {
+        pthread_mutex_unlock(&frp->mutex);
+        return (0);
+    }
+    siplog_flightrec_get(frp, copy, len);
+    frp->head = 0;
+    pthread_mutex_unlock(&frp->mutex);
+
+    nrecs = 0;
+    for (cp = copy, ep = copy + len; cp < ep; nrecs++) {
+        memcpy(&hdr, cp, sizeof(hdr));
+        cp += sizeof(hdr);
+        memcpy(tstamp, cp, hdr.tlen);
+        tstamp[hdr.tlen] = '\0';
+        cp += hdr.tlen;
+        memcpy(idx_id, cp, hdr.ilen);
+        idx_id[hdr.ilen] = '\0';
+        cp += hdr.ilen;
+        memcpy(mbuf, cp, hdr.mlen);
+        mbuf[hdr.mlen] = '\0';
+        cp += hdr.mlen;
+        cb(arg, tstamp, (hdr.ilen > 0) ? idx_id : NULL, mbuf);
+    }
+    free(copy);
+    return (nrecs);
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Compaction of the call-id index of a log file. The raw index, "<ino>",
+ * gets a line per message, in the order they have been written, so the
+ * lines of a call are all over it. Compaction sorts it by call-id and
+ * offset, merges the extents of a call that follow each other in the log
+ * into one and writes the result out as "<ino>.cidx", same format, that
+ * can be binary searched. The raw index is renamed to "<ino>.compacting"
+ * first and only removed once the compact one is in place, so lines that
+ * are written meanwhile go into a new raw index and nothing is lost if
+ * the compaction is interrupted: the next one picks up where it left.
+ * Readers are to look at all three of them.
+ *
+ * The async backend runs it in the background, once per file, when it
+ * notices that the file has been rotated, unless SIPLOG_INDEX_COMPACT is
+ * "0", and so does siplog-idxcompact(1) on request.
+ */
+
+#define _FILE_OFFSET_BITS  64
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "siplog.h"
+#include "internal/_siplog.h"
+#include "internal/siplog_idxcompact.h"
+
+/* Most times the index is gone through, see siplog_index_compact() */
+#define SIPLOG_IDX_MAXPASS	4
+
+/* Inode of the file whose index has been compacted in the background last */
+static unsigned long long siplog_index_compacted;
+
+struct siplog_extent {
+    const char *id;
+    size_t idlen;
+    uint64_t offset;
+    uint64_t len;
+};
+
+struct siplog_extents {
+    struct siplog_extent *ext;
+    size_t n;
+    size_t size;
+};
+
+struct siplog_idxmap {
+    void *data;
+    size_t size;
+};
+
+static const char *
+siplog_idx_number(const char *cp, const char *ep, uint64_t *vp)
+{
+    uint64_t v;
+
+    if (cp >= ep || *cp < '0' || *cp > '9')
+        return (NULL);
+    for (v = 0; cp < ep && *cp >= '0' && *cp <= '9'; cp++)
+        v = v * 10 + (*cp - '0');
+    *vp = v;
+    return (cp);
+}
+
+/* Add the "<id> <offset> <len>" lines of the file, malformed ones skipped */
+static int
+siplog_idx_load(const char *path, struct siplog_idxmap *mp,
+  struct siplog_extents *esp)
+{
+    struct siplog_extent *ep;
+    struct stat st;
+    const char *cp, *end, *nl, *sp, *idend;
+    uint64_t off, len;
+    int fd;
+
+    mp->data = NULL;
+    mp->size = 0;
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return ((errno == ENOENT) ? 0 : -1);
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return (-1);
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return (0);
+    }
+    mp->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mp->data == MAP_FAILED) {
+        mp->data = NULL;
+        return (-1);
+    }
+    mp->size = st.st_size;
+    end = (const char *)mp->data + mp->size;
+    for (cp = mp->data; cp < end; cp = nl + 1) {
+        nl = memchr(cp, '\n', end - cp);
+        if (nl == NULL)
+            break;
+        idend = memchr(cp, ' ', nl - cp);
+        if (idend == NULL || idend == cp)
+            continue;
+        sp = siplog_idx_number(idend + 1, nl, &off);
+        if (sp == NULL || *sp != ' ')
+            continue;
+        sp = siplog_idx_number(sp + 1, nl, &len);
+        if (sp != nl)
+            continue;
+        if (esp->n == esp->size) {
+            ep = realloc(esp->ext, esp->size * 2 * sizeof(*ep));
+            if (ep == NULL)
+                return (-1);
+            esp->ext = ep;
+            esp->size *= 2;
+        }
+        ep = &esp->ext[esp->n++];
+        ep->id = cp;
+        ep->idlen = idend - cp;
+        ep->offset = off;
+        ep->len = len;
+    }
+    return (0);
+}
+
+static void
+siplog_idx_unmap(struct siplog_idxmap *mp)
+{
+
+    if (mp->data != NULL)
+        munmap(mp->data, mp->size);
+    mp->data = NULL;
+}
+
+/* Byte order of the call-ids, then the offset */
+static int
+siplog_extent_cmp(const void *a, const void *b)
+{
+    const struct siplog_extent *ea, *eb;
+    int r;
+
+    ea = (const struct siplog_extent *)a;
+    eb = (const struct siplog_extent *)b;
+    r = memcmp(ea->id, eb->id, MIN(ea->idlen, eb->idlen));
+    if (r != 0)
+        return (r);
+    if (ea->idlen != eb->idlen)
+        return ((ea->idlen > eb->idlen) ? 1 : -1);
+    return ((ea->offset > eb->offset) - (ea->offset < eb->offset));
+}
+
+/* Sort, merge and write out into path */
+static int
+siplog_idx_store(const char *path, struct siplog_extents *esp)
+{
+    struct siplog_extent *ep, *lp;
+    FILE *f;
+    size_t i;
+    int r;
+
+    qsort(esp->ext, esp->n, sizeof(*esp->ext), siplog_extent_cmp);
+    f = fopen(path, "w");
+    if (f == NULL)
+        return (-1);
+    lp = NULL;
+    for (i = 0; i <= esp->n; i++) {
+        ep = (i < esp->n) ? &esp->ext[i] : NULL;
+        if (ep != NULL && lp != NULL && ep->idlen == lp->idlen &&
+          memcmp(ep->id, lp->id, lp->idlen) == 0 &&
+          ep->offset <= lp->offset + lp->len) {
+            lp->len = MAX(lp->offset + lp->len, ep->offset + ep->len) -
+              lp->offset;
+            continue;
+        }
+        if (lp != NULL)
+            fprintf(f, "%.*s %llu %llu\n", (int)lp->idlen, lp->id,
+              (unsigned long long)lp->offset, (unsigned long long)lp->len);
+        lp = ep;
+    }
+    r = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0)
+        r = -1;
+    return (r);
+}
+
+int
+siplog_index_compact(const char *idxdir, unsigned long long ino)
+{
+    struct siplog_extents es;
+    struct siplog_idxmap cmap, wmap;
+    struct stat st;
+    char rpath[1024], wpath[1024], cpath[1024], tpath[1024];
+    int dfd, pass, rval;
+
+    snprintf(rpath, sizeof(rpath), "%s/%llu", idxdir, ino);
+    snprintf(wpath, sizeof(wpath), "%s/%llu.compacting", idxdir, ino);
+    snprintf(cpath, sizeof(cpath), "%s/%llu.cidx", idxdir, ino);
+    snprintf(tpath, sizeof(tpath), "%s/%llu.cidx.tmp", idxdir, ino);
+
+    /* One compaction at a time in the directory, across processes */
+    dfd = open(idxdir, O_RDONLY);
+    if (dfd == -1)
+        return (-1);
+    if (flock(dfd, LOCK_EX) == -1) {
+        close(dfd);
+        return (-1);
+    }
+    es.size = 1024;
+    es.ext = malloc(es.size * sizeof(*es.ext));
+    rval = (es.ext != NULL) ? 0 : -1;
+
+    /*
+     * What an interrupted compaction has left, if anything, then the rest.
+     * A writer that has opened the raw index before it got renamed can
+     * still append to it, that takes another pass.
+     */
+    for (pass = 0; pass < SIPLOG_IDX_MAXPASS && rval == 0; pass++) {
+        if (access(wpath, F_OK) == -1 && rename(rpath, wpath) == -1) {
+            if (errno != ENOENT)
+                rval = -1;
+            break;
+        }
+        es.n = 0;
+        if (siplog_idx_load(cpath, &cmap, &es) != 0) {
+            siplog_idx_unmap(&cmap);
+            rval = -1;
+            break;
+        }
+        if (siplog_idx_load(wpath, &wmap, &es) != 0 ||
+          siplog_idx_store(tpath, &es) != 0 || rename(tpath, cpath) != 0) {
+            unlink(tpath);
+            rval = -1;
+        } else if (stat(wpath, &st) == 0 && (size_t)st.st_size == wmap.size) {
+            unlink(wpath);
+        }
+        siplog_idx_unmap(&wmap);
+        siplog_idx_unmap(&cmap);
+    }
+    free(es.ext);
+    close(dfd);
+    return (rval);
+}
+
+static void *
+siplog_index_compact_run(void *arg)
+{
+    unsigned long long ino;
+
+    ino = *(unsigned long long *)arg;
+    free(arg);
+    siplog_index_compact(siplog_index_dir(), ino);
+    return (NULL);
+}
+
+/*
+ * Compact the index of a file that has just been rotated away, in a thread.
+ * Every handle that has the file open notices the rotation on its own, the
+ * first one to do so gets it compacted and the rest are to leave it be.
+ */
+void
+siplog_index_compact_bg(unsigned long long ino)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    unsigned long long *arg;
+    const char *cp;
+
+    cp = getenv("SIPLOG_INDEX_COMPACT");
+    if (cp != NULL && strcmp(cp, "0") == 0)
+        return;
+    if (__atomic_exchange_n(&siplog_index_compacted, ino,
+      __ATOMIC_RELAXED) == ino)
+        return;
+    arg = malloc(sizeof(*arg));
+    if (arg == NULL)
+        goto e0;
+    *arg = ino;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, siplog_index_compact_run, arg) != 0) {
+        free(arg);
+        pthread_attr_destroy(&attr);
+        goto e0;
+    }
+    pthread_attr_destroy(&attr);
+    return;
+e0:
+    /* Let the next handle have a go at it */
+    __atomic_compare_exchange_n(&siplog_index_compacted, &ino, 0, 0,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
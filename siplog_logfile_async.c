@@ -7,22 +7,37 @@
 
 #define _FILE_OFFSET_BITS  64
 
+#include <sys/param.h>
 #include <sys/file.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "siplog.h"
 #include "internal/_siplog.h"
+#include "internal/siplog_collector.h"
+#include "internal/siplog_fanout.h"
+#include "internal/siplog_idxcompact.h"
 #include "internal/siplog_logfile_async.h"
+#include "internal/siplog_sites.h"
+#include "internal/siplog_stats.h"
 
 #define SIPLOG_WI_POOL_SIZE     64
 #define SIPLOG_WI_DATA_LEN      (8 * 1024)
 #define SIPLOG_WI_ID_LEN        128
+/* Default cap on the length of a line that does not fit into the item */
+#define SIPLOG_WI_MAX_LEN       (256 * 1024)
 
 typedef enum {
     SIPLOG_ITEM_ASYNC_OPEN,
@@ -36,23 +51,111 @@ typedef enum {
 #define SIPLOG_WI_NOWAIT	0
 #define	SIPLOG_WI_WAIT		1
 
+/*
+ * ERR and CRIT lines go through a lane of their own, which the worker
+ * drains first, and can use the last SIPLOG_WI_HIPRI_RESERVE free items,
+ * so that a flood of debug output doesn't push them out. Control messages
+ * go through the low priority lane, since they have to come after all the
+ * lines queued before them, except for the open that has to come first.
+ */
+#define SIPLOG_WI_HIPRI_RESERVE	16
+#define SIPLOG_LANE_HI		0
+#define SIPLOG_LANE_LO		1
+#define SIPLOG_NLANES		2
+#define SIPLOG_LANE(level)	((level) >= SIPLOG_ERR ? SIPLOG_LANE_HI : \
+				  SIPLOG_LANE_LO)
+
+/*
+ * No handle gets more than its fair share of the items its lane can use:
+ * they are split evenly between the handles that have any in flight and
+ * one more, so that there is always room for a handle that comes in with
+ * a line, and one that floods the queue only ever drops its own lines.
+ * A handle that has the queue to itself can use all of the lane, and the
+ * flight recorder replay is never held to the share. Control messages
+ * don't take items at all. SIPLOG_HANDLE_QUOTA sets a fixed number of
+ * items per handle instead. The worker takes turns between the handles
+ * as well, see siplog_queue_interleave().
+ */
+#define SIPLOG_WI_RR_MAX	SIPLOG_WI_POOL_SIZE
+
+/* Where the worker delivers records of a given handle */
+#define SIPLOG_SINK_FILE	0
+#define SIPLOG_SINK_COLLECTOR	1
+#define SIPLOG_SINK_STDERR	2
+
+/*
+ * The worker doesn't get woken up for every line. While it is parked
+ * waiting for more lines to batch, producers only signal it once
+ * SIPLOG_WORKER_FILL lines are queued or a high priority one comes in,
+ * otherwise it picks the lines up SIPLOG_WORKER_LATENCY ms after the first
+ * one has been queued. Both can be changed with SIPLOG_ASYNC_FILL and
+ * SIPLOG_ASYNC_LATENCY. Before going idle the worker polls the queue for
+ * a little while, yielding the CPU in between. None of this holds once the
+ * pool is down to SIPLOG_WI_LOW free items: the worker is then woken up
+ * whatever it's doing, and a producer that finds no item for its line
+ * yields to it once before dropping the line, or else on a single CPU it
+ * would keep dropping lines until preempted.
+ */
+#define SIPLOG_WORKER_FILL	16
+#define SIPLOG_WORKER_LATENCY	5
+#define SIPLOG_WORKER_SPINS	64
+#define SIPLOG_WI_LOW		(SIPLOG_WI_POOL_SIZE / 2)
+
+#define SIPLOG_PARKED_NOT	0
+#define SIPLOG_PARKED_IDLE	1	/* queue is empty */
+#define SIPLOG_PARKED_BATCH	2	/* waiting for more to batch */
+
+/* Most records the worker hands over to the kernel at once */
+#define SIPLOG_WI_BATCH		SIPLOG_COLLECTOR_BATCH
+
+/* How long to stick to the file once the collector is found unreachable */
+#define SIPLOG_COLLECTOR_RETRY	1
+
+/*
+ * Everything that goes through the queue starts with this. Log records
+ * are siplog_wi's taken from the pool, or off the heap for the flight
+ * recorder replays, while control messages (open, close, hbeat and exit)
+ * are embedded into the handle or are static, so that they never have to
+ * wait for a free item.
+ */
+struct siplog_qent
+{
+    item_types item_type;
+    struct loginfo *loginfo;
+    struct siplog_qent *next;
+};
+
 struct siplog_private {
     int fd;
     ino_t ino;
     char *fpath;
+    int sink;
+    const char *oname;
+    struct siplog_qent open_qe;
+    struct siplog_qent hbeat_qe;
+    struct siplog_qent close_qe;
+    int hbeat_pending;
+    int inflight;		/* items taken, under siplog_wi_free_mutex */
 };
 
 struct siplog_wi
 {
-    item_types item_type;
-    struct loginfo *loginfo;
+    struct siplog_qent qe;
     char data[SIPLOG_WI_DATA_LEN];
+    char *ext;          /* heap copy of lines longer than data, or NULL */
+    struct siplog_lbuf *lbuf;	/* shared line ext points into, or NULL */
     const char *name;
     int len;
+    int level;
+    struct siplog_private *owner;	/* handle the item is charged to */
+    int onheap;		/* not from the pool, freed once written out */
     struct siplog_wi *next;
     char idx_id[SIPLOG_WI_ID_LEN];
 };
 
+#define SIPLOG_QE2WI(qep)	((struct siplog_wi *)(qep))
+#define SIPLOG_WI_BUF(wi)	((wi)->ext != NULL ? (wi)->ext : (wi)->data)
+
 static pthread_mutex_t siplog_init_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int siplog_queue_inited = 0;
 static int atexit_registered = 0;
@@ -64,19 +167,44 @@ static pthread_cond_t siplog_wi_free_cond;
 static pthread_mutex_t siplog_wi_free_mutex;
 
 static int siplog_dropped_items;
+static unsigned long siplog_level_drops[SIPLOG_NLEVELS];
+static int siplog_wi_nfree;
+static int siplog_wi_free_waiters;
+static int siplog_wi_nactive;	/* handles with items in flight */
+static int siplog_wi_quota;
+
+static int siplog_worker_parked;
+static int siplog_worker_fill;
+static long siplog_worker_latency;
+static int siplog_queue_len;
+static int siplog_queue_urgent;
+static struct timespec siplog_queue_since;
+static size_t siplog_wi_maxlen;
+
+/* Collector socket, only ever touched by the worker thread */
+static int siplog_collector_fd = -1;
+static time_t siplog_collector_retry;
 
 static struct siplog_wi siplog_wi_pool[SIPLOG_WI_POOL_SIZE];
 static struct siplog_wi *siplog_wi_free;
-static struct siplog_wi *siplog_wi_queue, *siplog_wi_queue_tail;
+static struct siplog_lane {
+    struct siplog_qent *head;
+    struct siplog_qent *tail;
+} siplog_lanes[SIPLOG_NLANES];
+static struct siplog_qent siplog_exit_qe = {
+    .item_type = SIPLOG_ITEM_ASYNC_EXIT
+};
 
 static int siplog_queue_init(void);
 void siplog_queue_run(void);
-struct siplog_wi *siplog_queue_get_free_item(int);
-static void siplog_queue_put_item(struct siplog_wi *);
-static void siplog_queue_handle_open(struct siplog_wi *);
+struct siplog_wi *siplog_queue_get_free_item(struct loginfo *, int, int);
+static void siplog_queue_put_item(struct siplog_qent *, int);
+static void siplog_queue_handle_open(struct loginfo *, const char *);
 static void siplog_queue_handle_write(struct siplog_wi *);
-static void siplog_queue_handle_close(struct siplog_wi *);
+static void siplog_queue_handle_close(struct loginfo *);
 static void siplog_queue_handle_owrc(struct siplog_wi *);
+static void siplog_queue_free_item(struct siplog_wi *);
+static void siplog_queue_free_items(struct siplog_wi **, int);
 
 #if 0
 static void siplog_log_dropped_items(struct siplog_wi *);
@@ -93,7 +221,7 @@ siplog_log_dropped_items(struct siplog_wi *wi)
     sprintf(p, "/GLOBAL/libsiplog: %d message(s) were dropped\n", siplog_dropped_items);
     wi->len = strlen(wi->data);
 
-    switch(wi->item_type) {
+    switch(wi->qe.item_type) {
 	case SIPLOG_ITEM_ASYNC_WRITE:
 	    siplog_queue_handle_write(wi);
 	    break;
@@ -111,15 +239,12 @@ siplog_log_dropped_items(struct siplog_wi *wi)
 static void
 siplog_logfile_async_atexit(void)
 {
-    struct siplog_wi *wi;
 
     if (siplog_queue_inited == 0)
 	return;
 
     /* Wait for the worker thread to exit */
-    wi = siplog_queue_get_free_item(SIPLOG_WI_WAIT);
-    wi->item_type = SIPLOG_ITEM_ASYNC_EXIT;
-    siplog_queue_put_item(wi);
+    siplog_queue_put_item(&siplog_exit_qe, SIPLOG_LANE_LO);
     pthread_join(siplog_queue, NULL);
     siplog_queue_inited = 0;
 }
@@ -133,14 +258,14 @@ siplog_logfile_async_atfork(void)
 }
 
 static void
-siplog_queue_handle_open(struct siplog_wi *wi)
+siplog_queue_handle_open(struct loginfo *lp, const char *name)
 {
     struct siplog_private *private;
     struct stat sb;
 
-    private = (struct siplog_private *)wi->loginfo->private;
+    private = (struct siplog_private *)lp->private;
 
-    private->fd = open(wi->name, O_CREAT | O_APPEND | O_WRONLY, 0640);
+    private->fd = open(name, O_CREAT | O_APPEND | O_WRONLY, 0640);
     if (fstat(private->fd, &sb) == 0) {
         private->ino = sb.st_ino;
     } else {
@@ -149,7 +274,7 @@ siplog_queue_handle_open(struct siplog_wi *wi)
     if (private->fpath != NULL) {
         free(private->fpath);
     }
-    private->fpath = strdup(wi->name);
+    private->fpath = strdup(name);
 }
 
 static void
@@ -158,25 +283,26 @@ siplog_queue_handle_write(struct siplog_wi *wi)
     off_t offset;
     struct siplog_private *private;
 
-    private = (struct siplog_private *)wi->loginfo->private;
+    private = (struct siplog_private *)wi->qe.loginfo->private;
     if (private->fd >= 0) {
 	offset = siplog_lockf(private->fd);
 	if (wi->idx_id[0] != '\0') {
 	    siplog_update_index(wi->idx_id, private->fd, offset, wi->len);
 	}
-	write(private->fd, wi->data, wi->len);
+	write(private->fd, SIPLOG_WI_BUF(wi), wi->len);
+	siplog_update_tsindex(private->fd, offset);
 	siplog_unlockf(private->fd, offset);
     }
 }
 
 static void
-siplog_queue_handle_close(struct siplog_wi *wi)
+siplog_queue_handle_close(struct loginfo *lp)
 {
     struct siplog_private *private;
 
-    private = (struct siplog_private *)wi->loginfo->private;
+    private = (struct siplog_private *)lp->private;
     if (private->fd >= 0) {
-        close(private->fd);
+        siplog_closef(private->fd);
         private->fd = -1;
     }
     if (private->fpath != NULL) {
@@ -192,153 +318,695 @@ siplog_queue_handle_owrc(struct siplog_wi *wi)
     struct stat sb;
     int skipoc;
 
-    private = (struct siplog_private *)wi->loginfo->private;
+    private = (struct siplog_private *)wi->qe.loginfo->private;
     skipoc = 0;
     if (private->fd != -1 && private->fpath != NULL && private->ino > 0) {
         if (stat(private->fpath, &sb) == 0 && sb.st_ino == private->ino)
             skipoc = 1;
     }
     if (skipoc == 0) {
-        if (private->fd != -1)
-            siplog_queue_handle_close(wi);
-        siplog_queue_handle_open(wi);
+        if (private->fd != -1) {
+            /* Rotated away, or not there anymore */
+            if (private->ino > 0)
+                siplog_index_compact_bg(private->ino);
+            siplog_queue_handle_close(wi->qe.loginfo);
+        }
+        siplog_queue_handle_open(wi->qe.loginfo, wi->name);
     }
     siplog_queue_handle_write(wi);
 }
 
 static void
-siplog_queue_handle_hbeat(struct siplog_wi *wi)
+siplog_queue_handle_hbeat(struct loginfo *lp)
 {
     struct siplog_private *private;
     struct stat sb;
+    char *fpath;
 
-    private = (struct siplog_private *)wi->loginfo->private;
+    private = (struct siplog_private *)lp->private;
     if (private->fd != -1 && private->fpath != NULL && private->ino > 0) {
         if (stat(private->fpath, &sb) != 0 || sb.st_ino == private->ino)
             return;
     } else {
         return;
     }
-    siplog_queue_handle_close(wi);
-    siplog_queue_handle_open(wi);
+    /* File has been rotated, reopen it under the same name */
+    siplog_index_compact_bg(private->ino);
+    fpath = private->fpath;
+    private->fpath = NULL;
+    siplog_queue_handle_close(lp);
+    siplog_queue_handle_open(lp, fpath);
+    free(fpath);
+}
+
+static int
+siplog_collector_connect(void)
+{
+    struct sockaddr_un sun;
+    const char *cp;
+    int fd;
+
+    if (siplog_collector_fd != -1)
+        return (0);
+    if (time(NULL) < siplog_collector_retry)
+        return (-1);
+    cp = getenv("SIPLOG_COLLECTOR_SOCK");
+    if (cp == NULL)
+        cp = SIPLOG_COLLECTOR_DEFAULT_SOCK;
+    memset(&sun, '\0', sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strlcpy(sun.sun_path, cp, sizeof(sun.sun_path));
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd == -1)
+        goto e0;
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+        goto e1;
+    siplog_collector_fd = fd;
+    return (0);
+e1:
+    close(fd);
+e0:
+    siplog_collector_retry = time(NULL) + SIPLOG_COLLECTOR_RETRY;
+    return (-1);
+}
+
+static void
+siplog_collector_disconnect(void)
+{
+
+    close(siplog_collector_fd);
+    siplog_collector_fd = -1;
+    siplog_collector_retry = time(NULL) + SIPLOG_COLLECTOR_RETRY;
+}
+
+/*
+ * Ship a batch of records to the collector with as few sendmmsg(2) calls
+ * as possible, anything that could not be delivered goes to the log file
+ * directly. Items are returned to the free list.
+ */
+static void
+siplog_collector_flush(struct siplog_wi **batch, int nbatch)
+{
+    struct siplog_collector_hdr hdrs[SIPLOG_COLLECTOR_BATCH];
+    struct iovec iovs[SIPLOG_COLLECTOR_BATCH][4];
+    struct mmsghdr msgs[SIPLOG_COLLECTOR_BATCH];
+    struct siplog_wi *wi;
+    int i, nsent, r;
+
+    nsent = 0;
+    if (siplog_collector_connect() == 0) {
+        memset(msgs, '\0', sizeof(msgs[0]) * nbatch);
+        for (i = 0; i < nbatch; i++) {
+            wi = batch[i];
+            hdrs[i].magic = SIPLOG_COLLECTOR_MAGIC;
+            hdrs[i].path_len = strlen(wi->name);
+            hdrs[i].idx_len = strlen(wi->idx_id);
+            iovs[i][0].iov_base = &hdrs[i];
+            iovs[i][0].iov_len = sizeof(hdrs[i]);
+            iovs[i][1].iov_base = (void *)wi->name;
+            iovs[i][1].iov_len = hdrs[i].path_len;
+            iovs[i][2].iov_base = wi->idx_id;
+            iovs[i][2].iov_len = hdrs[i].idx_len;
+            iovs[i][3].iov_base = SIPLOG_WI_BUF(wi);
+            iovs[i][3].iov_len = wi->len;
+            msgs[i].msg_hdr.msg_iov = iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 4;
+        }
+        while (nsent < nbatch) {
+            r = sendmmsg(siplog_collector_fd, msgs + nsent, nbatch - nsent, 0);
+            if (r == -1) {
+                if (errno == EINTR)
+                    continue;
+                siplog_collector_disconnect();
+                break;
+            }
+            nsent += r;
+        }
+    }
+    for (i = nsent; i < nbatch; i++)
+        siplog_queue_handle_owrc(batch[i]);
+    siplog_queue_free_items(batch, nbatch);
+}
+
+/*
+ * Write a batch of stderr records out with a single writev(2) whenever
+ * possible. Whatever can't be written is dropped, there is nowhere else
+ * to put it. Items are returned to the free list.
+ */
+static void
+siplog_stderr_flush(struct siplog_wi **batch, int nbatch)
+{
+    struct iovec iovs[SIPLOG_WI_BATCH], *iovp;
+    ssize_t r;
+    int i, niov;
+
+    for (i = 0; i < nbatch; i++) {
+        iovs[i].iov_base = SIPLOG_WI_BUF(batch[i]);
+        iovs[i].iov_len = batch[i]->len;
+    }
+    iovp = iovs;
+    niov = nbatch;
+    while (niov > 0) {
+        r = writev(STDERR_FILENO, iovp, niov);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        /* skip over what has been written, short writes are possible */
+        while (niov > 0 && (size_t)r >= iovp->iov_len) {
+            r -= iovp->iov_len;
+            iovp++;
+            niov--;
+        }
+        if (niov > 0) {
+            iovp->iov_base = (char *)iovp->iov_base + r;
+            iovp->iov_len -= r;
+        }
+    }
+    siplog_queue_free_items(batch, nbatch);
+}
+
+/* Called with the free list locked */
+static int
+siplog_queue_over_share(const struct siplog_private *private, int reserve)
+{
+    int share;
+
+    if (private->inflight == 0)
+	return (0);
+    if (siplog_wi_quota > 0)
+	return (private->inflight >= siplog_wi_quota);
+    /* The only one with items in flight is this one */
+    if (siplog_wi_nactive == 1)
+	return (0);
+    share = (SIPLOG_WI_POOL_SIZE - reserve) / (siplog_wi_nactive + 1);
+    return (private->inflight >= MAX(share, 1));
+}
+
+/* Have the worker drain the queue now, see SIPLOG_WI_LOW */
+static void
+siplog_queue_kick(void)
+{
+
+    pthread_mutex_lock(&siplog_queue_mutex);
+    if (siplog_queue_len > 0)
+	siplog_queue_urgent = 1;
+    if (siplog_worker_parked != SIPLOG_PARKED_NOT)
+	pthread_cond_signal(&siplog_queue_cond);
+    pthread_mutex_unlock(&siplog_queue_mutex);
 }
 
 struct siplog_wi *
-siplog_queue_get_free_item(int wait)
+siplog_queue_get_free_item(struct loginfo *lp, int wait, int level)
 {
+    struct siplog_private *private;
     struct siplog_wi *wi;
+    int reserve, yielded, low;
 
+    private = (struct siplog_private *)lp->private;
+    /* Low priority lines leave a few items for the high priority ones */
+    reserve = (SIPLOG_LANE(level) == SIPLOG_LANE_HI) ? 0 :
+      SIPLOG_WI_HIPRI_RESERVE;
+    yielded = 0;
     pthread_mutex_lock(&siplog_wi_free_mutex);
-    while (siplog_wi_free == NULL) {
+    while (siplog_wi_nfree <= reserve ||
+      siplog_queue_over_share(private, reserve)) {
+	if (siplog_wi_nfree <= reserve && yielded == 0) {
+	    pthread_mutex_unlock(&siplog_wi_free_mutex);
+	    siplog_queue_kick();
+	    sched_yield();
+	    yielded = 1;
+	    pthread_mutex_lock(&siplog_wi_free_mutex);
+	    continue;
+	}
 	/* no free work items, return if no wait is requested */
 	if (wait == 0) {
 	    siplog_dropped_items++;
+	    if (level >= 0 && level < SIPLOG_NLEVELS)
+		__atomic_add_fetch(&siplog_level_drops[level], 1,
+		  __ATOMIC_RELAXED);
 	    pthread_mutex_unlock(&siplog_wi_free_mutex);
 	    return NULL;
 	}
-	pthread_cond_wait(&siplog_wi_free_cond, &siplog_wi_free_mutex);	 
+	siplog_wi_free_waiters++;
+	pthread_cond_wait(&siplog_wi_free_cond, &siplog_wi_free_mutex);
+	siplog_wi_free_waiters--;
     }
 
     wi = siplog_wi_free;
 
     /* move up siplog_wi_free */
     siplog_wi_free = siplog_wi_free->next;
+    siplog_wi_nfree--;
+    if (private->inflight++ == 0)
+	siplog_wi_nactive++;
+    wi->owner = private;
+    low = (siplog_wi_nfree <= SIPLOG_WI_LOW);
     pthread_mutex_unlock(&siplog_wi_free_mutex);
+    if (low)
+	siplog_queue_kick();
 
+    wi->level = level;
     return wi;
 }
 
+/*
+ * Number of lines of a given level dropped because the queue was full or
+ * the handle was over its share of it
+ */
+unsigned long
+siplog_queue_drops(int level)
+{
+
+    if (level < 0 || level >= SIPLOG_NLEVELS)
+	return (0);
+    return (__atomic_load_n(&siplog_level_drops[level], __ATOMIC_RELAXED));
+}
+
+/* Number of entries waiting for the worker */
+int
+siplog_queue_depth(void)
+{
+
+    return (__atomic_load_n(&siplog_queue_len, __ATOMIC_RELAXED));
+}
+
 static void
-siplog_queue_put_item(struct siplog_wi *wi)
+siplog_queue_put_item(struct siplog_qent *qe, int lane)
 {
+    struct siplog_lane *lnp;
 
     pthread_mutex_lock(&siplog_queue_mutex);
 
-    wi->next = NULL;
-    if (siplog_wi_queue == NULL) {
-	siplog_wi_queue = wi;
-	siplog_wi_queue_tail = wi;
+    if (siplog_queue_len == 0)
+	clock_gettime(CLOCK_MONOTONIC, &siplog_queue_since);
+    lnp = &siplog_lanes[lane];
+    qe->next = NULL;
+    if (lnp->head == NULL) {
+	__atomic_store_n(&lnp->head, qe, __ATOMIC_RELAXED);
+	lnp->tail = qe;
     } else {
-	siplog_wi_queue_tail->next = wi;
-	siplog_wi_queue_tail = wi;
+	lnp->tail->next = qe;
+	lnp->tail = qe;
     }
+    __atomic_store_n(&siplog_queue_len, siplog_queue_len + 1,
+      __ATOMIC_RELAXED);
+    if (lane == SIPLOG_LANE_HI || qe->item_type == SIPLOG_ITEM_ASYNC_EXIT)
+	siplog_queue_urgent = 1;
 
-    /* notify worker thread */
-    pthread_cond_signal(&siplog_queue_cond);
+    /* notify worker thread, but only if it's waiting for this */
+    if (siplog_worker_parked == SIPLOG_PARKED_IDLE ||
+      (siplog_worker_parked == SIPLOG_PARKED_BATCH &&
+      (siplog_queue_urgent || siplog_queue_len >= siplog_worker_fill)))
+	pthread_cond_signal(&siplog_queue_cond);
 
     pthread_mutex_unlock(&siplog_queue_mutex);
 }
 
-void
-siplog_queue_run(void)
+static void
+siplog_queue_free_item(struct siplog_wi *wi)
 {
-    struct siplog_wi *wi;
-
-    for (;;) {
-	pthread_mutex_lock(&siplog_queue_mutex);
-	while (siplog_wi_queue == NULL) {
-	    pthread_cond_wait(&siplog_queue_cond, &siplog_queue_mutex);
-	}
-	wi = siplog_wi_queue;
-	siplog_wi_queue = wi->next;
-        pthread_mutex_unlock(&siplog_queue_mutex);
 
-        /* main work here */
-	switch (wi->item_type) {
-	    case SIPLOG_ITEM_ASYNC_OPEN:
-		siplog_queue_handle_open(wi);
-		break;
-
-	    case SIPLOG_ITEM_ASYNC_WRITE:
-		siplog_queue_handle_write(wi);
-		break;
-
-	    case SIPLOG_ITEM_ASYNC_CLOSE:
-		siplog_queue_handle_close(wi);
-		/* free loginfo structure */
-                free(wi->loginfo->private);
-		siplog_free(wi->loginfo);
-		break;
-
-	    case SIPLOG_ITEM_ASYNC_OWRC:
-		siplog_queue_handle_owrc(wi);
-		break;
+    siplog_queue_free_items(&wi, 1);
+}
 
-            case SIPLOG_ITEM_ASYNC_EXIT:
-                return;
+/*
+ * Item that is neither taken from the pool nor charged to any handle, for
+ * records that are to be neither dropped nor waited for. Returns NULL if
+ * out of memory.
+ */
+static struct siplog_wi *
+siplog_queue_heap_item(int level)
+{
+    struct siplog_wi *wi;
 
-            case SIPLOG_ITEM_ASYNC_HBEAT:
-                siplog_queue_handle_hbeat(wi);
-                break;
+    wi = malloc(sizeof(*wi));
+    if (wi == NULL)
+	return (NULL);
+    memset(wi, '\0', sizeof(*wi));
+    wi->onheap = 1;
+    wi->level = level;
+    return (wi);
+}
 
-	    default:
-		break;
+static void
+siplog_queue_free_items(struct siplog_wi **wis, int nwis)
+{
+    struct siplog_wi *wi;
+    int i, npool;
+
+    npool = 0;
+    for (i = 0; i < nwis; i++) {
+	if (wis[i]->lbuf != NULL) {
+	    siplog_lbuf_release(wis[i]->lbuf);
+	    wis[i]->lbuf = NULL;
+	} else if (wis[i]->ext != NULL) {
+	    free(wis[i]->ext);
 	}
+	wis[i]->ext = NULL;
+	if (wis[i]->onheap) {
+	    free(wis[i]);
+	    wis[i] = NULL;
+	} else {
+	    npool++;
+	}
+    }
+    if (npool == 0)
+	return;
 
-	/* put wi into siplog_wi_free' tail */
-	pthread_mutex_lock(&siplog_wi_free_mutex);
+    /* put items into siplog_wi_free' tail */
+    pthread_mutex_lock(&siplog_wi_free_mutex);
 
+    for (i = 0; i < nwis; i++) {
+	wi = wis[i];
+	if (wi == NULL)
+	    continue;
 #if 0
 	/* log dropped items count */
 	if (siplog_dropped_items > 0 &&
-	    (wi->item_type == SIPLOG_ITEM_ASYNC_WRITE || wi->item_type == SIPLOG_ITEM_ASYNC_OWRC)) {
+	    (wi->qe.item_type == SIPLOG_ITEM_ASYNC_WRITE || wi->qe.item_type == SIPLOG_ITEM_ASYNC_OWRC)) {
 		pthread_mutex_unlock(&siplog_wi_free_mutex);
 		siplog_log_dropped_items(wi);
 		pthread_mutex_lock(&siplog_wi_free_mutex);
 	}
 #endif
-
+	if (wi->owner != NULL && --wi->owner->inflight == 0)
+	    siplog_wi_nactive--;
+	wi->owner = NULL;
 	wi->next = siplog_wi_free;
 	siplog_wi_free = wi;
+    }
+    siplog_wi_nfree += npool;
 
-	pthread_cond_signal(&siplog_wi_free_cond);
-	pthread_mutex_unlock(&siplog_wi_free_mutex);
+    if (siplog_wi_free_waiters > 0)
+	pthread_cond_broadcast(&siplog_wi_free_cond);
+    pthread_mutex_unlock(&siplog_wi_free_mutex);
+}
+
+/*
+ * Returns the sink of a record that can be batched together with other
+ * records going to the same sink, -1 if the entry is to be handled on its
+ * own.
+ */
+static int
+siplog_queue_batch_sink(struct siplog_qent *qe)
+{
+    struct siplog_private *private;
+    struct siplog_wi *wi;
+
+    if (qe->item_type != SIPLOG_ITEM_ASYNC_WRITE &&
+      qe->item_type != SIPLOG_ITEM_ASYNC_OWRC)
+	return (-1);
+    private = (struct siplog_private *)qe->loginfo->private;
+    switch (private->sink) {
+    case SIPLOG_SINK_STDERR:
+	return (SIPLOG_SINK_STDERR);
+
+    case SIPLOG_SINK_COLLECTOR:
+	/* Lines that don't fit into a datagram go to the file directly */
+	wi = SIPLOG_QE2WI(qe);
+	if (sizeof(struct siplog_collector_hdr) + strlen(wi->name) +
+	  strlen(wi->idx_id) + wi->len > SIPLOG_COLLECTOR_MAXMSG)
+	    return (-1);
+	return (SIPLOG_SINK_COLLECTOR);
+
+    default:
+	return (-1);
+    }
+}
+
+static void
+siplog_queue_flush_batch(struct siplog_wi **batch, int nbatch, int sink)
+{
+
+    if (sink == SIPLOG_SINK_STDERR)
+	siplog_stderr_flush(batch, nbatch);
+    else
+	siplog_collector_flush(batch, nbatch);
+}
+
+/*
+ * Put what's left of a chain taken off a lane back to the head of it,
+ * ahead of anything queued since.
+ */
+static void
+siplog_queue_requeue(struct siplog_qent *head, struct siplog_qent *tail,
+  int lane)
+{
+    struct siplog_lane *lnp;
+    struct siplog_qent *qe;
+    int n;
+
+    n = 0;
+    for (qe = head; qe != tail->next; qe = qe->next)
+	n++;
+    pthread_mutex_lock(&siplog_queue_mutex);
+    if (siplog_queue_len == 0)
+	clock_gettime(CLOCK_MONOTONIC, &siplog_queue_since);
+    __atomic_store_n(&siplog_queue_len, siplog_queue_len + n,
+      __ATOMIC_RELAXED);
+    lnp = &siplog_lanes[lane];
+    tail->next = lnp->head;
+    if (lnp->head == NULL)
+	lnp->tail = tail;
+    __atomic_store_n(&lnp->head, head, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&siplog_queue_mutex);
+}
+
+/*
+ * Reorder a chain taken off the low priority lane so that the handles take
+ * turns, one entry each, with the entries of every handle kept in order.
+ * The exit message, which belongs to no handle, and whatever comes after
+ * it stay at the end, as does everything past SIPLOG_WI_RR_MAX handles.
+ */
+static void
+siplog_queue_interleave(struct siplog_qent **headp,
+  struct siplog_qent **tailp)
+{
+    struct {
+	struct loginfo *lp;
+	struct siplog_qent *head;
+	struct siplog_qent *tail;
+    } rr[SIPLOG_WI_RR_MAX];
+    struct siplog_qent *qe, *head, *tail, *rest;
+    int i, nrr, more;
+
+    nrr = 0;
+    rest = NULL;
+    for (qe = *headp; qe != NULL; qe = (qe == *tailp) ? NULL : qe->next) {
+	if (qe->loginfo == NULL) {
+	    rest = qe;
+	    break;
+	}
+	for (i = 0; i < nrr && rr[i].lp != qe->loginfo; i++)
+	    continue;
+	if (i == nrr) {
+	    if (nrr == SIPLOG_WI_RR_MAX) {
+		rest = qe;
+		break;
+	    }
+	    rr[nrr].lp = qe->loginfo;
+	    rr[nrr].head = qe;
+	    nrr++;
+	} else {
+	    rr[i].tail->next = qe;
+	}
+	rr[i].tail = qe;
+    }
+    if (nrr < 2)
+	return;
+
+    head = tail = NULL;
+    do {
+	more = 0;
+	for (i = 0; i < nrr; i++) {
+	    qe = rr[i].head;
+	    if (qe == NULL)
+		continue;
+	    rr[i].head = (qe == rr[i].tail) ? NULL : qe->next;
+	    if (head == NULL)
+		head = qe;
+	    else
+		tail->next = qe;
+	    tail = qe;
+	    more |= (rr[i].head != NULL);
+	}
+    } while (more);
+    tail->next = rest;
+    *headp = head;
+    if (rest == NULL)
+	*tailp = tail;
+}
+
+/*
+ * Called with the queue locked, returns once there is something in it that
+ * is worth waking up for.
+ */
+static void
+siplog_queue_wait(void)
+{
+    struct timespec now, deadline;
+    int i;
+
+    for (;;) {
+	if (siplog_queue_len == 0) {
+	    pthread_mutex_unlock(&siplog_queue_mutex);
+	    for (i = 0; i < SIPLOG_WORKER_SPINS; i++) {
+		if (__atomic_load_n(&siplog_queue_len, __ATOMIC_RELAXED) != 0)
+		    break;
+		sched_yield();
+	    }
+	    pthread_mutex_lock(&siplog_queue_mutex);
+	    if (siplog_queue_len == 0) {
+		siplog_worker_parked = SIPLOG_PARKED_IDLE;
+		pthread_cond_wait(&siplog_queue_cond, &siplog_queue_mutex);
+		siplog_worker_parked = SIPLOG_PARKED_NOT;
+	    }
+	    continue;
+	}
+	if (siplog_queue_urgent || siplog_queue_len >= siplog_worker_fill)
+	    return;
+	deadline = siplog_queue_since;
+	deadline.tv_nsec += siplog_worker_latency;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+	deadline.tv_nsec %= 1000000000L;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec &&
+	  now.tv_nsec >= deadline.tv_nsec))
+	    return;
+	siplog_worker_parked = SIPLOG_PARKED_BATCH;
+	pthread_cond_timedwait(&siplog_queue_cond, &siplog_queue_mutex,
+	  &deadline);
+	siplog_worker_parked = SIPLOG_PARKED_NOT;
+    }
+}
+
+void
+siplog_queue_run(void)
+{
+    struct siplog_qent *qe, *qe_next, *lo, *lo_tail, *hi_tail;
+    struct siplog_private *private;
+    struct loginfo *lp;
+    struct siplog_wi *batch[SIPLOG_WI_BATCH];
+    struct siplog_lane *hi_lane, *lo_lane;
+    int nbatch, inlo, sink, bsink;
+
+    hi_lane = &siplog_lanes[SIPLOG_LANE_HI];
+    lo_lane = &siplog_lanes[SIPLOG_LANE_LO];
+    nbatch = 0;
+    bsink = -1;
+    for (;;) {
+	pthread_mutex_lock(&siplog_queue_mutex);
+	siplog_queue_wait();
+	siplog_stats_lag(&siplog_queue_since);
+	/* grab everything that is queued so far, high priority lane first */
+	lo = lo_lane->head;
+	lo_tail = lo_lane->tail;
+	qe = hi_lane->head;
+	hi_tail = hi_lane->tail;
+	__atomic_store_n(&hi_lane->head, NULL, __ATOMIC_RELAXED);
+	hi_lane->tail = NULL;
+	__atomic_store_n(&lo_lane->head, NULL, __ATOMIC_RELAXED);
+	lo_lane->tail = NULL;
+	__atomic_store_n(&siplog_queue_len, 0, __ATOMIC_RELAXED);
+	siplog_queue_urgent = 0;
+        pthread_mutex_unlock(&siplog_queue_mutex);
+
+	if (lo != NULL)
+	    siplog_queue_interleave(&lo, &lo_tail);
+	if (qe != NULL)
+	    hi_tail->next = lo;
+	else
+	    qe = lo;
+	inlo = (qe == lo);
+
+	for (; qe != NULL; qe = qe_next) {
+	    qe_next = qe->next;
+
+	    if (qe == lo)
+		inlo = 1;
+	    /* let high priority lines that came in since overtake the rest */
+	    if (inlo && __atomic_load_n(&hi_lane->head, __ATOMIC_RELAXED) !=
+	      NULL) {
+		if (nbatch > 0) {
+		    siplog_queue_flush_batch(batch, nbatch, bsink);
+		    nbatch = 0;
+		}
+		siplog_queue_requeue(qe, lo_tail, SIPLOG_LANE_LO);
+		break;
+	    }
+
+	    sink = siplog_queue_batch_sink(qe);
+	    /* keep ordering with whatever has been batched so far */
+	    if (nbatch > 0 && sink != bsink) {
+		siplog_queue_flush_batch(batch, nbatch, bsink);
+		nbatch = 0;
+	    }
+	    if (sink != -1) {
+		bsink = sink;
+		batch[nbatch++] = SIPLOG_QE2WI(qe);
+		if (nbatch == SIPLOG_WI_BATCH) {
+		    siplog_queue_flush_batch(batch, nbatch, bsink);
+		    nbatch = 0;
+		}
+		continue;
+	    }
+
+            /* main work here */
+	    switch (qe->item_type) {
+		case SIPLOG_ITEM_ASYNC_OPEN:
+		    private = (struct siplog_private *)qe->loginfo->private;
+		    siplog_queue_handle_open(qe->loginfo, private->oname);
+		    break;
+
+		case SIPLOG_ITEM_ASYNC_WRITE:
+		    siplog_queue_handle_write(SIPLOG_QE2WI(qe));
+		    siplog_queue_free_item(SIPLOG_QE2WI(qe));
+		    break;
+
+		case SIPLOG_ITEM_ASYNC_CLOSE:
+		    lp = qe->loginfo;
+		    siplog_queue_handle_close(lp);
+		    /* free loginfo structure, qe is part of its private */
+		    free(lp->private);
+		    siplog_free(lp);
+		    break;
+
+		case SIPLOG_ITEM_ASYNC_OWRC:
+		    siplog_queue_handle_owrc(SIPLOG_QE2WI(qe));
+		    siplog_queue_free_item(SIPLOG_QE2WI(qe));
+		    break;
+
+                case SIPLOG_ITEM_ASYNC_EXIT:
+                    if (siplog_collector_fd != -1)
+                        siplog_collector_disconnect();
+                    return;
+
+                case SIPLOG_ITEM_ASYNC_HBEAT:
+		    private = (struct siplog_private *)qe->loginfo->private;
+		    __atomic_store_n(&private->hbeat_pending, 0,
+		      __ATOMIC_RELEASE);
+                    siplog_queue_handle_hbeat(qe->loginfo);
+                    break;
+
+		default:
+		    break;
+	    }
+	}
+	if (nbatch > 0) {
+	    siplog_queue_flush_batch(batch, nbatch, bsink);
+	    nbatch = 0;
+	}
+	siplog_stats_publish(0);
     }
 }
 
 static int
 siplog_queue_init(void)
 {
+    pthread_condattr_t cattr;
+    const char *cp;
     int i;
 
     memset(siplog_wi_pool, 0, sizeof(siplog_wi_pool));
@@ -348,12 +1016,38 @@ siplog_queue_init(void)
     siplog_wi_pool[SIPLOG_WI_POOL_SIZE - 1].next = NULL;
 
     siplog_wi_free = siplog_wi_pool;
-    siplog_wi_queue = NULL;
-    siplog_wi_queue_tail = NULL;
+    siplog_wi_nfree = SIPLOG_WI_POOL_SIZE;
+    memset(siplog_lanes, 0, sizeof(siplog_lanes));
 
     siplog_dropped_items = 0;
 
-    pthread_cond_init(&siplog_queue_cond, NULL);
+    cp = getenv("SIPLOG_MAX_MSG_LEN");
+    siplog_wi_maxlen = (cp != NULL) ? strtoul(cp, NULL, 10) : SIPLOG_WI_MAX_LEN;
+    if (siplog_wi_maxlen < SIPLOG_WI_DATA_LEN)
+	siplog_wi_maxlen = SIPLOG_WI_DATA_LEN;
+
+    cp = getenv("SIPLOG_ASYNC_FILL");
+    siplog_worker_fill = (cp != NULL) ? atoi(cp) : SIPLOG_WORKER_FILL;
+    if (siplog_worker_fill < 1)
+	siplog_worker_fill = 1;
+    cp = getenv("SIPLOG_ASYNC_LATENCY");
+    siplog_worker_latency = ((cp != NULL) ? atol(cp) : SIPLOG_WORKER_LATENCY) *
+      1000000L;
+    if (siplog_worker_latency < 0)
+	siplog_worker_latency = 0;
+    siplog_worker_parked = SIPLOG_PARKED_NOT;
+    siplog_queue_len = 0;
+    siplog_queue_urgent = 0;
+    siplog_wi_free_waiters = 0;
+    siplog_wi_nactive = 0;
+    cp = getenv("SIPLOG_HANDLE_QUOTA");
+    siplog_wi_quota = (cp != NULL) ? atoi(cp) : 0;
+
+    /* Batching deadlines are on the monotonic clock */
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&siplog_queue_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
     pthread_mutex_init(&siplog_queue_mutex, NULL);
     pthread_cond_init(&siplog_wi_free_cond, NULL);
     pthread_mutex_init(&siplog_wi_free_mutex, NULL);
@@ -364,10 +1058,9 @@ siplog_queue_init(void)
     return 0;
 }
 
-int
-siplog_logfile_async_open(struct loginfo *lp)
+static int
+siplog_async_open(struct loginfo *lp, int sink)
 {
-    struct siplog_wi *wi;
     struct siplog_private *private;
 
     pthread_mutex_lock(&siplog_init_mutex);
@@ -395,125 +1088,292 @@ siplog_logfile_async_open(struct loginfo *lp)
 
     memset(private, 0, sizeof(*private));
     private->fd = -1;
+    private->sink = sink;
+    private->open_qe.item_type = SIPLOG_ITEM_ASYNC_OPEN;
+    private->open_qe.loginfo = lp;
+    private->hbeat_qe.item_type = SIPLOG_ITEM_ASYNC_HBEAT;
+    private->hbeat_qe.loginfo = lp;
+    private->close_qe.item_type = SIPLOG_ITEM_ASYNC_CLOSE;
+    private->close_qe.loginfo = lp;
 
     lp->private = (void *)private;
 
-    if ((lp->flags & LF_REOPEN) == 0) {
-	wi = siplog_queue_get_free_item(SIPLOG_WI_NOWAIT);
-	if (wi == NULL) {
-            free(lp->private);
-	    return -1;
-        }
+    /* Collector handles only open the log file if they have to fall back */
+    if ((lp->flags & LF_REOPEN) == 0 && sink == SIPLOG_SINK_FILE) {
+	private->oname = getenv("SIPLOG_LOGFILE_FILE");
+	if (private->oname == NULL)
+            private->oname = SIPLOG_DEFAULT_PATH;
 
-	wi->item_type = SIPLOG_ITEM_ASYNC_OPEN;
-	wi->loginfo = lp;
-	wi->len = 0;
-	wi->name = getenv("SIPLOG_LOGFILE_FILE");
-	if (wi->name == NULL)
-            wi->name = SIPLOG_DEFAULT_PATH;
-
-	siplog_queue_put_item(wi);
+	siplog_queue_put_item(&private->open_qe, SIPLOG_LANE_HI);
     }
     return 0;
 }
 
-void
-siplog_logfile_async_write(struct loginfo *lp, const char *tstamp, const char *estr,
-  const char *idx_id, const char *fmt, va_list ap)
+int
+siplog_logfile_async_open(struct loginfo *lp)
 {
-    struct siplog_wi *wi;
-    char *p;
-    int s1, s2;
 
-    wi = siplog_queue_get_free_item(SIPLOG_WI_NOWAIT);
-    if (wi == NULL)
-	return;
-
-    do {
-	p = wi->data;
-	s1 = sizeof(wi->data);
+    return (siplog_async_open(lp, SIPLOG_SINK_FILE));
+}
 
-	s2 = snprintf(p, s1, "%s/%s/%s[%d]: ", tstamp, lp->call_id, lp->app, lp->pid);
-	if (s2 >= s1) {
-	    /* message was truncated */
-	    p[s1 - 2] = '\n';
-	    break;
-	}
-	p += s2;
-	s1 -= s2;
+int
+siplog_collector_open(struct loginfo *lp)
+{
 
-	s2 = vsnprintf(p, s1, fmt, ap);
-	if (s2 >= s1) {
-	    /* message was truncated */
-	    p[s1 - 2] = '\n';
-	    break;
-	}
-	p += s2;
-	s1 -= s2;
-
-	if (estr != NULL) {
-	    s2 = snprintf(p, s1, ": %s", estr);
-	    if (s2 >= s1) {
-		/* message was truncated */
-		p[s1 - 2] = '\n';
-		break;
-	    }
-	    p += s2;
-	    s1 -= s2;
-	}
+    return (siplog_async_open(lp, SIPLOG_SINK_COLLECTOR));
+}
 
-	if (s1 == 1) {
-	    /* message was truncated */
-	    p -= 1;
-	}
+int
+siplog_stderr_async_open(struct loginfo *lp)
+{
 
-	p[0] = '\n';
-	p[1] = '\0';
+    return (siplog_async_open(lp, SIPLOG_SINK_STDERR));
+}
 
-    } while (0);
+static void
+siplog_async_set_idx(struct siplog_wi *wi, const char *idx_id)
+{
 
     if (idx_id != NULL) {
         strlcpy(wi->idx_id, idx_id, sizeof(wi->idx_id));
     } else {
         wi->idx_id[0] = '\0';
     }
+}
+
+/* Fill in the rest of a formatted item and queue it for the worker */
+static void
+siplog_async_submit(struct loginfo *lp, struct siplog_wi *wi)
+{
+    int sink;
 
-    if ((lp->flags & LF_REOPEN) != 0) {
-	wi->item_type = SIPLOG_ITEM_ASYNC_OWRC;
+    sink = ((struct siplog_private *)lp->private)->sink;
+    if (sink == SIPLOG_SINK_COLLECTOR ||
+      ((lp->flags & LF_REOPEN) != 0 && sink == SIPLOG_SINK_FILE)) {
+	wi->qe.item_type = SIPLOG_ITEM_ASYNC_OWRC;
 	wi->name = getenv("SIPLOG_LOGFILE_FILE");
 	if (wi->name == NULL)
 	    wi->name = SIPLOG_DEFAULT_PATH;
     } else {
-	wi->item_type = SIPLOG_ITEM_ASYNC_WRITE;
+	wi->qe.item_type = SIPLOG_ITEM_ASYNC_WRITE;
     }
-    wi->loginfo = lp;
-    wi->len = strlen(wi->data);
+    wi->qe.loginfo = lp;
 
-    siplog_queue_put_item(wi);
+    siplog_queue_put_item(&wi->qe, SIPLOG_LANE(wi->level));
 }
 
+/*
+ * Lines that fit into the item are formatted into it right away, longer
+ * ones are formatted again into a heap block of the right size, at most
+ * siplog_wi_maxlen bytes, that is released once the line is written out.
+ */
 void
-siplog_logfile_async_close(struct loginfo *lp)
+siplog_logfile_async_write(struct loginfo *lp, int level, const char *tstamp,
+  const char *estr, const char *idx_id, const char *fmt, va_list ap)
 {
     struct siplog_wi *wi;
+    va_list aq;
+    size_t size;
+    int len;
 
-    wi = siplog_queue_get_free_item(SIPLOG_WI_WAIT);
-    wi->item_type = SIPLOG_ITEM_ASYNC_CLOSE;
-    wi->loginfo = lp;
-    wi->len = 0;
+    wi = siplog_queue_get_free_item(lp, SIPLOG_WI_NOWAIT, level);
+    if (wi == NULL)
+	return;
+
+    va_copy(aq, ap);
+    len = siplog_format_line(wi->data, sizeof(wi->data), lp, tstamp, estr,
+      fmt, aq);
+    va_end(aq);
+    if (len < 0) {
+	siplog_queue_free_item(wi);
+	return;
+    }
+    if ((size_t)len < sizeof(wi->data)) {
+	wi->len = len;
+    } else {
+	size = MIN((size_t)len + 1, siplog_wi_maxlen);
+	wi->ext = malloc(size);
+	if (wi->ext != NULL) {
+	    len = siplog_format_line(wi->ext, size, lp, tstamp, estr, fmt, ap);
+	    wi->len = MIN((size_t)len, size - 1);
+	} else {
+	    /* Out of memory, settle for what has fit into the item */
+	    wi->len = sizeof(wi->data) - 1;
+	}
+    }
 
-    siplog_queue_put_item(wi);
+    siplog_async_set_idx(wi, idx_id);
+    siplog_stats_bytes(wi->len);
+    siplog_async_submit(lp, wi);
 }
 
+/*
+ * Pre-formatted data is copied once, right after the prefix, into the item
+ * or, when it doesn't fit, into a heap block just like for long lines.
+ */
 void
-siplog_logfile_async_hbeat(struct loginfo *lp)
+siplog_logfile_async_writev(struct loginfo *lp, int level, const char *tstamp,
+  const char *idx_id, const struct iovec *iov, int iovcnt)
 {
     struct siplog_wi *wi;
+    size_t plen, dlen, size;
+    char *buf;
+    int i, r;
+
+    wi = siplog_queue_get_free_item(lp, SIPLOG_WI_NOWAIT, level);
+    if (wi == NULL) {
+	/* Not logged after all, see siplog_emitv() */
+	siplog_site_acct.emitted = 0;
+	return;
+    }
 
-    wi = siplog_queue_get_free_item(SIPLOG_WI_WAIT);
-    wi->item_type = SIPLOG_ITEM_ASYNC_HBEAT;
-    wi->loginfo = lp;
-    wi->len = 0;
+    r = snprintf(wi->data, sizeof(wi->data), "%s/%s/%s[%d]: ", tstamp,
+      lp->call_id, lp->app, lp->pid);
+    if (r < 0) {
+	siplog_queue_free_item(wi);
+	return;
+    }
+    plen = MIN((size_t)r, sizeof(wi->data) - 2);
+    dlen = 0;
+    for (i = 0; i < iovcnt; i++)
+	dlen += iov[i].iov_len;
+    buf = wi->data;
+    size = sizeof(wi->data);
+    if (plen + dlen + 1 >= size) {
+	size = MIN(plen + dlen + 2, siplog_wi_maxlen);
+	wi->ext = malloc(size);
+	if (wi->ext != NULL) {
+	    buf = wi->ext;
+	    memcpy(buf, wi->data, plen);
+	} else {
+	    /* Out of memory, settle for what fits into the item */
+	    size = sizeof(wi->data);
+	}
+    }
+    dlen = MIN(siplog_iov_flatten(buf + plen, size - plen - 1, iov, iovcnt),
+      size - plen - 2);
+    buf[plen + dlen] = '\n';
+    buf[plen + dlen + 1] = '\0';
+    wi->len = plen + dlen + 1;
+
+    siplog_async_set_idx(wi, idx_id);
+    siplog_stats_bytes(wi->len);
+    siplog_async_submit(lp, wi);
+}
 
-    siplog_queue_put_item(wi);
+/*
+ * Line that a fan-out handle has formatted already is not copied, the
+ * item keeps a reference to it until written out. Flight recorder
+ * contents are the context of an error and are not to be lost, but the
+ * line that has triggered them is not to wait for the worker either, so
+ * they get an item of their own off the heap.
+ */
+void
+siplog_logfile_async_writeb(struct loginfo *lp, int level, const char *idx_id,
+  struct siplog_lbuf *lb)
+{
+    struct siplog_wi *wi;
+
+    if ((lb->flags & SIPLOG_LBUF_REPLAY) != 0) {
+	wi = siplog_queue_heap_item(level);
+    } else {
+	wi = siplog_queue_get_free_item(lp, SIPLOG_WI_NOWAIT, level);
+    }
+    if (wi == NULL)
+	return;
+    siplog_lbuf_hold(lb);
+    wi->lbuf = lb;
+    wi->ext = lb->data;
+    wi->len = lb->len;
+    siplog_async_set_idx(wi, idx_id);
+    siplog_async_submit(lp, wi);
+}
+
+/*
+ * Hand out the space right after the prefix in the item itself or, for
+ * large reservations, in a heap block, to be formatted into by the caller
+ * in place. The item goes to the worker once committed and back to the
+ * pool if abandoned.
+ */
+char *
+siplog_logfile_async_reserve(struct loginfo *lp, int level, const char *tstamp,
+  const char *idx_id, size_t size, void **cookie)
+{
+    struct siplog_wi *wi;
+    size_t plen;
+    int r;
+
+    wi = siplog_queue_get_free_item(lp, SIPLOG_WI_NOWAIT, level);
+    if (wi == NULL)
+	return (NULL);
+
+    r = snprintf(wi->data, sizeof(wi->data), "%s/%s/%s[%d]: ", tstamp,
+      lp->call_id, lp->app, lp->pid);
+    if (r < 0 || (size_t)r > sizeof(wi->data) - 2)
+	goto e0;
+    plen = r;
+    if (plen + size + 1 >= sizeof(wi->data)) {
+	if (plen + size + 2 > siplog_wi_maxlen)
+	    goto e0;
+	wi->ext = malloc(plen + size + 2);
+	if (wi->ext == NULL)
+	    goto e0;
+	memcpy(wi->ext, wi->data, plen);
+    }
+    wi->len = plen;
+    siplog_async_set_idx(wi, idx_id);
+    *cookie = wi;
+    return (SIPLOG_WI_BUF(wi) + plen);
+e0:
+    siplog_queue_free_item(wi);
+    return (NULL);
+}
+
+void
+siplog_logfile_async_commit(struct loginfo *lp, void *cookie, size_t len)
+{
+    struct siplog_wi *wi;
+    char *buf;
+
+    wi = (struct siplog_wi *)cookie;
+    buf = SIPLOG_WI_BUF(wi);
+    buf[wi->len + len] = '\n';
+    buf[wi->len + len + 1] = '\0';
+    wi->len += len + 1;
+    siplog_stats_bytes(wi->len);
+    siplog_async_submit(lp, wi);
+}
+
+void
+siplog_logfile_async_abandon(struct loginfo *lp __attribute__ ((unused)),
+  void *cookie)
+{
+
+    siplog_queue_free_item((struct siplog_wi *)cookie);
+}
+
+/*
+ * Neither close nor hbeat ever wait for a free item: both use control
+ * messages embedded into the handle, the worker reclaims the handle once
+ * everything queued before the close has been written out.
+ */
+void
+siplog_logfile_async_close(struct loginfo *lp)
+{
+    struct siplog_private *private;
+
+    private = (struct siplog_private *)lp->private;
+    siplog_queue_put_item(&private->close_qe, SIPLOG_LANE_LO);
+}
+
+void
+siplog_logfile_async_hbeat(struct loginfo *lp)
+{
+    struct siplog_private *private;
+
+    private = (struct siplog_private *)lp->private;
+    /* Coalesce with the one that is already in the queue, if any */
+    if (__atomic_exchange_n(&private->hbeat_pending, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    siplog_queue_put_item(&private->hbeat_qe, SIPLOG_LANE_LO);
 }
@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Buffered log file backend, "logfile_buffered", for single-threaded
+ * event loop applications that can't have a worker thread. Lines are
+ * formatted right into a per-process buffer and go out to the file all
+ * at once, with a single writev(2), when:
+ *
+ *  - siplog_hbeat() is called on any of the handles;
+ *  - the buffer is full, its size is SIPLOG_BUFFER_SIZE bytes;
+ *  - an ERR or CRIT line comes in;
+ *  - a line comes in more than SIPLOG_BUFFER_LATENCY ms after the oldest
+ *    one still in the buffer;
+ *  - the last handle is closed, or the process exits.
+ *
+ * siplog_hbeat_hint() tells the loop how long it can wait before calling
+ * siplog_hbeat() to keep within the latency.
+ */
+
+#define _FILE_OFFSET_BITS  64
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "siplog.h"
+#include "internal/_siplog.h"
+#include "internal/siplog_fanout.h"
+#include "internal/siplog_logfile_buf.h"
+#include "internal/siplog_stats.h"
+
+#define SIPLOG_BUF_SIZE		(64 * 1024)
+#define SIPLOG_BUF_LATENCY	100
+/* Buffer is flushed before formatting a line if it has less room left */
+#define SIPLOG_BUF_MINROOM	128
+/* Most lines kept in the buffer, for the sake of the call-id index */
+#define SIPLOG_BUF_MAXLINES	1024
+/* Initial room for the call-ids of the lines in the buffer */
+#define SIPLOG_BUF_IDSIZE	4096
+
+struct siplog_bufline {
+    size_t len;
+    int idx_off;	/* of the call-id in ids, -1 if none */
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    char *data;
+    size_t size;
+    size_t len;
+    char *ids;
+    size_t ids_size;
+    size_t ids_len;
+    struct siplog_bufline lines[SIPLOG_BUF_MAXLINES];
+    int nlines;
+    struct timespec since;	/* when the oldest line has been buffered */
+    long latency;		/* ms */
+    int inited;
+    int nhandles;		/* open ones, the last to close frees it */
+    int hooked;		/* atexit and atfork handlers are in place */
+} siplog_buf = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static void siplog_buf_flush(const char *, size_t, const char *);
+
+static long
+siplog_buf_age(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - siplog_buf.since.tv_sec) * 1000 +
+      (now.tv_nsec - siplog_buf.since.tv_nsec) / 1000000);
+}
+
+static void
+siplog_buf_atexit(void)
+{
+
+    pthread_mutex_lock(&siplog_buf.mutex);
+    siplog_buf_flush(NULL, 0, NULL);
+    pthread_mutex_unlock(&siplog_buf.mutex);
+}
+
+static void
+siplog_buf_prefork(void)
+{
+
+    pthread_mutex_lock(&siplog_buf.mutex);
+}
+
+static void
+siplog_buf_postfork_parent(void)
+{
+
+    pthread_mutex_unlock(&siplog_buf.mutex);
+}
+
+static void
+siplog_buf_postfork_child(void)
+{
+
+    /* What's buffered is the parent's to write out */
+    siplog_buf.len = 0;
+    siplog_buf.nlines = 0;
+    siplog_buf.ids_len = 0;
+    pthread_mutex_unlock(&siplog_buf.mutex);
+}
+
+/* Called with the buffer locked */
+static int
+siplog_buf_init(void)
+{
+    const char *cp;
+    long size;
+
+    cp = getenv("SIPLOG_BUFFER_SIZE");
+    size = (cp != NULL) ? atol(cp) : SIPLOG_BUF_SIZE;
+    if (size < 1024)
+        size = 1024;
+    cp = getenv("SIPLOG_BUFFER_LATENCY");
+    siplog_buf.latency = (cp != NULL) ? atol(cp) : SIPLOG_BUF_LATENCY;
+    if (siplog_buf.latency < 0)
+        siplog_buf.latency = 0;
+    siplog_buf.data = malloc(size);
+    siplog_buf.ids = malloc(SIPLOG_BUF_IDSIZE);
+    if (siplog_buf.data == NULL || siplog_buf.ids == NULL) {
+        free(siplog_buf.data);
+        free(siplog_buf.ids);
+        siplog_buf.data = siplog_buf.ids = NULL;
+        return (-1);
+    }
+    siplog_buf.size = size;
+    siplog_buf.ids_size = SIPLOG_BUF_IDSIZE;
+    if (!siplog_buf.hooked) {
+        atexit(siplog_buf_atexit);
+        pthread_atfork(siplog_buf_prefork, siplog_buf_postfork_parent,
+          siplog_buf_postfork_child);
+        siplog_buf.hooked = 1;
+    }
+    siplog_buf.inited = 1;
+    return (0);
+}
+
+/*
+ * Write out everything that is in the buffer, followed by the line that
+ * doesn't fit into it, if any, and index them. Called with the buffer
+ * locked.
+ */
+static void
+siplog_buf_flush(const char *extra, size_t elen, const char *eidx)
+{
+    struct siplog_bufline *blp;
+    struct iovec iov[2];
+    off_t offset, pos;
+    int fd, i, n;
+
+    if (siplog_buf.len == 0 && elen == 0)
+        return;
+    fd = open(siplog_logfile_path(), O_CREAT | O_APPEND | O_WRONLY, 0666);
+    if (fd == -1)
+        goto out;
+    n = 0;
+    if (siplog_buf.len > 0) {
+        iov[n].iov_base = siplog_buf.data;
+        iov[n++].iov_len = siplog_buf.len;
+    }
+    if (elen > 0) {
+        iov[n].iov_base = (void *)extra;
+        iov[n++].iov_len = elen;
+    }
+    offset = siplog_lockf(fd);
+    writev(fd, iov, n);
+    siplog_update_tsindex(fd, offset);
+    siplog_unlockf(fd, offset);
+    pos = offset;
+    for (i = 0; i < siplog_buf.nlines; i++) {
+        blp = &siplog_buf.lines[i];
+        if (blp->idx_off >= 0)
+            siplog_update_index(siplog_buf.ids + blp->idx_off, fd, pos,
+              blp->len);
+        pos += blp->len;
+    }
+    if (elen > 0)
+        siplog_update_index(eidx, fd, pos, elen);
+    siplog_closef(fd);
+out:
+    siplog_buf.len = 0;
+    siplog_buf.nlines = 0;
+    siplog_buf.ids_len = 0;
+}
+
+/*
+ * Account for a line of len bytes that has been put at the end of the
+ * buffer and decide if it's time to flush. Called with the buffer locked.
+ */
+static void
+siplog_buf_added(int level, const char *idx_id, size_t len)
+{
+    struct siplog_bufline *blp;
+    size_t idlen, nsize;
+    char *cp;
+
+    if (siplog_buf.nlines == 0)
+        clock_gettime(CLOCK_MONOTONIC, &siplog_buf.since);
+    blp = &siplog_buf.lines[siplog_buf.nlines++];
+    blp->len = len;
+    blp->idx_off = -1;
+    siplog_buf.len += len;
+    if (idx_id != NULL && idx_id[0] != '\0') {
+        idlen = strlen(idx_id) + 1;
+        if (siplog_buf.ids_len + idlen > siplog_buf.ids_size) {
+            nsize = MAX(siplog_buf.ids_size * 2, siplog_buf.ids_len + idlen);
+            cp = realloc(siplog_buf.ids, nsize);
+            if (cp != NULL) {
+                siplog_buf.ids = cp;
+                siplog_buf.ids_size = nsize;
+            }
+        }
+        if (siplog_buf.ids_len + idlen <= siplog_buf.ids_size) {
+            memcpy(siplog_buf.ids + siplog_buf.ids_len, idx_id, idlen);
+            blp->idx_off = siplog_buf.ids_len;
+            siplog_buf.ids_len += idlen;
+        }
+    }
+    if (level >= SIPLOG_ERR || siplog_buf.nlines == SIPLOG_BUF_MAXLINES ||
+      siplog_buf.size - siplog_buf.len < SIPLOG_BUF_MINROOM ||
+      siplog_buf_age() >= siplog_buf.latency)
+        siplog_buf_flush(NULL, 0, NULL);
+}
+
+/*
+ * Get the buffer locked, with at least len bytes free if possible.
+ * Returns the number of bytes free, -1 if it can't be set up.
+ */
+static ssize_t
+siplog_buf_lock(size_t len)
+{
+
+    pthread_mutex_lock(&siplog_buf.mutex);
+    if (!siplog_buf.inited && siplog_buf_init() != 0) {
+        pthread_mutex_unlock(&siplog_buf.mutex);
+        return (-1);
+    }
+    if (siplog_buf.size - siplog_buf.len < len)
+        siplog_buf_flush(NULL, 0, NULL);
+    return (siplog_buf.size - siplog_buf.len);
+}
+
+int
+siplog_logfile_buf_open(struct loginfo *lp)
+{
+
+    lp->private = NULL;
+    pthread_mutex_lock(&siplog_buf.mutex);
+    siplog_buf.nhandles++;
+    pthread_mutex_unlock(&siplog_buf.mutex);
+    return (0);
+}
+
+/*
+ * The line is formatted right into the buffer. If it doesn't fit, the
+ * buffer is flushed and it's tried again, lines that are longer than the
+ * whole buffer are formatted into a heap block and written out with it.
+ */
+void
+siplog_logfile_buf_write(struct loginfo *lp, int level, const char *tstamp,
+  const char *estr, const char *idx_id, const char *fmt, va_list ap)
+{
+    va_list aq;
+    ssize_t room;
+    char *buf;
+    int len;
+
+    room = siplog_buf_lock(SIPLOG_BUF_MINROOM);
+    if (room < 0)
+        return;
+    va_copy(aq, ap);
+    len = siplog_format_line(siplog_buf.data + siplog_buf.len, room, lp,
+      tstamp, estr, fmt, aq);
+    va_end(aq);
+    if (len < 0)
+        goto out;
+    if (len >= room && siplog_buf.len > 0) {
+        siplog_buf_flush(NULL, 0, NULL);
+        room = siplog_buf.size;
+        va_copy(aq, ap);
+        len = siplog_format_line(siplog_buf.data, room, lp, tstamp, estr,
+          fmt, aq);
+        va_end(aq);
+        if (len < 0)
+            goto out;
+    }
+    if (len < room) {
+        siplog_stats_bytes(len);
+        siplog_buf_added(level, idx_id, len);
+        goto out;
+    }
+    buf = malloc(len + 1);
+    if (buf == NULL) {
+        /* Settle for what has fit */
+        siplog_stats_bytes(room - 1);
+        siplog_buf_added(level, idx_id, room - 1);
+        goto out;
+    }
+    len = siplog_format_line(buf, len + 1, lp, tstamp, estr, fmt, ap);
+    siplog_stats_bytes(len);
+    siplog_buf_flush(buf, len, idx_id);
+    free(buf);
+out:
+    pthread_mutex_unlock(&siplog_buf.mutex);
+}
+
+void
+siplog_logfile_buf_writev(struct loginfo *lp, int level, const char *tstamp,
+  const char *idx_id, const struct iovec *iov, int iovcnt)
+{
+    char prefix[512], *buf;
+    size_t plen, dlen;
+    ssize_t room;
+    int i, r;
+
+    r = snprintf(prefix, sizeof(prefix), "%s/%s/%s[%d]: ", tstamp,
+      lp->call_id, lp->app, lp->pid);
+    if (r < 0)
+        return;
+    plen = MIN((size_t)r, sizeof(prefix) - 1);
+    dlen = 0;
+    for (i = 0; i < iovcnt; i++)
+        dlen += iov[i].iov_len;
+    room = siplog_buf_lock(plen + dlen + 1);
+    if (room < 0)
+        return;
+    if ((size_t)room >= plen + dlen + 1) {
+        buf = siplog_buf.data + siplog_buf.len;
+        memcpy(buf, prefix, plen);
+        siplog_iov_flatten(buf + plen, dlen + 1, iov, iovcnt);
+        buf[plen + dlen] = '\n';
+        siplog_stats_bytes(plen + dlen + 1);
+        siplog_buf_added(level, idx_id, plen + dlen + 1);
+    } else {
+        /* Larger than the whole buffer, goes out as is */
+        buf = malloc(plen + dlen + 1);
+        if (buf != NULL) {
+            memcpy(buf, prefix, plen);
+            siplog_iov_flatten(buf + plen, dlen + 1, iov, iovcnt);
+            buf[plen + dlen] = '\n';
+            siplog_stats_bytes(plen + dlen + 1);
+            siplog_buf_flush(buf, plen + dlen + 1, idx_id);
+            free(buf);
+        }
+    }
+    pthread_mutex_unlock(&siplog_buf.mutex);
+}
+
+void
+siplog_logfile_buf_writeb(struct loginfo *lp __attribute__ ((unused)),
+  int level, const char *idx_id, struct siplog_lbuf *lb)
+{
+    ssize_t room;
+
+    room = siplog_buf_lock(lb->len);
+    if (room < 0)
+        return;
+    if ((size_t)room >= lb->len) {
+        memcpy(siplog_buf.data + siplog_buf.len, lb->data, lb->len);
+        siplog_buf_added(level, idx_id, lb->len);
+    } else {
+        siplog_buf_flush(lb->data, lb->len, idx_id);
+    }
+    pthread_mutex_unlock(&siplog_buf.mutex);
+}
+
+void
+siplog_logfile_buf_hbeat(struct loginfo *lp __attribute__ ((unused)))
+{
+
+    pthread_mutex_lock(&siplog_buf.mutex);
+    siplog_buf_flush(NULL, 0, NULL);
+    pthread_mutex_unlock(&siplog_buf.mutex);
+}
+
+/*
+ * Handles share the buffer, it's written out and freed once the last one
+ * is closed. Until then, what's in it is left for the next flush.
+ */
+void
+siplog_logfile_buf_close(struct loginfo *lp __attribute__ ((unused)))
+{
+
+    pthread_mutex_lock(&siplog_buf.mutex);
+    if (--siplog_buf.nhandles == 0 && siplog_buf.inited) {
+        siplog_buf_flush(NULL, 0, NULL);
+        free(siplog_buf.data);
+        free(siplog_buf.ids);
+        siplog_buf.data = siplog_buf.ids = NULL;
+        siplog_buf.size = siplog_buf.ids_size = 0;
+        siplog_buf.inited = 0;
+    }
+    pthread_mutex_unlock(&siplog_buf.mutex);
+}
+
+/*
+ * No descriptor to watch, the file is only opened for the flush. Timeout
+ * is how soon the oldest line that is buffered is due, -1 if there are
+ * none.
+ */
+int
+siplog_logfile_buf_hint(struct loginfo *lp __attribute__ ((unused)),
+  int *timeout)
+{
+
+    pthread_mutex_lock(&siplog_buf.mutex);
+    if (siplog_buf.nlines == 0)
+        *timeout = -1;
+    else
+        *timeout = MAX(siplog_buf.latency - siplog_buf_age(), 0);
+    pthread_mutex_unlock(&siplog_buf.mutex);
+    return (-1);
+}
@@ -31,18 +31,28 @@
  * unallocated memory. Our attitude here is "fail with core dump early" if
  * some error of inconsistency is found to aid debugging. Some extra smarts
  * can be added, such as guard area to detect any buffer overflows.
+ *
+ * For use in production the layer can be switched at runtime into the
+ * sampling mode (see siplog_memdeb_setsampling() or SIPLOG_MEMDEB_SAMPLE
+ * environment variable), in which only about one allocation per N bytes
+ * is attributed to its call site, Poisson-style, and all per-site figures
+ * are scaled up estimates. Allocations that are not sampled only pay for
+ * the header and a thread-local countdown.
  */
 
 #include <sys/types.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "siplog.h"
 #include "siplog_mem_debug.h"
+#include "internal/siplog_sitetab.h"
 
 #undef malloc
 #undef free
@@ -53,26 +63,77 @@
 
 #define UNUSED(x) (void)(x)
 
+/*
+ * Allocation size histogram: bucket 0 counts sizes up to 16 bytes, each
+ * next one doubles the upper bound, the last one catches everything else.
+ */
+#define MEMDEB_NHIST		16
+#define MEMDEB_HIST_MINLOG2	4
+
+/* How many call sites siplog_memdeb_dumpstats() ranks by live bytes */
+#define MEMDEB_TOPN		10
+
 struct memdeb_stats {
     int64_t nalloc;
     int64_t nunalloc_baseln;
     int64_t nfree;
     int64_t nrealloc;
     int64_t afails;
+    int64_t live_bytes;
+    int64_t peak_bytes;
+    int64_t hist[MEMDEB_NHIST];
 };
 
+/*
+ * Per-node counters are only ever updated with relaxed atomic increments
+ * and folded together by the readers, so the allocation fast path does
+ * not serialise on any lock.
+ */
+#define MEMDEB_INC(mnp, fld) \
+    (void)__atomic_add_fetch(&(mnp)->mstats.fld, 1, __ATOMIC_RELAXED)
+#define MEMDEB_ADD(mnp, fld, n) \
+    __atomic_add_fetch(&(mnp)->mstats.fld, (n), __ATOMIC_RELAXED)
+#define MEMDEB_GET(mnp, fld) \
+    __atomic_load_n(&(mnp)->mstats.fld, __ATOMIC_RELAXED)
+
 #define MEMDEB_SIGNATURE 0x8b26e00041dfdec6UL
 
 struct memdeb_node
 {
-    uint64_t magic;
-    const char *fname;
-    int linen;
-    const char *funcn;
+    struct siplog_sitetab_ent ent;	/* has to be the first */
     struct memdeb_stats mstats;
-    struct memdeb_node *next;
 };
 
+#define MEMDEB_HDR_SIGNATURE 0x6c5dc3a1be0e4f27UL
+
+/*
+ * Header stored in front of every block handed out to the caller, four
+ * words keep the returned pointer aligned the same way malloc(3) does.
+ * The mnp is NULL for blocks that were not picked by the sampler, weight
+ * is the number of allocations the sampled block stands for.
+ */
+struct memdeb_hdr
+{
+    struct memdeb_node *mnp;
+    size_t size;
+    uint64_t weight;
+    uint64_t magic;
+};
+
+static unsigned long memdeb_sample_rate;
+static pthread_once_t memdeb_sample_once = PTHREAD_ONCE_INIT;
+
+static __thread struct {
+    unsigned long rate;
+    int64_t bytes_left;
+    uint64_t rnd;
+} memdeb_sampler;
+
+static struct {
+    int64_t live_bytes;
+    int64_t peak_bytes;
+} memdeb_totals;
+
 static struct {
     const char *funcn;
     int max_nunalloc;
@@ -82,50 +143,177 @@ static struct {
     {.funcn = NULL}
 };
 
-static struct memdeb_node *nodes;
-static pthread_mutex_t *memdeb_mutex;
+/*
+ * Call-site nodes live in a lock-free table keyed on the (fname, linen,
+ * funcn) tuple, see siplog_sitetab.c.
+ */
+static struct siplog_sitetab memdeb_tab =
+  SIPLOG_SITETAB_INITIALIZER(MEMDEB_SIGNATURE);
+static pthread_mutex_t memdeb_report_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static struct memdeb_node *
-siplog_memdeb_nget(const char *fname, int linen, const char *funcn, int doalloc)
+siplog_memdeb_nget(const char *fname, int linen, const char *funcn)
 {
-    struct memdeb_node *rval, *mnp, *lastnode;
+    struct siplog_sitetab_ent *ep;
+    struct memdeb_node *rval;
 
-    if (memdeb_mutex == NULL) {
-        memdeb_mutex = malloc(sizeof(pthread_mutex_t));
-        if (memdeb_mutex == NULL)
-            abort();
-        pthread_mutex_init(memdeb_mutex, NULL);
-    }
-    pthread_mutex_lock(memdeb_mutex);
-    lastnode = NULL;
-    for (mnp = nodes; mnp != NULL; mnp = mnp->next) {
-        if (mnp->magic != MEMDEB_SIGNATURE) {
-            /* nodelist is corrupt */
-            abort();
-        }
-        if (mnp->fname == fname && mnp->linen == linen && mnp->funcn == funcn)
-            return (mnp);
-        lastnode = mnp;
-    }
-    if (doalloc == 0) {
-        pthread_mutex_unlock(memdeb_mutex);
-        return (NULL);
-    }
+    ep = siplog_sitetab_find(&memdeb_tab, fname, linen, funcn);
+    if (ep != NULL)
+        return ((struct memdeb_node *)ep);
     rval = malloc(sizeof(struct memdeb_node));
     if (rval == NULL) {
         abort();
     }
     memset(rval, '\0', sizeof(struct memdeb_node));
-    rval->magic = MEMDEB_SIGNATURE;
-    rval->fname = fname;
-    rval->linen = linen;
-    rval->funcn = funcn;
-    if (nodes == NULL) {
-        nodes = rval;
-    } else {
-        lastnode->next = rval;
+    siplog_sitetab_init(&memdeb_tab, &rval->ent, fname, linen, funcn);
+    ep = siplog_sitetab_insert(&memdeb_tab, &rval->ent);
+    if (ep != &rval->ent)
+        free(rval);
+    return ((struct memdeb_node *)ep);
+}
+
+static void
+siplog_memdeb_sample_init(void)
+{
+    const char *cp;
+
+    cp = getenv("SIPLOG_MEMDEB_SAMPLE");
+    if (cp != NULL)
+        memdeb_sample_rate = strtoul(cp, NULL, 10);
+}
+
+unsigned long
+siplog_memdeb_setsampling(unsigned long rate)
+{
+
+    pthread_once(&memdeb_sample_once, siplog_memdeb_sample_init);
+    return (__atomic_exchange_n(&memdeb_sample_rate, rate, __ATOMIC_RELAXED));
+}
+
+/* Exponentially distributed number of bytes until the next sample */
+static int64_t
+siplog_memdeb_nextsample(unsigned long rate)
+{
+    uint64_t x;
+    double u;
+
+    if (memdeb_sampler.rnd == 0) {
+        memdeb_sampler.rnd = (uint64_t)(uintptr_t)&memdeb_sampler ^
+          ((uint64_t)getpid() << 32) ^ 0x2545f4914f6cdd1dULL;
     }
-    return (rval);
+    /* xorshift64* */
+    x = memdeb_sampler.rnd;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    memdeb_sampler.rnd = x;
+    x *= 0x2545f4914f6cdd1dULL;
+    u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return ((int64_t)(-log(u) * rate) + 1);
+}
+
+/*
+ * Decide whether allocation of the given size should be attributed to
+ * its call site. Returns 0 if not, or the estimated number of allocations
+ * of that size that the sample represents otherwise.
+ */
+static uint64_t
+siplog_memdeb_sample(size_t size)
+{
+    unsigned long rate;
+    double p;
+
+    pthread_once(&memdeb_sample_once, siplog_memdeb_sample_init);
+    rate = __atomic_load_n(&memdeb_sample_rate, __ATOMIC_RELAXED);
+    if (rate == 0)
+        return (1);
+    if (memdeb_sampler.rate != rate) {
+        memdeb_sampler.rate = rate;
+        memdeb_sampler.bytes_left = siplog_memdeb_nextsample(rate);
+    }
+    memdeb_sampler.bytes_left -= size;
+    if (memdeb_sampler.bytes_left > 0)
+        return (0);
+    memdeb_sampler.bytes_left = siplog_memdeb_nextsample(rate);
+    p = 1.0 - exp(-(double)size / rate);
+    if (p <= 0.0)
+        return (1);
+    return ((uint64_t)(1.0 / p + 0.5));
+}
+
+static void
+siplog_memdeb_peak(int64_t *peakp, int64_t live)
+{
+    int64_t peak;
+
+    peak = __atomic_load_n(peakp, __ATOMIC_RELAXED);
+    while (live > peak) {
+        if (__atomic_compare_exchange_n(peakp, &peak, live, 1,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+}
+
+static int
+siplog_memdeb_hbucket(size_t size)
+{
+    int b;
+
+    if (size <= (1 << MEMDEB_HIST_MINLOG2))
+        return (0);
+    b = 64 - __builtin_clzll((unsigned long long)size - 1) - MEMDEB_HIST_MINLOG2;
+    return (b < MEMDEB_NHIST ? b : MEMDEB_NHIST - 1);
+}
+
+/*
+ * Account for delta bytes being (de-)allocated by the call site at mnp,
+ * size is the new block size to record in the histogram or 0.
+ */
+static void
+siplog_memdeb_account(struct memdeb_node *mnp, int64_t delta, size_t size,
+  uint64_t weight)
+{
+    int64_t live;
+
+    delta *= (int64_t)weight;
+    live = MEMDEB_ADD(mnp, live_bytes, delta);
+    if (delta > 0)
+        siplog_memdeb_peak(&mnp->mstats.peak_bytes, live);
+    live = __atomic_add_fetch(&memdeb_totals.live_bytes, delta,
+      __ATOMIC_RELAXED);
+    if (delta > 0)
+        siplog_memdeb_peak(&memdeb_totals.peak_bytes, live);
+    if (size > 0)
+        MEMDEB_ADD(mnp, hist[siplog_memdeb_hbucket(size)], weight);
+}
+
+static void *
+siplog_memdeb_attach(char *cp, struct memdeb_node *mnp, size_t size,
+  uint64_t weight)
+{
+    struct memdeb_hdr hdr;
+
+    hdr.mnp = mnp;
+    hdr.size = size;
+    hdr.weight = weight;
+    hdr.magic = MEMDEB_HDR_SIGNATURE;
+    memcpy(cp, &hdr, sizeof(hdr));
+    return (cp + sizeof(hdr));
+}
+
+static char *
+siplog_memdeb_detach(void *ptr, struct memdeb_hdr *hdrp)
+{
+    char *cp;
+
+    cp = (char *)ptr - sizeof(*hdrp);
+    memcpy(hdrp, cp, sizeof(*hdrp));
+    if (hdrp->magic != MEMDEB_HDR_SIGNATURE ||
+      (hdrp->mnp != NULL && hdrp->mnp->ent.magic != MEMDEB_SIGNATURE)) {
+        /* Free of unallicated pointer or nodelist is corrupt */
+        abort();
+    }
+    return (cp);
 }
 
 void *
@@ -133,20 +321,21 @@ siplog_memdeb_malloc(size_t size, const char *fname, int linen, const char *func
 {
     struct memdeb_node *mnp;
     char *rval;
+    uint64_t weight;
 
-    mnp = siplog_memdeb_nget(fname, linen, funcn, 1);
-
-    rval = malloc(sizeof(struct memdeb_node *) + size);
+    weight = siplog_memdeb_sample(size);
+    rval = malloc(sizeof(struct memdeb_hdr) + size);
     if (rval == NULL) {
-        mnp->mstats.afails++;
-        pthread_mutex_unlock(memdeb_mutex);
+        mnp = siplog_memdeb_nget(fname, linen, funcn);
+        MEMDEB_INC(mnp, afails);
         return (NULL);
     }
-    mnp->mstats.nalloc++;
-    pthread_mutex_unlock(memdeb_mutex);
-    memcpy(rval, &mnp, sizeof(struct memdeb_node *));
-    rval += sizeof(struct memdeb_node *);
-    return (rval);
+    if (weight == 0)
+        return (siplog_memdeb_attach(rval, NULL, size, 0));
+    mnp = siplog_memdeb_nget(fname, linen, funcn);
+    MEMDEB_ADD(mnp, nalloc, weight);
+    siplog_memdeb_account(mnp, size, size, weight);
+    return (siplog_memdeb_attach(rval, mnp, size, weight));
 }
 
 void
@@ -156,18 +345,13 @@ siplog_memdeb_free(void *ptr, const char *fname, int linen, const char *funcn)
     UNUSED(linen);
     UNUSED(funcn);
     char *cp;
-    struct memdeb_node *mnp;
+    struct memdeb_hdr hdr;
 
-    cp = ptr;
-    cp -= sizeof(struct memdeb_node *);
-    memcpy(&mnp, cp, sizeof(struct memdeb_node *));
-    if (mnp->magic != MEMDEB_SIGNATURE) {
-        /* Free of unallicated pointer or nodelist is corrupt */
-        abort();
+    cp = siplog_memdeb_detach(ptr, &hdr);
+    if (hdr.mnp != NULL) {
+        MEMDEB_ADD(hdr.mnp, nfree, hdr.weight);
+        siplog_memdeb_account(hdr.mnp, -(int64_t)hdr.size, 0, hdr.weight);
     }
-    pthread_mutex_lock(memdeb_mutex);
-    mnp->mstats.nfree++;
-    pthread_mutex_unlock(memdeb_mutex);
     return free(cp);
 }
 
@@ -178,48 +362,33 @@ siplog_memdeb_realloc(void *ptr, size_t size,  const char *fname, int linen, con
     UNUSED(linen);
     UNUSED(funcn);
     char *cp;
-    struct memdeb_node *mnp;
+    struct memdeb_hdr hdr;
 
-    cp = ptr;
-    cp -= sizeof(struct memdeb_node *);
-    memcpy(&mnp, cp, sizeof(struct memdeb_node *));
-    if (mnp->magic != MEMDEB_SIGNATURE) {
-        /* Realloc of unallicated pointer or nodelist is corrupt */
-        abort();
-    }
-    cp = realloc(cp, size + sizeof(struct memdeb_node *));
+    cp = siplog_memdeb_detach(ptr, &hdr);
+    cp = realloc(cp, size + sizeof(struct memdeb_hdr));
     if (cp == NULL) {
-        pthread_mutex_lock(memdeb_mutex);
-        mnp->mstats.afails++;
-        pthread_mutex_unlock(memdeb_mutex);
+        if (hdr.mnp != NULL)
+            MEMDEB_INC(hdr.mnp, afails);
         return (cp);
     }
-    pthread_mutex_lock(memdeb_mutex);
-    mnp->mstats.nrealloc++;
-    pthread_mutex_unlock(memdeb_mutex);
-    return (cp + sizeof(struct memdeb_node *));
+    if (hdr.mnp != NULL) {
+        MEMDEB_ADD(hdr.mnp, nrealloc, hdr.weight);
+        siplog_memdeb_account(hdr.mnp, (int64_t)size - (int64_t)hdr.size,
+          size, hdr.weight);
+    }
+    return (siplog_memdeb_attach(cp, hdr.mnp, size, hdr.weight));
 }
 
 char *
 siplog_memdeb_strdup(const char *ptr, const char *fname, int linen, const char *funcn)
 {
-    struct memdeb_node *mnp;
     char *rval;
     size_t size;
 
-    mnp = siplog_memdeb_nget(fname, linen, funcn, 1);
-
     size = strlen(ptr) + 1;
-    rval = malloc(size + sizeof(struct memdeb_node *));
-    if (rval == NULL) {
-        mnp->mstats.afails++;
-        pthread_mutex_unlock(memdeb_mutex);
+    rval = siplog_memdeb_malloc(size, fname, linen, funcn);
+    if (rval == NULL)
         return (NULL);
-    }
-    mnp->mstats.nalloc++;
-    pthread_mutex_unlock(memdeb_mutex);
-    memcpy(rval, &mnp, sizeof(struct memdeb_node *));
-    rval += sizeof(struct memdeb_node *);
     memcpy(rval, ptr, size);
     return (rval);
 }
@@ -273,27 +442,154 @@ is_approved(const char *funcn)
     return (0);
 }
 
+static struct memdeb_node *
+siplog_memdeb_nnext(struct memdeb_node *mnp, int *bucketp)
+{
+
+    return ((struct memdeb_node *)siplog_sitetab_next(&memdeb_tab,
+      (struct siplog_sitetab_ent *)mnp, bucketp));
+}
+
+static void
+siplog_memdeb_nstats(struct memdeb_node *mnp, struct memdeb_stats *msp)
+{
+    int i;
+
+    msp->nalloc = MEMDEB_GET(mnp, nalloc);
+    msp->nunalloc_baseln = MEMDEB_GET(mnp, nunalloc_baseln);
+    msp->nfree = MEMDEB_GET(mnp, nfree);
+    msp->nrealloc = MEMDEB_GET(mnp, nrealloc);
+    msp->afails = MEMDEB_GET(mnp, afails);
+    msp->live_bytes = MEMDEB_GET(mnp, live_bytes);
+    msp->peak_bytes = MEMDEB_GET(mnp, peak_bytes);
+    for (i = 0; i < MEMDEB_NHIST; i++)
+        msp->hist[i] = MEMDEB_GET(mnp, hist[i]);
+}
+
+#define MEMDEB_FOREACH(mnp, bucket) \
+    for ((bucket) = -1, (mnp) = siplog_memdeb_nnext(NULL, &(bucket)); \
+      (mnp) != NULL; (mnp) = siplog_memdeb_nnext((mnp), &(bucket)))
+
+struct memdeb_rank {
+    struct memdeb_node *mnp;
+    struct memdeb_stats mstats;
+};
+
+static int
+siplog_memdeb_rankcmp(const void *a, const void *b)
+{
+    const struct memdeb_rank *ra, *rb;
+
+    ra = (const struct memdeb_rank *)a;
+    rb = (const struct memdeb_rank *)b;
+    if (ra->mstats.live_bytes != rb->mstats.live_bytes)
+        return (ra->mstats.live_bytes > rb->mstats.live_bytes ? -1 : 1);
+    return (ra->mstats.peak_bytes > rb->mstats.peak_bytes ? -1 :
+      ra->mstats.peak_bytes < rb->mstats.peak_bytes);
+}
+
+static void
+siplog_memdeb_fmthist(const struct memdeb_stats *msp, char *buf, size_t len)
+{
+    int i, r;
+    size_t off;
+
+    buf[0] = '\0';
+    for (off = 0, i = 0; i < MEMDEB_NHIST && off < len; i++) {
+        if (msp->hist[i] == 0)
+            continue;
+        if (i == MEMDEB_NHIST - 1) {
+            r = snprintf(buf + off, len - off, " >%llu:%lld",
+              1ULL << (MEMDEB_HIST_MINLOG2 + i - 1), (long long)msp->hist[i]);
+        } else {
+            r = snprintf(buf + off, len - off, " <=%llu:%lld",
+              1ULL << (MEMDEB_HIST_MINLOG2 + i), (long long)msp->hist[i]);
+        }
+        if (r < 0)
+            break;
+        off += r;
+    }
+}
+
+int
+siplog_memdeb_dumptop(int level, siplog_t handle, int topn)
+{
+    struct memdeb_node *mnp;
+    struct memdeb_rank *rank;
+    char hbuf[256];
+    int nnodes, i, bucket;
+    unsigned long rate;
+
+    pthread_mutex_lock(&memdeb_report_mutex);
+    nnodes = 0;
+    MEMDEB_FOREACH(mnp, bucket)
+        nnodes++;
+    rank = malloc(sizeof(*rank) * (nnodes > 0 ? nnodes : 1));
+    if (rank == NULL) {
+        pthread_mutex_unlock(&memdeb_report_mutex);
+        return (-1);
+    }
+    i = 0;
+    MEMDEB_FOREACH(mnp, bucket) {
+        if (i == nnodes)
+            break;
+        rank[i].mnp = mnp;
+        siplog_memdeb_nstats(mnp, &rank[i].mstats);
+        i++;
+    }
+    nnodes = i;
+    pthread_mutex_unlock(&memdeb_report_mutex);
+
+    qsort(rank, nnodes, sizeof(*rank), siplog_memdeb_rankcmp);
+    rate = __atomic_load_n(&memdeb_sample_rate, __ATOMIC_RELAXED);
+    if (rate != 0) {
+        siplog_write(level, handle, "MEMDEB:siplog: sampling one allocation "
+          "per %lu bytes, figures below are estimates", rate);
+    }
+    siplog_write(level, handle, "MEMDEB:siplog: live bytes = %lld, "
+      "peak bytes = %lld, top %d call sites by live bytes:",
+      (long long)__atomic_load_n(&memdeb_totals.live_bytes, __ATOMIC_RELAXED),
+      (long long)__atomic_load_n(&memdeb_totals.peak_bytes, __ATOMIC_RELAXED),
+      topn);
+    for (i = 0; i < nnodes && i < topn; i++) {
+        if (rank[i].mstats.live_bytes == 0 && rank[i].mstats.peak_bytes == 0)
+            break;
+        siplog_memdeb_fmthist(&rank[i].mstats, hbuf, sizeof(hbuf));
+        siplog_write(level, handle,
+          "  %s+%d, %s(): live = %lld, peak = %lld, nlive = %lld, sizes:%s",
+          rank[i].mnp->ent.fname, rank[i].mnp->ent.linen,
+          rank[i].mnp->ent.funcn,
+          (long long)rank[i].mstats.live_bytes,
+          (long long)rank[i].mstats.peak_bytes,
+          (long long)(rank[i].mstats.nalloc - rank[i].mstats.nfree), hbuf);
+    }
+    free(rank);
+    return (i);
+}
+
 int
 siplog_memdeb_dumpstats(int level, siplog_t handle)
 {
     struct memdeb_node *mnp;
-    int errors_found, max_nunalloc;
+    struct memdeb_stats mstats;
+    int errors_found, max_nunalloc, bucket;
     int64_t nunalloc;
 
     errors_found = 0;
-    pthread_mutex_lock(memdeb_mutex);
-    for (mnp = nodes; mnp != NULL; mnp = mnp->next) {
-        nunalloc = mnp->mstats.nalloc - mnp->mstats.nfree;
-        if (mnp->mstats.afails == 0) {
-            if (mnp->mstats.nalloc == 0)
+    pthread_mutex_lock(&memdeb_report_mutex);
+    MEMDEB_FOREACH(mnp, bucket) {
+        siplog_memdeb_nstats(mnp, &mstats);
+        nunalloc = mstats.nalloc - mstats.nfree;
+        if (mstats.afails == 0) {
+            if (mstats.nalloc == 0)
                 continue;
-            if (mnp->mstats.nalloc == mnp->mstats.nfree)
+            if (mstats.nalloc == mstats.nfree)
                 continue;
-            if (nunalloc == mnp->mstats.nunalloc_baseln)
+            if (nunalloc == mstats.nunalloc_baseln)
                 continue;
         }
         if (nunalloc > 0) {
-            max_nunalloc = is_approved(mnp->funcn);
+            max_nunalloc = is_approved(mnp->ent.funcn);
             if (max_nunalloc > 0 && nunalloc <= max_nunalloc)
                 continue;
         }
@@ -304,10 +600,10 @@ siplog_memdeb_dumpstats(int level, siplog_t handle)
         errors_found++;
         siplog_write(level, handle,
           "  %s+%d, %s(): nalloc = %ld, nfree = %ld, afails = %ld",
-          mnp->fname, mnp->linen, mnp->funcn, mnp->mstats.nalloc,
-          mnp->mstats.nfree, mnp->mstats.afails);
+          mnp->ent.fname, mnp->ent.linen, mnp->ent.funcn, mstats.nalloc,
+          mstats.nfree, mstats.afails);
     }
-    pthread_mutex_unlock(memdeb_mutex);
+    pthread_mutex_unlock(&memdeb_report_mutex);
     if (errors_found == 0) {
         siplog_write(level, handle,
           "MEMDEB:siplog: all clear");
@@ -315,6 +611,7 @@ siplog_memdeb_dumpstats(int level, siplog_t handle)
         siplog_write(level, handle,
           "MEMDEB:siplog: errors found: %d", errors_found);
     }
+    siplog_memdeb_dumptop(level, handle, MEMDEB_TOPN);
     return (errors_found);
 }
 
@@ -323,16 +620,29 @@ siplog_memdeb_setbaseln(void)
 {
 
     struct memdeb_node *mnp;
+    struct memdeb_stats mstats;
+    int bucket;
 
-    pthread_mutex_lock(memdeb_mutex);
-    for (mnp = nodes; mnp != NULL; mnp = mnp->next) {
-        if (mnp->magic != MEMDEB_SIGNATURE) {
+    pthread_mutex_lock(&memdeb_report_mutex);
+    MEMDEB_FOREACH(mnp, bucket) {
+        if (mnp->ent.magic != MEMDEB_SIGNATURE) {
             /* Nodelist is corrupt */
             abort();
         }
-        if (mnp->mstats.nalloc == 0)
+        siplog_memdeb_nstats(mnp, &mstats);
+        if (mstats.nalloc == 0)
             continue;
-        mnp->mstats.nunalloc_baseln = mnp->mstats.nalloc - mnp->mstats.nfree;
+        __atomic_store_n(&mnp->mstats.nunalloc_baseln,
+          mstats.nalloc - mstats.nfree, __ATOMIC_RELAXED);
     }
-    pthread_mutex_unlock(memdeb_mutex);
+    pthread_mutex_unlock(&memdeb_report_mutex);
+}
+
+/* Current and peak number of live bytes, estimates if sampling is on */
+void
+siplog_memdeb_totals(int64_t *live_bytes, int64_t *peak_bytes)
+{
+
+    *live_bytes = __atomic_load_n(&memdeb_totals.live_bytes, __ATOMIC_RELAXED);
+    *peak_bytes = __atomic_load_n(&memdeb_totals.peak_bytes, __ATOMIC_RELAXED);
 }
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Protection against log storms. Two independent mechanisms, both
+ * configured per level:
+ *
+ *  o per-call-site rate limiting: each format string (compared by pointer,
+ *    so it's effectively a call site; siplog_writev() and siplog_reserve()
+ *    callers are told apart by return address, siplog_kwritev() and
+ *    siplog_kreserve() ones by the key they pass in) gets its own token
+ *    bucket, kept as a GCRA "theoretical arrival time" updated with CAS.
+ *    Lines over the limit are dropped before being formatted, their number
+ *    is reported with the next line that gets through from the same call
+ *    site;
+ *
+ *  o duplicate suppression: a handle remembers a hash of the last line it
+ *    has logged and, as long as the same line keeps coming, only counts it.
+ *    The count is reported as "last message repeated N times" once some
+ *    other line is logged or on siplog_hbeat()/siplog_close().
+ *
+ * Configuration is taken from the environment on first use:
+ *
+ *   SIPLOG_RATELIMIT=LEVEL:rate[:burst][,LEVEL:rate[:burst]...]
+ *   SIPLOG_DEDUP=LEVEL[,LEVEL...]
+ *
+ * and can be changed at runtime with siplog_set_ratelimit() and
+ * siplog_set_dedup(), which applies to the handles that are open already
+ * as well: the per-handle state is only allocated once it's needed.
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "siplog.h"
+#include "internal/_siplog.h"
+#include "internal/siplog_ratelimit.h"
+
+#define SIPLOG_RL_NSLOTS_LOG2	12
+#define SIPLOG_RL_NSLOTS	(1 << SIPLOG_RL_NSLOTS_LOG2)
+#define SIPLOG_RL_MAXPROBE	16
+
+struct siplog_rl_slot {
+    const void *site;
+    int64_t tat;
+    int64_t nsuppressed;
+};
+
+struct siplog_dedup {
+    pthread_mutex_t mutex;
+    uint64_t hash;
+    int64_t nrepeats;
+};
+
+static struct siplog_rl_slot siplog_rl_slots[SIPLOG_RL_NSLOTS];
+
+static struct {
+    int rate;
+    int burst;
+} siplog_rl_conf[SIPLOG_NLEVELS];
+static int siplog_dedup_conf[SIPLOG_NLEVELS];
+
+static pthread_once_t siplog_rl_once = PTHREAD_ONCE_INIT;
+
+static void
+siplog_rl_init(void)
+{
+    const char *cp;
+    char *buf, *tok, *last, *rate, *burst;
+    int level;
+
+    cp = getenv("SIPLOG_RATELIMIT");
+    if (cp != NULL && (buf = strdup(cp)) != NULL) {
+        for (tok = strtok_r(buf, ",", &last); tok != NULL;
+          tok = strtok_r(NULL, ",", &last)) {
+            rate = strchr(tok, ':');
+            if (rate == NULL)
+                continue;
+            *rate++ = '\0';
+            burst = strchr(rate, ':');
+            if (burst != NULL)
+                *burst++ = '\0';
+            level = siplog_level_byname(tok);
+            if (level < 0)
+                continue;
+            siplog_rl_conf[level].rate = atoi(rate);
+            siplog_rl_conf[level].burst = (burst != NULL) ? atoi(burst) : 0;
+        }
+        free(buf);
+    }
+    cp = getenv("SIPLOG_DEDUP");
+    if (cp != NULL && (buf = strdup(cp)) != NULL) {
+        for (tok = strtok_r(buf, ",", &last); tok != NULL;
+          tok = strtok_r(NULL, ",", &last)) {
+            level = siplog_level_byname(tok);
+            if (level >= 0)
+                siplog_dedup_conf[level] = 1;
+        }
+        free(buf);
+    }
+}
+
+int
+siplog_set_ratelimit(int level, int rate, int burst)
+{
+
+    if (level < 0 || level >= SIPLOG_NLEVELS || rate < 0 || burst < 0)
+        return (-1);
+    pthread_once(&siplog_rl_once, siplog_rl_init);
+    __atomic_store_n(&siplog_rl_conf[level].burst, burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&siplog_rl_conf[level].rate, rate, __ATOMIC_RELAXED);
+    return (0);
+}
+
+int
+siplog_set_dedup(int level, int onoff)
+{
+
+    if (level < 0 || level >= SIPLOG_NLEVELS)
+        return (-1);
+    pthread_once(&siplog_rl_once, siplog_rl_init);
+    __atomic_store_n(&siplog_dedup_conf[level], onoff != 0, __ATOMIC_RELAXED);
+    return (0);
+}
+
+static struct siplog_rl_slot *
+siplog_rl_slot(const void *site)
+{
+    struct siplog_rl_slot *slot;
+    const void *key;
+    uint64_t h;
+    int i;
+
+    h = (uint64_t)(uintptr_t)site * 0x9e3779b97f4a7c15ULL;
+    h >>= 64 - SIPLOG_RL_NSLOTS_LOG2;
+    for (i = 0; i < SIPLOG_RL_MAXPROBE; i++) {
+        slot = &siplog_rl_slots[(h + i) & (SIPLOG_RL_NSLOTS - 1)];
+        key = __atomic_load_n(&slot->site, __ATOMIC_ACQUIRE);
+        if (key == site)
+            return (slot);
+        if (key != NULL)
+            continue;
+        if (__atomic_compare_exchange_n(&slot->site, &key, site, 0,
+          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || key == site)
+            return (slot);
+    }
+    /* Table is full around here, don't limit this call site */
+    return (NULL);
+}
+
+/*
+ * Check if a line with a given level coming from a given call site (format
+ * string or return address) is allowed to go out.
+ * Returns 0 if it should be dropped, 1 otherwise, in which case
+ * nsuppressed is set to the number of lines from the same call site that
+ * were dropped since the last one that made it through.
+ */
+int
+siplog_rl_check(int level, const void *site, int64_t *nsuppressed)
+{
+    struct siplog_rl_slot *slot;
+    struct timespec ts;
+    int64_t now, tat, ntat, interval, tolerance;
+    int rate, burst;
+
+    *nsuppressed = 0;
+    pthread_once(&siplog_rl_once, siplog_rl_init);
+    if (level < 0 || level >= SIPLOG_NLEVELS)
+        return (1);
+    rate = __atomic_load_n(&siplog_rl_conf[level].rate, __ATOMIC_RELAXED);
+    if (rate == 0)
+        return (1);
+    burst = __atomic_load_n(&siplog_rl_conf[level].burst, __ATOMIC_RELAXED);
+    slot = siplog_rl_slot(site);
+    if (slot == NULL)
+        return (1);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    interval = 1000000000LL / rate;
+    tolerance = interval * (burst > 1 ? burst - 1 : 0);
+    tat = __atomic_load_n(&slot->tat, __ATOMIC_RELAXED);
+    do {
+        if (tat - tolerance > now) {
+            __atomic_add_fetch(&slot->nsuppressed, 1, __ATOMIC_RELAXED);
+            return (0);
+        }
+        ntat = (tat > now ? tat : now) + interval;
+    } while (!__atomic_compare_exchange_n(&slot->tat, &tat, ntat, 1,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if (__atomic_load_n(&slot->nsuppressed, __ATOMIC_RELAXED) != 0)
+        *nsuppressed = __atomic_exchange_n(&slot->nsuppressed, 0,
+          __ATOMIC_RELAXED);
+    return (1);
+}
+
+int
+siplog_dedup_enabled(int level)
+{
+
+    pthread_once(&siplog_rl_once, siplog_rl_init);
+    if (level < 0 || level >= SIPLOG_NLEVELS)
+        return (0);
+    return (__atomic_load_n(&siplog_dedup_conf[level], __ATOMIC_RELAXED));
+}
+
+struct siplog_dedup *
+siplog_dedup_alloc(void)
+{
+    struct siplog_dedup *dp;
+
+    dp = malloc(sizeof(*dp));
+    if (dp == NULL)
+        return (NULL);
+    memset(dp, '\0', sizeof(*dp));
+    pthread_mutex_init(&dp->mutex, NULL);
+    return (dp);
+}
+
+void
+siplog_dedup_free(struct siplog_dedup *dp)
+{
+
+    pthread_mutex_destroy(&dp->mutex);
+    free(dp);
+}
+
+static uint64_t
+siplog_dedup_hash(uint64_t h, const char *cp, size_t len)
+{
+
+    /* FNV-1a */
+    while (len-- > 0) {
+        h ^= (unsigned char)*cp++;
+        h *= 0x100000001b3ULL;
+    }
+    return (h);
+}
+
+/*
+ * Check if the formatted line is the same as the last one logged via
+ * the handle. Returns 1 if it is and should be dropped, 0 otherwise, in
+ * which case nrepeats is set to the number of duplicates of the previous
+ * line that have been dropped and are yet to be reported.
+ */
+int
+siplog_dedup_check(struct siplog_dedup *dp, int level, const char *msg,
+  size_t len, const char *estr, int64_t *nrepeats)
+{
+    uint64_t h;
+
+    h = siplog_dedup_hash(0xcbf29ce484222325ULL, (const char *)&level,
+      sizeof(level));
+    h = siplog_dedup_hash(h, msg, len);
+    if (estr != NULL)
+        h = siplog_dedup_hash(h, estr, strlen(estr));
+    *nrepeats = 0;
+    pthread_mutex_lock(&dp->mutex);
+    if (dp->hash == h) {
+        dp->nrepeats++;
+        pthread_mutex_unlock(&dp->mutex);
+        return (1);
+    }
+    dp->hash = h;
+    *nrepeats = dp->nrepeats;
+    dp->nrepeats = 0;
+    pthread_mutex_unlock(&dp->mutex);
+    return (0);
+}
+
+/* Returns number of dropped duplicates yet to be reported and resets it */
+int64_t
+siplog_dedup_flush(struct siplog_dedup *dp)
+{
+    int64_t nrepeats;
+
+    pthread_mutex_lock(&dp->mutex);
+    nrepeats = dp->nrepeats;
+    dp->nrepeats = 0;
+    if (nrepeats > 0) {
+        /* Next identical line is going to be logged again */
+        dp->hash = 0;
+    }
+    pthread_mutex_unlock(&dp->mutex);
+    return (nrepeats);
+}
@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Per-call-site accounting of the logging volume, for the applications
+ * that opt in with siplog_sites.h: every siplog_*write*() call there is
+ * tagged with its file, line and function, and counts, for its site, the
+ * lines that got logged, the ones that were below the level of the handle
+ * and the ones that were dropped on the way, by the rate limiter, the
+ * deduplication or a full queue, along with the bytes and the time spent
+ * formatting the lines that got logged.
+ *
+ * Sites live in the same kind of table as the call sites of
+ * siplog_mem_debug.c do, see siplog_sitetab.c, and their counters are
+ * relaxed atomics. The bytes and the formatting time are picked up by
+ * siplog_format_line(), or the backend, through a per-thread record while
+ * the line is on its way. Pre-formatted lines are counted without the
+ * prefix and take no time to format.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "siplog.h"
+#include "siplog_sites.h"
+#include "internal/_siplog.h"
+#include "internal/siplog_sites.h"
+#include "internal/siplog_sitetab.h"
+
+#undef siplog_write
+#undef siplog_write_va
+#undef siplog_ewrite
+#undef siplog_ewrite_va
+#undef siplog_iwrite
+#undef siplog_writev
+#undef siplog_iwritev
+
+struct siplog_site_stats {
+    int64_t nlines;
+    int64_t nbelow;
+    int64_t ndropped;
+    int64_t bytes;
+    int64_t fmt_ns;
+};
+
+#define SITE_INC(sp, fld) \
+    (void)__atomic_add_fetch(&(sp)->sstats.fld, 1, __ATOMIC_RELAXED)
+#define SITE_ADD(sp, fld, n) \
+    (void)__atomic_add_fetch(&(sp)->sstats.fld, (n), __ATOMIC_RELAXED)
+#define SITE_GET(sp, fld) \
+    __atomic_load_n(&(sp)->sstats.fld, __ATOMIC_RELAXED)
+
+struct siplog_site {
+    struct siplog_sitetab_ent ent;	/* has to be the first */
+    struct siplog_site_stats sstats;
+};
+
+#define SITE_SIGNATURE 0x3d6f1c8e5a90b247UL
+
+static struct siplog_sitetab site_tab =
+  SIPLOG_SITETAB_INITIALIZER(SITE_SIGNATURE);
+static pthread_mutex_t site_report_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+__thread struct siplog_site_acct siplog_site_acct;
+
+/* Look the site up, adding it if it's new, NULL if out of memory */
+static struct siplog_site *
+siplog_site_get(const char *fname, int linen, const char *funcn)
+{
+    struct siplog_sitetab_ent *ep;
+    struct siplog_site *rval;
+
+    ep = siplog_sitetab_find(&site_tab, fname, linen, funcn);
+    if (ep != NULL)
+        return ((struct siplog_site *)ep);
+    rval = malloc(sizeof(*rval));
+    if (rval == NULL)
+        return (NULL);
+    memset(rval, '\0', sizeof(*rval));
+    siplog_sitetab_init(&site_tab, &rval->ent, fname, linen, funcn);
+    ep = siplog_sitetab_insert(&site_tab, &rval->ent);
+    if (ep != &rval->ent)
+        free(rval);
+    return ((struct siplog_site *)ep);
+}
+
+int64_t
+siplog_site_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * The line has been formatted, len bytes long, after having started at
+ * start. Only the last one counts if it had to be formatted again to fit.
+ */
+void
+siplog_site_formatted(int64_t start, int len)
+{
+
+    siplog_site_acct.fmt_ns += siplog_site_clock() - start;
+    if (len < 0)
+        return;
+    siplog_site_acct.bytes = len;
+    siplog_site_acct.emitted = 1;
+}
+
+void
+siplog_site_emittedv(const struct iovec *iov, int iovcnt)
+{
+    size_t len;
+    int i;
+
+    len = 1;
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    siplog_site_acct.bytes = len;
+    siplog_site_acct.emitted = 1;
+}
+
+/*
+ * Count the line against the site and, if it's going to be logged, start
+ * accounting for it. Returns NULL if there is nothing more to do.
+ */
+static struct siplog_site *
+siplog_site_enter(const char *fname, int linen, const char *funcn,
+  int level, siplog_t handle)
+{
+    struct loginfo *lp;
+    struct siplog_site *sp;
+
+    lp = (struct loginfo *)handle;
+    if (lp == NULL || lp->bend == NULL || siplog_site_acct.active)
+        return (NULL);
+    sp = siplog_site_get(fname, linen, funcn);
+    if (sp == NULL)
+        return (NULL);
+    if (level < lp->level) {
+        SITE_INC(sp, nbelow);
+        return (NULL);
+    }
+    siplog_site_acct.active = 1;
+    siplog_site_acct.emitted = 0;
+    siplog_site_acct.bytes = 0;
+    siplog_site_acct.fmt_ns = 0;
+    return (sp);
+}
+
+static void
+siplog_site_leave(struct siplog_site *sp)
+{
+
+    if (sp == NULL)
+        return;
+    siplog_site_acct.active = 0;
+    if (!siplog_site_acct.emitted) {
+        SITE_INC(sp, ndropped);
+        return;
+    }
+    SITE_INC(sp, nlines);
+    SITE_ADD(sp, bytes, (int64_t)siplog_site_acct.bytes);
+    SITE_ADD(sp, fmt_ns, siplog_site_acct.fmt_ns);
+}
+
+void
+siplog_site_write_va(const char *fname, int linen, const char *funcn,
+  int level, siplog_t handle, const char *fmt, va_list ap)
+{
+    struct siplog_site *sp;
+
+    sp = siplog_site_enter(fname, linen, funcn, level, handle);
+    siplog_write_va(level, handle, fmt, ap);
+    siplog_site_leave(sp);
+}
+
+void
+siplog_site_write(const char *fname, int linen, const char *funcn,
+  int level, siplog_t handle, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    siplog_site_write_va(fname, linen, funcn, level, handle, fmt, ap);
+    va_end(ap);
+}
+
+void
+siplog_site_ewrite_va(const char *fname, int linen, const char *funcn,
+  int level, siplog_t handle, const char *fmt, va_list ap)
+{
+    struct siplog_site *sp;
+    int errno_bak;
+
+    errno_bak = errno;
+    sp = siplog_site_enter(fname, linen, funcn, level, handle);
+    errno = errno_bak;
+    siplog_ewrite_va(level, handle, fmt, ap);
+    siplog_site_leave(sp);
+    errno = errno_bak;
+}
+
+void
+siplog_site_ewrite(const char *fname, int linen, const char *funcn,
+  int level, siplog_t handle, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    siplog_site_ewrite_va(fname, linen, funcn, level, handle, fmt, ap);
+    va_end(ap);
+}
+
+void
+siplog_site_iwrite(const char *fname, int linen, const char *funcn,
+  int level, siplog_t handle, const char *idx_id, const char *fmt, ...)
+{
+    struct siplog_site *sp;
+    va_list ap;
+
+    sp = siplog_site_enter(fname, linen, funcn, level, handle);
+    va_start(ap, fmt);
+    siplog_iwrite_va(level, handle, idx_id, fmt, ap);
+    va_end(ap);
+    siplog_site_leave(sp);
+}
+
+/*
+ * The site itself tells them apart for the rate limiter, or, when there is
+ * none, the return address as in siplog_writev().
+ */
+void
+siplog_site_writev(const char *fname, int linen, const char *funcn,
+  int level, siplog_t handle, const struct iovec *iov, int iovcnt)
+{
+    struct siplog_site *sp;
+    struct loginfo *lp;
+
+    lp = (struct loginfo *)handle;
+    if (lp == NULL)
+        return;
+    sp = siplog_site_enter(fname, linen, funcn, level, handle);
+    siplog_writev_common(level, lp,
+      (lp->call_id_global != 0) ? NULL : lp->call_id, iov, iovcnt,
+      (sp != NULL) ? (const void *)sp : __builtin_return_address(0));
+    siplog_site_leave(sp);
+}
+
+void
+siplog_site_iwritev(const char *fname, int linen, const char *funcn,
+  int level, siplog_t handle, const char *idx_id, const struct iovec *iov,
+  int iovcnt)
+{
+    struct siplog_site *sp;
+
+    sp = siplog_site_enter(fname, linen, funcn, level, handle);
+    siplog_writev_common(level, (struct loginfo *)handle, idx_id, iov, iovcnt,
+      (sp != NULL) ? (const void *)sp : __builtin_return_address(0));
+    siplog_site_leave(sp);
+}
+
+struct siplog_site_rank {
+    struct siplog_site *sp;
+    struct siplog_site_stats sstats;
+    int64_t key;
+};
+
+static int
+siplog_site_rankcmp(const void *a, const void *b)
+{
+    const struct siplog_site_rank *ra, *rb;
+
+    ra = (const struct siplog_site_rank *)a;
+    rb = (const struct siplog_site_rank *)b;
+    if (ra->key != rb->key)
+        return (ra->key > rb->key ? -1 : 1);
+    if (ra->sstats.nbelow != rb->sstats.nbelow)
+        return (ra->sstats.nbelow > rb->sstats.nbelow ? -1 : 1);
+    return (ra->sstats.ndropped > rb->sstats.ndropped ? -1 :
+      ra->sstats.ndropped < rb->sstats.ndropped);
+}
+
+/*
+ * Log the topn call sites with the most bytes, formatting time or lines
+ * logged, as selected by order, along with the totals of all of them.
+ * Returns the number of sites reported or -1 on error.
+ */
+int
+siplog_sites_dumptop(int level, siplog_t handle, int topn, int order)
+{
+    static const char *orders[] = {"bytes", "format time", "lines"};
+    struct siplog_sitetab_ent *ep;
+    struct siplog_site *sp;
+    struct siplog_site_rank *rank;
+    struct siplog_site_stats tot;
+    int nsites, i, bucket;
+
+    if (order < SIPLOG_SITES_BYTES || order > SIPLOG_SITES_LINES)
+        return (-1);
+    pthread_mutex_lock(&site_report_mutex);
+    nsites = 0;
+    SIPLOG_SITETAB_FOREACH(&site_tab, ep, bucket)
+        nsites++;
+    rank = malloc(sizeof(*rank) * (nsites > 0 ? nsites : 1));
+    if (rank == NULL) {
+        pthread_mutex_unlock(&site_report_mutex);
+        return (-1);
+    }
+    memset(&tot, '\0', sizeof(tot));
+    i = 0;
+    SIPLOG_SITETAB_FOREACH(&site_tab, ep, bucket) {
+        if (i == nsites)
+            break;
+        sp = (struct siplog_site *)ep;
+        rank[i].sp = sp;
+        rank[i].sstats.nlines = SITE_GET(sp, nlines);
+        rank[i].sstats.nbelow = SITE_GET(sp, nbelow);
+        rank[i].sstats.ndropped = SITE_GET(sp, ndropped);
+        rank[i].sstats.bytes = SITE_GET(sp, bytes);
+        rank[i].sstats.fmt_ns = SITE_GET(sp, fmt_ns);
+        switch (order) {
+        case SIPLOG_SITES_BYTES:
+            rank[i].key = rank[i].sstats.bytes;
+            break;
+
+        case SIPLOG_SITES_TIME:
+            rank[i].key = rank[i].sstats.fmt_ns;
+            break;
+
+        default:
+            rank[i].key = rank[i].sstats.nlines;
+            break;
+        }
+        tot.nlines += rank[i].sstats.nlines;
+        tot.nbelow += rank[i].sstats.nbelow;
+        tot.ndropped += rank[i].sstats.ndropped;
+        tot.bytes += rank[i].sstats.bytes;
+        tot.fmt_ns += rank[i].sstats.fmt_ns;
+        i++;
+    }
+    nsites = i;
+    pthread_mutex_unlock(&site_report_mutex);
+
+    qsort(rank, nsites, sizeof(*rank), siplog_site_rankcmp);
+    siplog_write(level, handle, "SITES:siplog: %d call sites, lines = %lld, "
+      "bytes = %lld, format time = %lld us, below level = %lld, "
+      "dropped = %lld, top %d by %s:", nsites, (long long)tot.nlines,
+      (long long)tot.bytes, (long long)(tot.fmt_ns / 1000),
+      (long long)tot.nbelow, (long long)tot.ndropped, topn, orders[order]);
+    for (i = 0; i < nsites && i < topn; i++) {
+        if (rank[i].key == 0 && rank[i].sstats.nbelow == 0 &&
+          rank[i].sstats.ndropped == 0)
+            break;
+        siplog_write(level, handle, "  %s+%d, %s(): lines = %lld, "
+          "bytes = %lld, format time = %lld us (%lld ns/line), "
+          "below level = %lld, dropped = %lld", rank[i].sp->ent.fname,
+          rank[i].sp->ent.linen, rank[i].sp->ent.funcn,
+          (long long)rank[i].sstats.nlines, (long long)rank[i].sstats.bytes,
+          (long long)(rank[i].sstats.fmt_ns / 1000),
+          (long long)((rank[i].sstats.nlines > 0) ?
+          rank[i].sstats.fmt_ns / rank[i].sstats.nlines : 0),
+          (long long)rank[i].sstats.nbelow,
+          (long long)rank[i].sstats.ndropped);
+    }
+    free(rank);
+    return (i);
+}
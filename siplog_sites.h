@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Per-call-site accounting of the logging volume, opt-in: include this
+ * after siplog.h, or force it in with -include, and the siplog_*write*()
+ * calls get tagged with their file, line and function. See
+ * siplog_sites_dumptop() for the report.
+ */
+
+#ifndef _SIPLOG_SITES_H_
+#define _SIPLOG_SITES_H_
+
+#include "siplog.h"
+
+#define siplog_write(level, handle, ...) \
+    siplog_site_write(__FILE__, __LINE__, __func__, (level), (handle), \
+      __VA_ARGS__)
+#define siplog_write_va(level, handle, fmt, ap) \
+    siplog_site_write_va(__FILE__, __LINE__, __func__, (level), (handle), \
+      (fmt), (ap))
+#define siplog_ewrite(level, handle, ...) \
+    siplog_site_ewrite(__FILE__, __LINE__, __func__, (level), (handle), \
+      __VA_ARGS__)
+#define siplog_ewrite_va(level, handle, fmt, ap) \
+    siplog_site_ewrite_va(__FILE__, __LINE__, __func__, (level), (handle), \
+      (fmt), (ap))
+#define siplog_iwrite(level, handle, idx_id, ...) \
+    siplog_site_iwrite(__FILE__, __LINE__, __func__, (level), (handle), \
+      (idx_id), __VA_ARGS__)
+#define siplog_writev(level, handle, iov, iovcnt) \
+    siplog_site_writev(__FILE__, __LINE__, __func__, (level), (handle), \
+      (iov), (iovcnt))
+#define siplog_iwritev(level, handle, idx_id, iov, iovcnt) \
+    siplog_site_iwritev(__FILE__, __LINE__, __func__, (level), (handle), \
+      (idx_id), (iov), (iovcnt))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void siplog_site_write(const char *, int, const char *, int, siplog_t,
+  const char *, ...);
+void siplog_site_write_va(const char *, int, const char *, int, siplog_t,
+  const char *, va_list);
+void siplog_site_ewrite(const char *, int, const char *, int, siplog_t,
+  const char *, ...);
+void siplog_site_ewrite_va(const char *, int, const char *, int, siplog_t,
+  const char *, va_list);
+void siplog_site_iwrite(const char *, int, const char *, int, siplog_t,
+  const char *, const char *, ...);
+void siplog_site_writev(const char *, int, const char *, int, siplog_t,
+  const struct iovec *, int);
+void siplog_site_iwritev(const char *, int, const char *, int, siplog_t,
+  const char *, const struct iovec *, int);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SIPLOG_SITES_H_ */
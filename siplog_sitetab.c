@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Lock-free table of call sites, keyed on the (fname, linen, funcn) tuple,
+ * that both siplog_mem_debug.c and siplog_sites.c keep their per-site
+ * counters in. It's a fixed-size hash table, entries are never removed
+ * once published, so lookups walk the chains without taking any lock and
+ * new entries are pushed onto the chain head with CAS. Entries are
+ * allocated by the callers, this file doesn't allocate anything so that
+ * the memory debugging layer can use it too. Every entry carries the
+ * magic of its table, a chain with anything else in it is corrupt.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "internal/siplog_sitetab.h"
+
+static unsigned int
+siplog_sitetab_hash(const char *fname, int linen, const char *funcn)
+{
+    uint64_t h;
+
+    h = (uint64_t)(uintptr_t)fname;
+    h ^= (uint64_t)(uintptr_t)funcn * 0xff51afd7ed558ccdULL;
+    h ^= (uint64_t)(unsigned int)linen * 0xc4ceb9fe1a85ec53ULL;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return ((unsigned int)(h >> (64 - SIPLOG_SITETAB_NBUCKETS_LOG2)));
+}
+
+static struct siplog_sitetab_ent *
+siplog_sitetab_walk(const struct siplog_sitetab *tp,
+  struct siplog_sitetab_ent *ep, struct siplog_sitetab_ent *stop,
+  const char *fname, int linen, const char *funcn)
+{
+
+    for (; ep != stop; ep = ep->next) {
+        if (ep->magic != tp->magic) {
+            /* Chain is corrupt */
+            abort();
+        }
+        if (ep->fname == fname && ep->linen == linen && ep->funcn == funcn)
+            return (ep);
+    }
+    return (NULL);
+}
+
+/* Set up a new entry for the site, before it's inserted */
+void
+siplog_sitetab_init(struct siplog_sitetab *tp, struct siplog_sitetab_ent *ep,
+  const char *fname, int linen, const char *funcn)
+{
+
+    ep->magic = tp->magic;
+    ep->fname = fname;
+    ep->linen = linen;
+    ep->funcn = funcn;
+    ep->next = NULL;
+}
+
+struct siplog_sitetab_ent *
+siplog_sitetab_find(struct siplog_sitetab *tp, const char *fname, int linen,
+  const char *funcn)
+{
+    struct siplog_sitetab_ent *head;
+
+    head = __atomic_load_n(&tp->buckets[siplog_sitetab_hash(fname, linen,
+      funcn)], __ATOMIC_ACQUIRE);
+    return (siplog_sitetab_walk(tp, head, NULL, fname, linen, funcn));
+}
+
+/*
+ * Publish the entry, unless its site is in the table already. Returns
+ * the entry that is in the table, if that's not ep it's up to the caller
+ * to dispose of it.
+ */
+struct siplog_sitetab_ent *
+siplog_sitetab_insert(struct siplog_sitetab *tp, struct siplog_sitetab_ent *ep)
+{
+    struct siplog_sitetab_ent **bp, *head, *sep;
+
+    bp = &tp->buckets[siplog_sitetab_hash(ep->fname, ep->linen, ep->funcn)];
+    head = __atomic_load_n(bp, __ATOMIC_ACQUIRE);
+    sep = siplog_sitetab_walk(tp, head, NULL, ep->fname, ep->linen,
+      ep->funcn);
+    if (sep != NULL)
+        return (sep);
+    for (;;) {
+        ep->next = head;
+        if (__atomic_compare_exchange_n(bp, &head, ep, 0, __ATOMIC_RELEASE,
+          __ATOMIC_ACQUIRE))
+            return (ep);
+        /* Lost the race, check if somebody else has added the same site */
+        sep = siplog_sitetab_walk(tp, head, ep->next, ep->fname, ep->linen,
+          ep->funcn);
+        if (sep != NULL)
+            return (sep);
+    }
+}
+
+/* Entry that comes after ep, the first one if ep is NULL, see FOREACH */
+struct siplog_sitetab_ent *
+siplog_sitetab_next(struct siplog_sitetab *tp, struct siplog_sitetab_ent *ep,
+  int *bucketp)
+{
+
+    if (ep != NULL && ep->next != NULL)
+        return (ep->next);
+    for ((*bucketp)++; *bucketp < SIPLOG_SITETAB_NBUCKETS; (*bucketp)++) {
+        ep = __atomic_load_n(&tp->buckets[*bucketp], __ATOMIC_ACQUIRE);
+        if (ep != NULL)
+            return (ep);
+    }
+    return (NULL);
+}
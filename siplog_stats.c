@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Live counters for siplog-stat(1). When SIPLOG_STATS is set, each process
+ * keeps lock-free counters of what goes through the library and every now
+ * and then publishes a snapshot of them, together with the drop counts,
+ * depth of the async queue and memory debugging totals, in a small POSIX
+ * shared memory segment of its own named "/siplog.<pid>". Only one thread
+ * publishes at a time and the readers never block it: the snapshot is
+ * guarded by a sequence counter that they check before and after copying
+ * it out. The segment is removed on exit.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "siplog.h"
+#include "internal/_siplog.h"
+#include "internal/siplog_logfile_async.h"
+#include "internal/siplog_stats.h"
+
+/* Snapshot in the segment is refreshed at most this often, ns */
+#define SIPLOG_STATS_INTERVAL	(100 * 1000000LL)
+/* Every that many lines of a level check if it's time to refresh it */
+#define SIPLOG_STATS_EVERY	64
+
+/* Only there when linked with the memory debugging version of the library */
+void siplog_memdeb_totals(int64_t *, int64_t *) __attribute__ ((weak));
+
+static struct {
+    uint64_t lines[SIPLOG_NLEVELS];
+    uint64_t bytes;
+    int64_t lag_last;
+    int64_t lag_max;
+    uint64_t idx_appends;
+    int64_t idx_ns_total;
+    int64_t idx_ns_max;
+} siplog_stats;
+
+static int siplog_stats_on;
+static int siplog_stats_busy;
+static int64_t siplog_stats_last;
+static pid_t siplog_stats_pid;
+static char siplog_stats_name[32];
+static char siplog_stats_app[SIPLOG_STATS_APP_LEN];
+static struct siplog_stats_shm *siplog_stats_shm;
+static pthread_once_t siplog_stats_once = PTHREAD_ONCE_INIT;
+static const char *siplog_stats_app0;
+
+static int64_t
+siplog_stats_elapsed(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((int64_t)(now.tv_sec - since->tv_sec) * 1000000000LL +
+      (now.tv_nsec - since->tv_nsec));
+}
+
+static void
+siplog_stats_max(int64_t *maxp, int64_t val)
+{
+    int64_t old;
+
+    old = __atomic_load_n(maxp, __ATOMIC_RELAXED);
+    while (val > old && !__atomic_compare_exchange_n(maxp, &old, val, 1,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        continue;
+}
+
+/* Create the segment of this process, called with siplog_stats_busy held */
+static int
+siplog_stats_attach(void)
+{
+    struct siplog_stats_shm *sp;
+    int fd;
+
+    siplog_stats_pid = getpid();
+    snprintf(siplog_stats_name, sizeof(siplog_stats_name),
+      "/" SIPLOG_STATS_PREFIX "%d", (int)siplog_stats_pid);
+    fd = shm_open(siplog_stats_name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd == -1)
+        return (-1);
+    if (ftruncate(fd, sizeof(*sp)) == -1)
+        goto e0;
+    sp = mmap(NULL, sizeof(*sp), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (sp == MAP_FAILED)
+        goto e0;
+    close(fd);
+    sp->version = SIPLOG_STATS_VERSION;
+    sp->pid = siplog_stats_pid;
+    memcpy(sp->app, siplog_stats_app, sizeof(sp->app));
+    __atomic_store_n(&sp->magic, SIPLOG_STATS_MAGIC, __ATOMIC_RELEASE);
+    siplog_stats_shm = sp;
+    return (0);
+e0:
+    close(fd);
+    shm_unlink(siplog_stats_name);
+    return (-1);
+}
+
+static void
+siplog_stats_atexit(void)
+{
+
+    /* Segment inherited from the parent is not ours to remove */
+    if (siplog_stats_shm != NULL && siplog_stats_pid == getpid())
+        shm_unlink(siplog_stats_name);
+}
+
+static void
+siplog_stats_atfork(void)
+{
+
+    /* Start from scratch, the child gets its segment on the next publish */
+    memset(&siplog_stats, '\0', sizeof(siplog_stats));
+    siplog_stats_shm = NULL;
+    siplog_stats_last = 0;
+    siplog_stats_busy = 0;
+}
+
+static void
+siplog_stats_setup(void)
+{
+    const char *cp;
+
+    cp = getenv("SIPLOG_STATS");
+    if (cp == NULL || atoi(cp) == 0)
+        return;
+    strlcpy(siplog_stats_app, siplog_stats_app0, sizeof(siplog_stats_app));
+    if (siplog_stats_attach() != 0)
+        return;
+    atexit(siplog_stats_atexit);
+    pthread_atfork(NULL, NULL, siplog_stats_atfork);
+    __atomic_store_n(&siplog_stats_on, 1, __ATOMIC_RELEASE);
+}
+
+/* Called on every siplog_open(), the first one names the process */
+void
+siplog_stats_init(const char *app)
+{
+
+    siplog_stats_app0 = app;
+    pthread_once(&siplog_stats_once, siplog_stats_setup);
+}
+
+int
+siplog_stats_enabled(void)
+{
+
+    return (__atomic_load_n(&siplog_stats_on, __ATOMIC_RELAXED));
+}
+
+void
+siplog_stats_line(int level)
+{
+    uint64_t n;
+
+    if (!siplog_stats_enabled() || level < 0 || level >= SIPLOG_NLEVELS)
+        return;
+    n = __atomic_add_fetch(&siplog_stats.lines[level], 1, __ATOMIC_RELAXED);
+    if (n % SIPLOG_STATS_EVERY == 0)
+        siplog_stats_publish(0);
+}
+
+void
+siplog_stats_bytes(size_t nbytes)
+{
+
+    if (siplog_stats_enabled())
+        __atomic_add_fetch(&siplog_stats.bytes, nbytes, __ATOMIC_RELAXED);
+}
+
+/* Worker has picked up records that have been queued since a given time */
+void
+siplog_stats_lag(const struct timespec *since)
+{
+    int64_t lag;
+
+    if (!siplog_stats_enabled())
+        return;
+    lag = siplog_stats_elapsed(since);
+    __atomic_store_n(&siplog_stats.lag_last, lag, __ATOMIC_RELAXED);
+    siplog_stats_max(&siplog_stats.lag_max, lag);
+}
+
+/* Index append that has started at a given time is complete */
+void
+siplog_stats_index(const struct timespec *start)
+{
+    int64_t ns;
+
+    if (!siplog_stats_enabled())
+        return;
+    ns = siplog_stats_elapsed(start);
+    __atomic_add_fetch(&siplog_stats.idx_appends, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&siplog_stats.idx_ns_total, ns, __ATOMIC_RELAXED);
+    siplog_stats_max(&siplog_stats.idx_ns_max, ns);
+}
+
+/*
+ * Refresh the snapshot in the segment, unless it has been done recently
+ * and force is not set, or another thread is doing it right now.
+ */
+void
+siplog_stats_publish(int force)
+{
+    struct siplog_stats_shm snap, *sp;
+    struct timespec ts;
+    struct timeval tv;
+    uint32_t seq;
+    int64_t now;
+    int i;
+
+    if (!siplog_stats_enabled())
+        return;
+    if (__atomic_exchange_n(&siplog_stats_busy, 1, __ATOMIC_ACQUIRE) != 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    if (!force && siplog_stats_last != 0 &&
+      now - siplog_stats_last < SIPLOG_STATS_INTERVAL)
+        goto out;
+    if (siplog_stats_shm == NULL && siplog_stats_attach() != 0)
+        goto out;
+    siplog_stats_last = now;
+    sp = siplog_stats_shm;
+
+    memcpy(&snap, sp, sizeof(snap));
+    gettimeofday(&tv, NULL);
+    snap.updated = (int64_t)tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL;
+    for (i = 0; i < SIPLOG_NLEVELS; i++) {
+        snap.lines[i] = __atomic_load_n(&siplog_stats.lines[i],
+          __ATOMIC_RELAXED);
+        snap.drops[i] = siplog_queue_drops(i);
+    }
+    snap.bytes = __atomic_load_n(&siplog_stats.bytes, __ATOMIC_RELAXED);
+    snap.qdepth = siplog_queue_depth();
+    snap.lag_last = __atomic_load_n(&siplog_stats.lag_last, __ATOMIC_RELAXED);
+    snap.lag_max = __atomic_load_n(&siplog_stats.lag_max, __ATOMIC_RELAXED);
+    snap.idx_appends = __atomic_load_n(&siplog_stats.idx_appends,
+      __ATOMIC_RELAXED);
+    snap.idx_ns_total = __atomic_load_n(&siplog_stats.idx_ns_total,
+      __ATOMIC_RELAXED);
+    snap.idx_ns_max = __atomic_load_n(&siplog_stats.idx_ns_max,
+      __ATOMIC_RELAXED);
+    if (siplog_memdeb_totals != NULL) {
+        siplog_memdeb_totals(&snap.memdeb_live, &snap.memdeb_peak);
+    } else {
+        snap.memdeb_live = -1;
+        snap.memdeb_peak = -1;
+    }
+
+    seq = sp->seq;
+    __atomic_store_n(&sp->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    snap.seq = seq + 1;
+    memcpy(sp, &snap, sizeof(snap));
+    __atomic_store_n(&sp->seq, seq + 2, __ATOMIC_RELEASE);
+out:
+    __atomic_store_n(&siplog_stats_busy, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,647 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Stress and soak harness. Runs a number of processes with a number of
+ * threads each, every thread with a handle of its own, all of them logging
+ * with siplog_iwrite() into the same SIPLOG_LOGFILE_FILE, while the log
+ * file is rotated underneath them. Once they are done, the output is
+ * checked:
+ *
+ *  o every line has to be complete and intact: the body carries the
+ *    call-id, sequence number and the length of a payload that is fully
+ *    determined by them, so torn or interleaved lines don't parse;
+ *
+ *  o every entry in the call-id index of each file has to point at the
+ *    start of a line of that call-id and have its exact length, or that of
+ *    a run of them once compacted, and every line has to be indexed;
+ *
+ *  o the number of sequence numbers that are missing has to match the
+ *    number of lines the library reports as dropped by the process, and
+ *    with -D, be no more than that percentage of the lines logged.
+ *
+ * Throughput and the distribution of the time spent in siplog_iwrite()
+ * are reported as well. Exits with 0 if all checks pass.
+ *
+ *   stress [-b bend] [-p nprocs] [-t nthreads] [-d seconds] [-r rotate_ms]
+ *          [-D max_drop_pct] [-R] [-k] [-o dir]
+ */
+
+#define _FILE_OFFSET_BITS  64
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "siplog.h"
+
+#define STRESS_APP		"stress"
+#define STRESS_MAXPAD		200
+/* Every that many lines is a long one, to exercise the heap paths */
+#define STRESS_LONG_EVERY	1024
+#define STRESS_LONG_LEN		(12 * 1024)
+#define STRESS_HBEAT_EVERY	256
+#define STRESS_NBUCKETS		64
+#define STRESS_MAXREPORT	5
+
+struct stress_thread {
+    pthread_t tid;
+    char call_id[64];
+    uint64_t nlines;
+    int64_t max_ns;
+    uint64_t hist[STRESS_NBUCKETS];
+    /* Filled in by the parent */
+    int proc;
+    uint8_t *seen;
+    uint64_t nseen;
+    uint64_t ndups;
+};
+
+struct stress_line {
+    off_t offset;
+    size_t len;
+    int thread;
+};
+
+static int nprocs = 4;
+static int nthreads = 4;
+static int duration = 5;
+static int rotate_ms = 500;
+static double max_drop_pct = 100;
+static int flags;
+static const char *workdir;
+static char logpath[1024];
+static char idxdir[1024];
+static char pattern[STRESS_LONG_LEN + 26];
+static struct timespec deadline;
+
+static struct stress_thread *threads;
+static uint64_t *drops;
+static uint64_t ntorn, nidx, nidx_bad, nunindexed;
+
+static void
+usage(void)
+{
+
+    fprintf(stderr, "usage: stress [-b bend] [-p nprocs] [-t nthreads] "
+      "[-d seconds] [-r rotate_ms]\n              [-D max_drop_pct] [-R] "
+      "[-k] [-o dir]\n");
+    exit(1);
+}
+
+static int64_t
+stress_ns(const struct timespec *tsp)
+{
+
+    return ((int64_t)tsp->tv_sec * 1000000000LL + tsp->tv_nsec);
+}
+
+static int
+stress_padlen(uint64_t seq)
+{
+
+    if (seq % STRESS_LONG_EVERY == STRESS_LONG_EVERY - 1)
+        return (STRESS_LONG_LEN);
+    return ((int)((seq * 7) % STRESS_MAXPAD));
+}
+
+static const char *
+stress_payload(uint64_t seq)
+{
+
+    return (pattern + seq % 26);
+}
+
+static void *
+stress_thread_run(void *arg)
+{
+    struct stress_thread *stp;
+    struct timespec t0, t1;
+    siplog_t h;
+    uint64_t seq;
+    int64_t ns;
+    int plen, level, b;
+
+    stp = (struct stress_thread *)arg;
+    h = siplog_open(STRESS_APP, stp->call_id, flags);
+    if (h == NULL)
+        err(1, "siplog_open");
+    for (seq = 0;; seq++) {
+        plen = stress_padlen(seq);
+        /* Some go through the high priority lane of the async backends */
+        level = (seq % 100 == 99) ? SIPLOG_ERR : SIPLOG_INFO;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        siplog_iwrite(level, h, stp->call_id, "S %s %" PRIu64 " %d %.*s E",
+          stp->call_id, seq, plen, plen, stress_payload(seq));
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns = stress_ns(&t1) - stress_ns(&t0);
+        if (ns > stp->max_ns)
+            stp->max_ns = ns;
+        b = (ns > 0) ? 64 - __builtin_clzll((uint64_t)ns) : 0;
+        stp->hist[b < STRESS_NBUCKETS ? b : STRESS_NBUCKETS - 1]++;
+        if (seq % STRESS_HBEAT_EVERY == STRESS_HBEAT_EVERY - 1)
+            siplog_hbeat(h);
+        if (stress_ns(&t1) >= stress_ns(&deadline))
+            break;
+    }
+    stp->nlines = seq + 1;
+    siplog_close(h);
+    return (NULL);
+}
+
+static void
+stress_child(int proc)
+{
+    struct stress_thread *stp;
+    char path[1100];
+    uint64_t ndrops;
+    FILE *f;
+    int i, j;
+
+    for (i = 0; i < nthreads; i++) {
+        stp = &threads[proc * nthreads + i];
+        if (pthread_create(&stp->tid, NULL, stress_thread_run, stp) != 0)
+            errx(1, "pthread_create failed");
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[proc * nthreads + i].tid, NULL);
+    ndrops = 0;
+    for (i = SIPLOG_DBUG; i <= SIPLOG_CRIT; i++)
+        ndrops += siplog_queue_drops(i);
+
+    snprintf(path, sizeof(path), "%s/res.%d", workdir, proc);
+    f = fopen(path, "w");
+    if (f == NULL)
+        err(1, "%s", path);
+    fprintf(f, "P %" PRIu64 "\n", ndrops);
+    for (i = 0; i < nthreads; i++) {
+        stp = &threads[proc * nthreads + i];
+        fprintf(f, "T %" PRIu64 " %" PRId64, stp->nlines, stp->max_ns);
+        for (j = 0; j < STRESS_NBUCKETS; j++)
+            fprintf(f, " %" PRIu64, stp->hist[j]);
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    /* exit(3) rather than _exit(2), async backends flush from atexit */
+    exit(0);
+}
+
+static void
+stress_results(int proc)
+{
+    struct stress_thread *stp;
+    char path[1100], kind[2];
+    FILE *f;
+    int i, j;
+
+    snprintf(path, sizeof(path), "%s/res.%d", workdir, proc);
+    f = fopen(path, "r");
+    if (f == NULL)
+        errx(1, "process #%d has not reported its results", proc);
+    if (fscanf(f, "%1s %" SCNu64, kind, &drops[proc]) != 2)
+        errx(1, "%s: malformed", path);
+    for (i = 0; i < nthreads; i++) {
+        stp = &threads[proc * nthreads + i];
+        if (fscanf(f, "%1s %" SCNu64 " %" SCNd64, kind, &stp->nlines,
+          &stp->max_ns) != 3)
+            errx(1, "%s: malformed", path);
+        for (j = 0; j < STRESS_NBUCKETS; j++) {
+            if (fscanf(f, "%" SCNu64, &stp->hist[j]) != 1)
+                errx(1, "%s: malformed", path);
+        }
+        stp->seen = calloc(stp->nlines, 1);
+        if (stp->seen == NULL)
+            err(1, "calloc");
+    }
+    fclose(f);
+    unlink(path);
+}
+
+/*
+ * Parse a line "<tstamp>/<call_id>/stress[<pid>]: S <call_id> <seq>
+ * <plen> <payload> E\n" and check that it is intact. Returns index of the
+ * thread that has logged it and stores the sequence number, -1 if it's
+ * torn.
+ */
+static int
+stress_parse(const char *cp, size_t len, uint64_t *seqp)
+{
+    const char *ep, *cid, *cide, *bp;
+    int proc, thr, plen, n;
+    char *p;
+    unsigned long long seq;
+
+    ep = cp + len;
+    if (len < 2 || ep[-1] != '\n')
+        return (-1);
+    cid = memchr(cp, '/', len);
+    if (cid == NULL)
+        return (-1);
+    cid++;
+    cide = memchr(cid, '/', ep - cid);
+    if (cide == NULL || (size_t)(ep - cide) < sizeof("/" STRESS_APP "[") ||
+      memcmp(cide, "/" STRESS_APP "[", sizeof("/" STRESS_APP "[") - 1) != 0)
+        return (-1);
+    bp = memchr(cide, ']', ep - cide);
+    if (bp == NULL || ep - bp < 6 || memcmp(bp, "]: S ", 5) != 0)
+        return (-1);
+    bp += 5;
+    if ((size_t)(ep - bp) <= (size_t)(cide - cid) ||
+      memcmp(bp, cid, cide - cid) != 0 || bp[cide - cid] != ' ')
+        return (-1);
+    /* The data is not NUL-terminated, so no sscanf(3) */
+    if (cide - cid < (int)sizeof(STRESS_APP "-") ||
+      memcmp(cid, STRESS_APP "-", sizeof(STRESS_APP "-") - 1) != 0)
+        return (-1);
+    proc = strtol(cid + sizeof(STRESS_APP "-") - 1, &p, 10);
+    if (*p != '-')
+        return (-1);
+    thr = strtol(p + 1, &p, 10);
+    if (p != cide || proc < 0 || proc >= nprocs || thr < 0 ||
+      thr >= nthreads)
+        return (-1);
+    bp += cide - cid + 1;
+    seq = strtoull(bp, &p, 10);
+    if (p == bp || *p != ' ')
+        return (-1);
+    bp = p + 1;
+    n = strtol(bp, &p, 10);
+    if (p == bp || *p != ' ')
+        return (-1);
+    bp = p + 1;
+    plen = stress_padlen(seq);
+    if (n != plen || ep - bp != plen + 3 ||
+      memcmp(bp, stress_payload(seq), plen) != 0 ||
+      memcmp(bp + plen, " E\n", 3) != 0)
+        return (-1);
+    *seqp = seq;
+    return (proc * nthreads + thr);
+}
+
+static int
+stress_linecmp(const void *a, const void *b)
+{
+    const struct stress_line *la, *lb;
+
+    la = (const struct stress_line *)a;
+    lb = (const struct stress_line *)b;
+    return ((la->offset > lb->offset) - (la->offset < lb->offset));
+}
+
+static void
+stress_check_index(const char *path, ino_t ino, struct stress_line *lines,
+  size_t nlines)
+{
+    static const char *sfx[] = {"", ".compacting", ".cidx"};
+    struct stress_line key, *lp, *elp;
+    char ipath[1100], id[256];
+    unsigned long long off, len, end;
+    uint8_t *indexed;
+    size_t i, j, nok;
+    FILE *f;
+
+    indexed = calloc(nlines + 1, 1);
+    if (indexed == NULL)
+        err(1, "calloc");
+    nok = 0;
+    /* Writers compact the index of the files they have rotated away */
+    for (j = 0; j < sizeof(sfx) / sizeof(sfx[0]); j++) {
+        snprintf(ipath, sizeof(ipath), "%s/%llu%s", idxdir,
+          (unsigned long long)ino, sfx[j]);
+        f = fopen(ipath, "r");
+        while (f != NULL &&
+          fscanf(f, "%255s %llu %llu", id, &off, &len) == 3) {
+            nidx++;
+            key.offset = off;
+            lp = bsearch(&key, lines, nlines, sizeof(*lines),
+              stress_linecmp);
+            /* Compact one merges consecutive lines of a call */
+            end = off;
+            for (elp = lp; elp != NULL && elp < lines + nlines &&
+              end < off + len && elp->offset == (off_t)end &&
+              strcmp(id, threads[elp->thread].call_id) == 0; elp++)
+                end += elp->len;
+            if (lp == NULL || end != off + len) {
+                if (nidx_bad++ < STRESS_MAXREPORT)
+                    warnx("%s: index entry \"%s %llu %llu\" doesn't match "
+                      "the file", path, id, off, len);
+                continue;
+            }
+            for (; lp < elp; lp++) {
+                if (indexed[lp - lines]++ == 0)
+                    nok++;
+            }
+        }
+        if (f != NULL)
+            fclose(f);
+    }
+    if (nok != nlines) {
+        for (i = 0; i < nlines; i++) {
+            if (indexed[i] == 0 && nunindexed++ < STRESS_MAXREPORT)
+                warnx("%s: line at %llu is not indexed", path,
+                  (unsigned long long)lines[i].offset);
+        }
+    }
+    free(indexed);
+}
+
+/* Check all lines in one of the log files, returns its size */
+static off_t
+stress_check_file(const char *path)
+{
+    struct stress_line *lines;
+    struct stress_thread *stp;
+    struct stat st;
+    const char *base, *cp, *ep, *nl;
+    size_t nlines;
+    uint64_t seq;
+    int fd, t;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 && errno == ENOENT)
+        return (0);
+    if (fd == -1 || fstat(fd, &st) == -1)
+        err(1, "%s", path);
+    if (st.st_size == 0) {
+        close(fd);
+        return (0);
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        err(1, "%s: mmap", path);
+    close(fd);
+    lines = malloc(sizeof(*lines) * (st.st_size / 32 + 1));
+    if (lines == NULL)
+        err(1, "malloc");
+    nlines = 0;
+    for (cp = base, ep = base + st.st_size; cp < ep; cp = nl) {
+        nl = memchr(cp, '\n', ep - cp);
+        nl = (nl != NULL) ? nl + 1 : ep;
+        t = stress_parse(cp, nl - cp, &seq);
+        if (t < 0 || seq >= threads[t].nlines) {
+            if (ntorn++ < STRESS_MAXREPORT)
+                warnx("%s: torn line at %lld: \"%.*s\"", path,
+                  (long long)(cp - base), (int)MIN(nl - cp, 120), cp);
+            continue;
+        }
+        stp = &threads[t];
+        if (stp->seen[seq]++ == 0)
+            stp->nseen++;
+        else
+            stp->ndups++;
+        lines[nlines].offset = cp - base;
+        lines[nlines].len = nl - cp;
+        lines[nlines].thread = t;
+        nlines++;
+    }
+    stress_check_index(path, st.st_ino, lines, nlines);
+    free(lines);
+    munmap((void *)base, st.st_size);
+    return (st.st_size);
+}
+
+static void
+stress_cleanup(const char *dir)
+{
+    struct dirent *dep;
+    char path[1100];
+    DIR *dp;
+
+    dp = opendir(dir);
+    if (dp == NULL)
+        return;
+    while ((dep = readdir(dp)) != NULL) {
+        if (strcmp(dep->d_name, ".") == 0 || strcmp(dep->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, dep->d_name);
+        unlink(path);
+    }
+    closedir(dp);
+    rmdir(dir);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct stress_thread *stp;
+    struct timespec start, end, ts, idle;
+    char tmpl[] = "/tmp/siplog-stress.XXXXXX";
+    char path[1100];
+    uint64_t hist[STRESS_NBUCKETS], total, nlines, missing, pdrops, acc;
+    int64_t max_ns;
+    off_t nbytes;
+    double secs;
+    pid_t pid;
+    int ch, i, j, b, nalive, nrot, status, keep, failed;
+
+    keep = 0;
+    while ((ch = getopt(argc, argv, "b:p:t:d:r:D:Rko:")) != -1) {
+        switch (ch) {
+        case 'b':
+            setenv("SIPLOG_BEND", optarg, 1);
+            break;
+
+        case 'p':
+            nprocs = atoi(optarg);
+            break;
+
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+
+        case 'd':
+            duration = atoi(optarg);
+            break;
+
+        case 'r':
+            rotate_ms = atoi(optarg);
+            break;
+
+        case 'D':
+            max_drop_pct = atof(optarg);
+            break;
+
+        case 'R':
+            flags |= LF_REOPEN;
+            break;
+
+        case 'k':
+            keep = 1;
+            break;
+
+        case 'o':
+            workdir = optarg;
+            break;
+
+        default:
+            usage();
+        }
+    }
+    if (optind != argc || nprocs < 1 || nthreads < 1 || duration < 1 ||
+      rotate_ms < 0 || max_drop_pct < 0)
+        usage();
+
+    if (workdir == NULL) {
+        workdir = mkdtemp(tmpl);
+        if (workdir == NULL)
+            err(1, "mkdtemp");
+    } else if (mkdir(workdir, 0755) == -1 && errno != EEXIST) {
+        err(1, "%s", workdir);
+    }
+    snprintf(logpath, sizeof(logpath), "%s/sip.log", workdir);
+    snprintf(idxdir, sizeof(idxdir), "%s/idx", workdir);
+    if (mkdir(idxdir, 0755) == -1 && errno != EEXIST)
+        err(1, "%s", idxdir);
+    setenv("SIPLOG_LOGFILE_FILE", logpath, 1);
+    setenv("SIPLOG_INDEX_DIR", idxdir, 1);
+    if (getenv("SIPLOG_BEND") == NULL)
+        setenv("SIPLOG_BEND", "logfile", 1);
+    for (i = 0; i < (int)sizeof(pattern); i++)
+        pattern[i] = 'a' + i % 26;
+
+    threads = calloc(nprocs * nthreads, sizeof(*threads));
+    drops = calloc(nprocs, sizeof(*drops));
+    if (threads == NULL || drops == NULL)
+        err(1, "calloc");
+    for (i = 0; i < nprocs * nthreads; i++) {
+        threads[i].proc = i / nthreads;
+        snprintf(threads[i].call_id, sizeof(threads[i].call_id),
+          STRESS_APP "-%d-%d", i / nthreads, i % nthreads);
+    }
+
+    printf("%d process(es) x %d thread(s), %s%s, %d s, rotating every %d ms"
+      " in %s\n", nprocs, nthreads, getenv("SIPLOG_BEND"),
+      (flags & LF_REOPEN) ? " (LF_REOPEN)" : "", duration, rotate_ms,
+      workdir);
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    deadline.tv_sec += duration;
+    for (i = 0; i < nprocs; i++) {
+        pid = fork();
+        if (pid == -1)
+            err(1, "fork");
+        if (pid == 0)
+            stress_child(i);
+    }
+
+    /* Rotate the log while the children are running */
+    ts.tv_sec = rotate_ms / 1000;
+    ts.tv_nsec = (rotate_ms % 1000) * 1000000L;
+    idle.tv_sec = 0;
+    idle.tv_nsec = 10000000L;
+    failed = 0;
+    nrot = 0;
+    for (nalive = nprocs; nalive > 0;) {
+        if (rotate_ms > 0) {
+            nanosleep(&ts, NULL);
+            snprintf(path, sizeof(path), "%s.%d", logpath, nrot);
+            if (rename(logpath, path) == 0)
+                nrot++;
+        } else {
+            nanosleep(&idle, NULL);
+        }
+        while (nalive > 0 && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            nalive--;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                warnx("child %d has failed", (int)pid);
+                failed = 1;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (failed)
+        errx(1, "FAIL, output is left in %s", workdir);
+
+    for (i = 0; i < nprocs; i++)
+        stress_results(i);
+    nbytes = stress_check_file(logpath);
+    for (i = 0; i < nrot; i++) {
+        snprintf(path, sizeof(path), "%s.%d", logpath, i);
+        nbytes += stress_check_file(path);
+    }
+
+    memset(hist, '\0', sizeof(hist));
+    total = nlines = missing = 0;
+    max_ns = 0;
+    for (i = 0; i < nprocs; i++) {
+        pdrops = 0;
+        for (j = 0; j < nthreads; j++) {
+            stp = &threads[i * nthreads + j];
+            total += stp->nlines;
+            nlines += stp->nseen;
+            pdrops += stp->nlines - stp->nseen;
+            if (stp->ndups > 0) {
+                warnx("%s: %" PRIu64 " duplicate line(s)", stp->call_id,
+                  stp->ndups);
+                failed = 1;
+            }
+            if (stp->max_ns > max_ns)
+                max_ns = stp->max_ns;
+            for (b = 0; b < STRESS_NBUCKETS; b++)
+                hist[b] += stp->hist[b];
+        }
+        missing += pdrops;
+        if (pdrops != drops[i]) {
+            warnx("process #%d: %" PRIu64 " line(s) missing, %" PRIu64
+              " reported as dropped", i, pdrops, drops[i]);
+            failed = 1;
+        }
+    }
+    if (ntorn > 0 || nidx_bad > 0 || nunindexed > 0)
+        failed = 1;
+    if (missing * 100.0 > total * max_drop_pct) {
+        warnx("%.1f%% of the lines dropped, more than %.1f%%",
+          missing * 100.0 / total, max_drop_pct);
+        failed = 1;
+    }
+
+    secs = (double)(stress_ns(&end) - stress_ns(&start)) / 1e9;
+    printf("lines: %" PRIu64 " logged, %" PRIu64 " written, %" PRIu64
+      " dropped, %d rotation(s)\n", total, nlines, missing, nrot);
+    printf("throughput: %.0f lines/s, %.1f MB/s\n", nlines / secs,
+      nbytes / secs / (1024 * 1024));
+    printf("checks: %" PRIu64 " torn line(s), %" PRIu64 " index entries, %"
+      PRIu64 " bad, %" PRIu64 " line(s) not indexed\n", ntorn, nidx,
+      nidx_bad, nunindexed);
+    printf("time in siplog_iwrite():");
+    for (acc = 0, b = 0; b < STRESS_NBUCKETS; b++) {
+        acc += hist[b];
+        if (acc * 2 >= total && (acc - hist[b]) * 2 < total)
+            printf(" p50 < %.1f us,", (double)(1ULL << b) / 1e3);
+        if (acc * 100 >= total * 99 && (acc - hist[b]) * 100 < total * 99)
+            printf(" p99 < %.1f us,", (double)(1ULL << b) / 1e3);
+        if (acc * 1000 >= total * 999 && (acc - hist[b]) * 1000 <
+          total * 999)
+            printf(" p99.9 < %.1f us,", (double)(1ULL << b) / 1e3);
+    }
+    printf(" max %.1f us\n", max_ns / 1e3);
+
+    if (failed) {
+        printf("FAIL, output is left in %s\n", workdir);
+        return (1);
+    }
+    printf("PASS\n");
+    if (!keep) {
+        stress_cleanup(idxdir);
+        stress_cleanup(workdir);
+    }
+    return (0);
+}
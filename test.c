@@ -5,12 +5,611 @@
  *
  */
 
+/*
+ * Logs some lines via whatever SIPLOG_BEND is set to, then runs the
+ * regression checks, each against a fresh log file of its own in a
+ * temporary directory. Exits with 0 if all of them pass.
+ */
+
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <err.h>
+#include <pthread.h>
 #include <siplog.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+/* Lines the flight recorder is checked with, all of them fit into it */
+#define TEST_NCONTEXT	400
+/* Lines of each call in the file whose index gets compacted */
+#define TEST_NCIDX	100
+/* Threads that hold a reservation each at once, fits into the low lane */
+#define TEST_NRESV	40
+/* Threads that take all of the items of the async queue, and then some */
+#define TEST_NHOG	72
+/* Seconds before a check that hangs is killed */
+#define TEST_TIMEOUT	30
+/* How long to wait for the lines to show up in the file, in 10ms steps */
+#define TLOG_NWAITS	500
+
+struct tlog {
+    char *buf;
+    char **lines;
+    int nlines;
+};
+
+struct tresv {
+    siplog_t log;
+    int level;
+    pthread_barrier_t *barrier;
+    pthread_barrier_t *release;	/* if not NULL, commit once it's passed */
+    int n;
+    char *rp;
+};
+
+static char tdir[] = "/tmp/siplog-test.XXXXXX";
+static int nchecks, nfailed;
+
+#define CHECK(expr)							\
+    do {								\
+	nchecks++;							\
+	if (!(expr)) {							\
+	    warnx("%s:%d: check failed: %s", __FILE__, __LINE__, #expr);\
+	    nfailed++;							\
+	}								\
+    } while (0)
+
+/*
+ * Point new handles at given backend and a log file of their own, path
+ * of which is stored in path.
+ */
+static void
+tlog_setup(const char *bend, const char *name, char *path, size_t size)
+{
+    char *cp;
+
+    snprintf(path, size, "%s/%s-%s.log", tdir, name, bend);
+    /* Fan-out specs are not much of a file name */
+    for (cp = path + strlen(tdir) + 1; *cp != '\0'; cp++) {
+        if (*cp == ',' || *cp == ':')
+            *cp = '_';
+    }
+    setenv("SIPLOG_BEND", bend, 1);
+    setenv("SIPLOG_LOGFILE_FILE", path, 1);
+}
+
+static void
+tlog_free(struct tlog *tlp)
+{
+
+    free(tlp->buf);
+    free(tlp->lines);
+    memset(tlp, '\0', sizeof(*tlp));
+}
+
+static int
+tlog_load(struct tlog *tlp, const char *path)
+{
+    FILE *f;
+    long size;
+    char *cp, *ep;
+
+    memset(tlp, '\0', sizeof(*tlp));
+    f = fopen(path, "r");
+    if (f == NULL)
+        return (-1);
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    tlp->buf = malloc(size + 1);
+    tlp->lines = malloc(sizeof(tlp->lines[0]) * (size + 1));
+    if (tlp->buf == NULL || tlp->lines == NULL ||
+      fread(tlp->buf, 1, size, f) != (size_t)size) {
+        fclose(f);
+        tlog_free(tlp);
+        return (-1);
+    }
+    fclose(f);
+    tlp->buf[size] = '\0';
+    for (cp = tlp->buf; *cp != '\0'; cp = ep + 1) {
+        ep = strchr(cp, '\n');
+        if (ep == NULL)
+            break;
+        *ep = '\0';
+        tlp->lines[tlp->nlines++] = cp;
+    }
+    return (0);
+}
+
+/* Index of the first line at or after from that has needle in it, or -1 */
+static int
+tlog_find(const struct tlog *tlp, const char *needle, int from)
+{
+    int i;
+
+    for (i = from; i < tlp->nlines; i++) {
+        if (strstr(tlp->lines[i], needle) != NULL)
+            return (i);
+    }
+    return (-1);
+}
+
+static int
+tlog_count(const struct tlog *tlp, const char *needle)
+{
+    int i, n;
+
+    n = 0;
+    for (i = tlog_find(tlp, needle, 0); i >= 0;
+      i = tlog_find(tlp, needle, i + 1))
+        n++;
+    return (n);
+}
+
+/*
+ * Load the file once needle shows up in it n times, the async backends
+ * write the lines out some time after the handle has been closed.
+ */
+static int
+tlog_wait(struct tlog *tlp, const char *path, const char *needle, int n)
+{
+    struct timespec interval;
+    int i;
+
+    interval.tv_sec = 0;
+    interval.tv_nsec = 10000000;
+    for (i = 0; i < TLOG_NWAITS; i++) {
+        if (tlog_load(tlp, path) == 0) {
+            if (tlog_count(tlp, needle) >= n)
+                return (0);
+            tlog_free(tlp);
+        }
+        nanosleep(&interval, NULL);
+    }
+    warnx("%s: \"%s\" never showed up %d time(s)", path, needle, n);
+    return (-1);
+}
+
+/* Duplicates get counted, handles opened before it was enabled included */
+static void
+test_dedup(const char *bend)
+{
+    char path[256];
+    struct tlog tl;
+    siplog_t log;
+    int i;
+
+    tlog_setup(bend, "dedup", path, sizeof(path));
+    log = siplog_open("test", "dedup@1.2.3.4", 0);
+    CHECK(log != NULL);
+    if (log == NULL)
+        return;
+    siplog_set_dedup(SIPLOG_INFO, 1);
+    for (i = 0; i < 5; i++)
+        siplog_write(SIPLOG_INFO, log, "same line");
+    siplog_write(SIPLOG_INFO, log, "other line");
+    siplog_close(log);
+    siplog_set_dedup(SIPLOG_INFO, 0);
+    if (tlog_wait(&tl, path, "other line", 1) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(tlog_count(&tl, "same line") == 1);
+    CHECK(tlog_count(&tl, "last message repeated 4 times") == 1);
+    CHECK(tlog_find(&tl, "same line", 0) <
+      tlog_find(&tl, "last message repeated", 0));
+    tlog_free(&tl);
+}
+
+/* Stands for a wrapper that all the lines of an application go through */
+static void
+test_wrapper(siplog_t log, const char *msg)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)msg;
+    iov.iov_len = strlen(msg);
+    siplog_kwritev(SIPLOG_INFO, log, msg, &iov, 1);
+}
+
+/*
+ * Burst of lines goes out, the rest is counted and reported later on. Can
+ * only be run once, the state is kept per call site, not per handle.
+ */
+static void
+test_ratelimit(const char *bend)
+{
+    char path[256];
+    struct tlog tl;
+    siplog_t log;
+    int i, j;
+
+    tlog_setup(bend, "ratelimit", path, sizeof(path));
+    log = siplog_open("test", "ratelimit@1.2.3.4", 0);
+    CHECK(log != NULL);
+    if (log == NULL)
+        return;
+    siplog_set_ratelimit(SIPLOG_WARN, 1, 3);
+    siplog_set_ratelimit(SIPLOG_INFO, 1, 1);
+    for (i = 0; i < 2; i++) {
+        test_wrapper(log, "keyed line a");
+        test_wrapper(log, "keyed line b");
+    }
+    for (i = 0; i < 2; i++) {
+        /* Only the first burst of 3 from each round gets through */
+        for (j = 0; j < 10; j++)
+            siplog_write(SIPLOG_WARN, log, "storm line %d", i);
+        if (i == 0)
+            sleep(1);
+    }
+    siplog_write(SIPLOG_WARN, log, "quiet line");
+    siplog_close(log);
+    siplog_set_ratelimit(SIPLOG_WARN, 0, 0);
+    siplog_set_ratelimit(SIPLOG_INFO, 0, 0);
+    if (tlog_wait(&tl, path, "quiet line", 1) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(tlog_count(&tl, "storm line 0") == 3);
+    CHECK(tlog_count(&tl, "storm line 1") == 1);
+    CHECK(tlog_count(&tl, "7 message(s) like \"storm line %d\"") == 1);
+    CHECK(tlog_count(&tl, "keyed line a") == 1);
+    CHECK(tlog_count(&tl, "keyed line b") == 1);
+    tlog_free(&tl);
+}
+
+/*
+ * Context that the flight recorder has kept is written out in full, in
+ * order and right ahead of the line that has triggered it, whichever way
+ * that line is logged.
+ */
+static void
+test_flightrec(const char *bend)
+{
+    static const char *triggers[] = {
+        "written trigger", "reserved trigger", "writev trigger"
+    };
+    char path[256], line[64], *rp;
+    struct iovec iov;
+    struct tlog tl;
+    siplog_t log;
+    int i, j, n, round, nlines;
+
+    tlog_setup(bend, "flightrec", path, sizeof(path));
+    log = siplog_open("test", "flightrec@1.2.3.4", LF_FLIGHTREC);
+    CHECK(log != NULL);
+    if (log == NULL)
+        return;
+    siplog_set_level(log, SIPLOG_INFO);
+    for (round = 0, i = 0; round < 3; round++) {
+        for (n = (round == 0) ? TEST_NCONTEXT : 10; n > 0; n--, i++)
+            siplog_write(SIPLOG_DBUG, log, "context line <%d>", i);
+        switch (round) {
+        case 0:
+            siplog_write(SIPLOG_ERR, log, "%s", triggers[round]);
+            break;
+        case 1:
+            rp = siplog_reserve(SIPLOG_ERR, log, 64);
+            CHECK(rp != NULL);
+            if (rp != NULL)
+                siplog_commit(log, snprintf(rp, 64, "%s", triggers[round]));
+            break;
+        case 2:
+            iov.iov_base = (void *)triggers[round];
+            iov.iov_len = strlen(triggers[round]);
+            siplog_writev(SIPLOG_ERR, log, &iov, 1);
+            break;
+        }
+    }
+    nlines = i;
+    siplog_close(log);
+    if (tlog_wait(&tl, path, triggers[2], 1) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(tlog_count(&tl, "context line <") == nlines);
+    for (round = 0, i = 0, j = 0; round < 3 && j >= 0; round++) {
+        for (n = (round == 0) ? TEST_NCONTEXT : 10; n > 0 && j >= 0;
+          n--, i++) {
+            snprintf(line, sizeof(line), "context line <%d>", i);
+            j = tlog_find(&tl, line, j);
+        }
+        CHECK(j >= 0);
+        CHECK(tlog_count(&tl, triggers[round]) == 1);
+        if (j >= 0) {
+            /* Nothing in between */
+            j = tlog_find(&tl, triggers[round], j);
+            CHECK(j >= 0 && strstr(tl.lines[j - 1], line) != NULL);
+        }
+    }
+    tlog_free(&tl);
+}
+
+/* Index files of given inode, sfx is one of "", ".compacting" or ".cidx" */
+static int
+tidx_exists(unsigned long long ino, const char *sfx)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/%llu%s", tdir, ino, sfx);
+    return (access(path, F_OK) == 0);
+}
+
+/*
+ * Index of a file that has been rotated away gets compacted, just once,
+ * whichever of the handles that have it open notices it first, and the
+ * lines of a call are then looked up through it.
+ */
+static void
+test_cidx(void)
+{
+    char path[256], opath[300], cpath[300], id[64], pid[64], *buf;
+    struct timespec interval;
+    struct stat st;
+    struct tlog tl;
+    siplog_t loga, logb;
+    unsigned long long ino, off, len;
+    FILE *cf, *lf;
+    int i, nlines, nother, next, sorted;
+
+    interval.tv_sec = 0;
+    interval.tv_nsec = 1000000;
+
+    tlog_setup("logfile_async", "cidx", path, sizeof(path));
+    loga = siplog_open("test", "cidx-a@1.2.3.4", 0);
+    logb = siplog_open("test", "cidx-b@1.2.3.4", 0);
+    CHECK(loga != NULL && logb != NULL);
+    if (loga == NULL || logb == NULL)
+        return;
+    for (i = 0; i < TEST_NCIDX; i++) {
+        /* Runs of lines of a call are to be merged into one extent */
+        siplog_write(SIPLOG_INFO, loga, "call a line <%d>", i);
+        siplog_write(SIPLOG_INFO, loga, "call a line <%d> again", i);
+        siplog_write(SIPLOG_INFO, logb, "call b line <%d>", i);
+        nanosleep(&interval, NULL);
+    }
+    /* Not to be dropped, the rest may be and is then not looked up */
+    siplog_write(SIPLOG_ERR, loga, "last line before rotation");
+    if (tlog_wait(&tl, path, "last line before rotation", 1) != 0) {
+        CHECK(0);
+        goto out;
+    }
+    tlog_free(&tl);
+    CHECK(stat(path, &st) == 0);
+    ino = st.st_ino;
+    snprintf(opath, sizeof(opath), "%s.0", path);
+    CHECK(rename(path, opath) == 0);
+    /* Like logrotate(8) does, new one is only picked up once it's there */
+    lf = fopen(path, "a");
+    CHECK(lf != NULL);
+    if (lf != NULL)
+        fclose(lf);
+    siplog_hbeat(loga);
+    siplog_hbeat(logb);
+    interval.tv_nsec = 10000000;
+    for (i = 0; i < TLOG_NWAITS; i++) {
+        if (tidx_exists(ino, ".cidx") && !tidx_exists(ino, "") &&
+          !tidx_exists(ino, ".compacting"))
+            break;
+        nanosleep(&interval, NULL);
+    }
+    CHECK(i < TLOG_NWAITS);
+    CHECK(!tidx_exists(ino, ".cidx.tmp"));
+
+    snprintf(cpath, sizeof(cpath), "%s/%llu.cidx", tdir, ino);
+    cf = fopen(cpath, "r");
+    lf = fopen(opath, "r");
+    CHECK(cf != NULL && lf != NULL);
+    nlines = nother = next = 0;
+    sorted = 1;
+    pid[0] = '\0';
+    while (cf != NULL && lf != NULL &&
+      fscanf(cf, "%63s %llu %llu", id, &off, &len) == 3) {
+        if (strcmp(pid, id) > 0)
+            sorted = 0;
+        strcpy(pid, id);
+        if (strcmp(id, "cidx-a@1.2.3.4") != 0)
+            continue;
+        next++;
+        buf = malloc(len + 1);
+        if (buf == NULL || fseek(lf, off, SEEK_SET) != 0 ||
+          fread(buf, 1, len, lf) != len) {
+            free(buf);
+            CHECK(0);
+            break;
+        }
+        buf[len] = '\0';
+        for (i = 0; i < (int)len; i++) {
+            if (buf[i] == '\n')
+                nlines++;
+        }
+        if (strstr(buf, "call b line") != NULL)
+            nother++;
+        free(buf);
+    }
+    if (cf != NULL)
+        fclose(cf);
+    if (lf != NULL)
+        fclose(lf);
+    CHECK(sorted);
+    CHECK(nother == 0);
+    if (tlog_load(&tl, opath) == 0) {
+        CHECK(nlines == tlog_count(&tl, "/cidx-a@1.2.3.4/"));
+        CHECK(next > 0);
+        tlog_free(&tl);
+    } else {
+        CHECK(0);
+    }
+out:
+    siplog_close(loga);
+    siplog_close(logb);
+}
+
+static void *
+tresv_run(void *arg)
+{
+    struct tresv *trp;
+
+    trp = (struct tresv *)arg;
+    trp->rp = siplog_reserve(trp->level, trp->log, 64);
+    /* Nothing is committed before everyone has had a go */
+    pthread_barrier_wait(trp->barrier);
+    if (trp->release != NULL)
+        pthread_barrier_wait(trp->release);
+    if (trp->rp != NULL)
+        siplog_commit(trp->log, snprintf(trp->rp, 64, "reserved line <%d>",
+          trp->n));
+    return (NULL);
+}
+
+/*
+ * Reservations that are held at once by many threads of an async handle
+ * that has the queue to itself all get an item, while another handle
+ * with a line in flight limits it to its share.
+ */
+static void
+test_share(void)
+{
+    struct tresv trs[TEST_NRESV];
+    pthread_t tids[TEST_NRESV];
+    pthread_barrier_t barrier;
+    char path[256], *rp;
+    struct tlog tl;
+    siplog_t logs[2], other;
+    unsigned long drops;
+    int i, round, ngot;
+
+    tlog_setup("logfile_async", "share", path, sizeof(path));
+    /* Lines of the first round may still be in flight in the second one */
+    logs[0] = siplog_open("test", "share@1.2.3.4", 0);
+    logs[1] = siplog_open("test", "share2@1.2.3.4", 0);
+    other = siplog_open("test", "share-other@1.2.3.4", 0);
+    CHECK(logs[0] != NULL && logs[1] != NULL && other != NULL);
+    if (logs[0] == NULL || logs[1] == NULL || other == NULL)
+        return;
+    for (round = 0; round < 2; round++) {
+        drops = siplog_queue_drops(SIPLOG_INFO);
+        rp = NULL;
+        if (round == 1) {
+            rp = siplog_reserve(SIPLOG_INFO, other, 64);
+            CHECK(rp != NULL);
+        }
+        pthread_barrier_init(&barrier, NULL, TEST_NRESV);
+        for (i = 0; i < TEST_NRESV; i++) {
+            trs[i].log = logs[round];
+            trs[i].level = SIPLOG_INFO;
+            trs[i].barrier = &barrier;
+            trs[i].release = NULL;
+            trs[i].n = round * TEST_NRESV + i;
+            if (pthread_create(&tids[i], NULL, tresv_run, &trs[i]) != 0)
+                err(1, "pthread_create");
+        }
+        for (ngot = 0, i = 0; i < TEST_NRESV; i++) {
+            pthread_join(tids[i], NULL);
+            if (trs[i].rp != NULL)
+                ngot++;
+        }
+        pthread_barrier_destroy(&barrier);
+        if (rp != NULL)
+            siplog_commit(other, snprintf(rp, 64, "other line"));
+        if (round == 0) {
+            CHECK(ngot == TEST_NRESV);
+            CHECK(siplog_queue_drops(SIPLOG_INFO) == drops);
+        } else {
+            CHECK(ngot > 0 && ngot < TEST_NRESV);
+            CHECK(siplog_queue_drops(SIPLOG_INFO) ==
+              drops + TEST_NRESV - ngot);
+        }
+    }
+    siplog_close(logs[0]);
+    siplog_close(logs[1]);
+    siplog_close(other);
+    /* Handles take turns, the other one may be written out last */
+    if (tlog_wait(&tl, path, "other line", 1) != 0) {
+        CHECK(0);
+        return;
+    }
+    tlog_free(&tl);
+    if (tlog_wait(&tl, path, "reserved line <", TEST_NRESV + ngot) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(tlog_count(&tl, "reserved line <") == TEST_NRESV + ngot);
+    CHECK(tlog_count(&tl, "other line") == 1);
+    tlog_free(&tl);
+}
+
+/*
+ * Flight recorder replay goes out even if the queue is full, and the line
+ * that has triggered it doesn't wait for the worker to make room for it.
+ * It used to, in which case it's killed after TEST_TIMEOUT.
+ */
+static void
+test_flightrec_full(void)
+{
+    struct tresv trs[TEST_NHOG];
+    pthread_t tids[TEST_NHOG];
+    pthread_barrier_t reserved, release;
+    char path[256];
+    struct tlog tl;
+    siplog_t log, hog;
+    int i, j, ngot;
+
+    tlog_setup("logfile_async", "flightrec-full", path, sizeof(path));
+    log = siplog_open("test", "flightrec-full@1.2.3.4", LF_FLIGHTREC);
+    hog = siplog_open("test", "flightrec-hog@1.2.3.4", 0);
+    CHECK(log != NULL && hog != NULL);
+    if (log == NULL || hog == NULL)
+        return;
+    siplog_set_level(log, SIPLOG_INFO);
+    for (i = 0; i < 10; i++)
+        siplog_write(SIPLOG_DBUG, log, "full context line <%d>", i);
+    pthread_barrier_init(&reserved, NULL, TEST_NHOG + 1);
+    pthread_barrier_init(&release, NULL, TEST_NHOG + 1);
+    for (i = 0; i < TEST_NHOG; i++) {
+        trs[i].log = hog;
+        trs[i].level = SIPLOG_ERR;
+        trs[i].barrier = &reserved;
+        trs[i].release = &release;
+        trs[i].n = i;
+        if (pthread_create(&tids[i], NULL, tresv_run, &trs[i]) != 0)
+            err(1, "pthread_create");
+    }
+    pthread_barrier_wait(&reserved);
+    for (ngot = 0, i = 0; i < TEST_NHOG; i++) {
+        if (trs[i].rp != NULL)
+            ngot++;
+    }
+    /* Not a single item is left */
+    CHECK(ngot < TEST_NHOG);
+    alarm(TEST_TIMEOUT);
+    siplog_write(SIPLOG_ERR, log, "full trigger");
+    alarm(0);
+    pthread_barrier_wait(&release);
+    for (i = 0; i < TEST_NHOG; i++)
+        pthread_join(tids[i], NULL);
+    pthread_barrier_destroy(&reserved);
+    pthread_barrier_destroy(&release);
+    siplog_close(log);
+    siplog_close(hog);
+    if (tlog_wait(&tl, path, "full trigger", 1) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(tlog_count(&tl, "full context line <") == 10);
+    j = tlog_find(&tl, "full trigger", 0);
+    CHECK(j > 0 && strstr(tl.lines[j - 1], "full context line <9>") != NULL);
+    tlog_free(&tl);
+}
+
+static const char *test_bends[] = {
+    "logfile", "logfile_async", "logfile_buffered",
+    "stderr:CRIT,logfile_async", NULL
+};
+
 int main()
 {
     siplog_t log, globallog;
@@ -29,7 +628,7 @@ int main()
     for (i = 0; i < 10000;) {
 	siplog_write(SIPLOG_DBUG, log, "message #%d", ++i);
 	/* sleep 0.0000001 second */
-	interval.tv_sec = 0; 
+	interval.tv_sec = 0;
 	interval.tv_nsec = 100;
 	nanosleep(&interval, NULL);
     }
@@ -41,5 +640,22 @@ int main()
     /* allow worker thread to finish its job in async mode */
     sleep(1);
 
+    if (mkdtemp(tdir) == NULL)
+        err(1, "can't create %s", tdir);
+    setenv("SIPLOG_INDEX_DIR", tdir, 1);
+    unsetenv("SIPLOG_LVL");
+    for (i = 0; test_bends[i] != NULL; i++) {
+        test_dedup(test_bends[i]);
+        test_flightrec(test_bends[i]);
+    }
+    test_ratelimit("logfile_async");
+    test_cidx();
+    test_share();
+    test_flightrec_full();
+    if (nfailed != 0)
+        errx(1, "%d of %d checks failed, logs are left in %s", nfailed,
+          nchecks, tdir);
+    printf("all %d checks passed\n", nchecks);
+
     exit(0);
 }
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Checks of the C++ front end, siplog.hpp. Lines are logged into a log
+ * file of their own and read back. Exits with 0 if all checks pass.
+ *
+ * Built with SIPLOG_TEST_BAD_FORMAT set to one of 1..5 it must not compile,
+ * each of those is a format string that is to be rejected at compile time.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "siplog.hpp"
+
+static int nchecks, nfailed;
+
+#define CHECK(expr)							\
+    do {								\
+	nchecks++;							\
+	if (!(expr)) {							\
+	    std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,\
+	      __LINE__, #expr);						\
+	    nfailed++;							\
+	}								\
+    } while (0)
+
+static std::vector<std::string>
+read_lines(const std::string &path)
+{
+    std::vector<std::string> lines;
+    std::ifstream f(path);
+    std::string line;
+
+    while (std::getline(f, line))
+        lines.push_back(line);
+    return (lines);
+}
+
+static int
+count_lines(const std::vector<std::string> &lines, const std::string &needle)
+{
+    int n = 0;
+
+    for (const auto &line : lines) {
+        if (line.find(needle) != std::string::npos)
+            n++;
+    }
+    return (n);
+}
+
+enum class color { red = 1, green = 2 };
+
+/* Arguments come out the way the placeholders ask for */
+static void
+test_format(const std::string &dir)
+{
+    std::string path = dir + "/format.log";
+
+    setenv("SIPLOG_LOGFILE_FILE", path.c_str(), 1);
+    {
+        siplog::log log("test_hpp", "format@1.2.3.4");
+        CHECK(bool(log));
+        log.info("int {} hex {:x} HEX {:X} neg {}", 42, 255u, 0xabcd, -7);
+        log.info("str {} sv {} char {} bool {}", "abc", std::string("def"),
+          'g', true);
+        log.info("enum {} null {} braces {{}}", color::green,
+          static_cast<const char *>(nullptr));
+        log.info("long {}", std::string(3 * siplog::line_reserve, 'x'));
+        log.dbug("after long");
+#ifdef SIPLOG_TEST_BAD_FORMAT
+#if SIPLOG_TEST_BAD_FORMAT == 1
+        log.info("{} and {}", 1);
+#elif SIPLOG_TEST_BAD_FORMAT == 2
+        log.info("{}", 1, 2);
+#elif SIPLOG_TEST_BAD_FORMAT == 3
+        log.info("{:x}", "not an integer");
+#elif SIPLOG_TEST_BAD_FORMAT == 4
+        log.info("{:d}", 1);
+#elif SIPLOG_TEST_BAD_FORMAT == 5
+        log.info("unterminated {", 1);
+#endif
+#endif
+    }
+    auto lines = read_lines(path);
+    CHECK(count_lines(lines, "]: int 42 hex ff HEX ABCD neg -7") == 1);
+    CHECK(count_lines(lines, "]: str abc sv def char g bool true") == 1);
+    CHECK(count_lines(lines, "]: enum 2 null (null) braces {}") == 1);
+    CHECK(count_lines(lines, "]: long " +
+      std::string(3 * siplog::line_reserve, 'x')) == 1);
+    CHECK(count_lines(lines, "]: after long") == 1);
+}
+
+/*
+ * Every call site gets a token bucket of its own, even though they all go
+ * through the same siplog::log::write<Args...>, and lines that don't fit
+ * into the first reservation only take one token.
+ */
+static void
+test_ratelimit(const std::string &dir)
+{
+    std::string path = dir + "/ratelimit.log";
+    std::string longarg(3 * siplog::line_reserve, 'y');
+
+    setenv("SIPLOG_LOGFILE_FILE", path.c_str(), 1);
+    siplog_set_ratelimit(SIPLOG_WARN, 1, 2);
+    {
+        siplog::log log("test_hpp", "ratelimit@1.2.3.4");
+        CHECK(bool(log));
+        for (int i = 0; i < 3; i++) {
+            log.warn("site a {}", std::string("a"));
+            log.warn("site b {}", std::string("b"));
+            log.warn("long site {}", longarg);
+        }
+    }
+    siplog_set_ratelimit(SIPLOG_WARN, 0, 0);
+    auto lines = read_lines(path);
+    CHECK(count_lines(lines, "]: site a a") == 2);
+    CHECK(count_lines(lines, "]: site b b") == 2);
+    CHECK(count_lines(lines, "]: long site " + longarg) == 2);
+}
+
+int
+main()
+{
+    char tdir[] = "/tmp/siplog-test-hpp.XXXXXX";
+
+    if (mkdtemp(tdir) == nullptr) {
+        std::perror(tdir);
+        return (1);
+    }
+    setenv("SIPLOG_BEND", "logfile", 1);
+    setenv("SIPLOG_INDEX_DIR", tdir, 1);
+    unsetenv("SIPLOG_LVL");
+    test_format(tdir);
+    test_ratelimit(tdir);
+    if (nfailed != 0) {
+        std::fprintf(stderr, "%d of %d checks failed, logs are left in %s\n",
+          nfailed, nchecks, tdir);
+        return (1);
+    }
+    std::printf("all %d checks passed\n", nchecks);
+    return (0);
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Reference collector for the "collector" backend. Receives records from
+ * the processes on the same box over a Unix datagram socket and appends
+ * them to the log files, maintaining the call-id index in the same way
+ * the file backends do. Records are consumed in batches with recvmmsg(2)
+ * and all consecutive records for the same file go out with a single
+ * writev(2) under a single lock.
+ */
+
+#define _FILE_OFFSET_BITS  64
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "siplog.h"
+#include "internal/_siplog.h"
+#include "internal/siplog_collector.h"
+
+#define COLLECTD_MAXFILES	16
+#define COLLECTD_IDX_LEN	256
+
+struct collectd_file {
+    char *path;
+    int fd;
+    ino_t ino;
+    time_t checked;
+};
+
+struct collectd_rec {
+    struct collectd_file *file;
+    char idx_id[COLLECTD_IDX_LEN];
+    char *data;
+    size_t len;
+};
+
+static struct collectd_file files[COLLECTD_MAXFILES];
+static int nfiles;
+static volatile sig_atomic_t done;
+
+static char bufs[SIPLOG_COLLECTOR_BATCH][SIPLOG_COLLECTOR_MAXMSG];
+static struct collectd_rec recs[SIPLOG_COLLECTOR_BATCH];
+
+static void
+usage(void)
+{
+
+    fprintf(stderr, "usage: siplog-collectd [-s socket] [-o logfile]\n");
+    exit(1);
+}
+
+static void
+collectd_sighandler(int sig __attribute__ ((unused)))
+{
+
+    done = 1;
+}
+
+static int
+collectd_reopen(struct collectd_file *cfp)
+{
+    struct stat sb;
+
+    if (cfp->fd != -1)
+        close(cfp->fd);
+    cfp->fd = open(cfp->path, O_CREAT | O_APPEND | O_WRONLY, 0640);
+    if (cfp->fd == -1) {
+        warn("%s", cfp->path);
+        return (-1);
+    }
+    cfp->ino = (fstat(cfp->fd, &sb) == 0) ? sb.st_ino : 0;
+    return (0);
+}
+
+static struct collectd_file *
+collectd_getfile(const char *path, size_t len, time_t now)
+{
+    struct collectd_file *cfp;
+    struct stat sb;
+    int i;
+
+    cfp = NULL;
+    for (i = 0; i < nfiles; i++) {
+        if (strlen(files[i].path) == len &&
+          memcmp(files[i].path, path, len) == 0) {
+            cfp = &files[i];
+            break;
+        }
+    }
+    if (cfp == NULL) {
+        if (nfiles == COLLECTD_MAXFILES)
+            return (NULL);
+        cfp = &files[nfiles];
+        cfp->path = strndup(path, len);
+        if (cfp->path == NULL)
+            return (NULL);
+        cfp->fd = -1;
+        nfiles++;
+    }
+    /* Pick up log rotation, at most once per second */
+    if (cfp->fd != -1 && cfp->checked != now) {
+        cfp->checked = now;
+        if (stat(cfp->path, &sb) != 0 || sb.st_ino != cfp->ino)
+            collectd_reopen(cfp);
+    }
+    if (cfp->fd == -1) {
+        cfp->checked = now;
+        if (collectd_reopen(cfp) != 0)
+            return (NULL);
+    }
+    return (cfp);
+}
+
+static int
+collectd_parse(struct collectd_rec *rp, char *buf, size_t len,
+  const char *opath, time_t now)
+{
+    struct siplog_collector_hdr hdr;
+    char *path;
+    size_t idx_len;
+
+    if (len < sizeof(hdr))
+        return (-1);
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != SIPLOG_COLLECTOR_MAGIC)
+        return (-1);
+    if (len < sizeof(hdr) + hdr.path_len + hdr.idx_len)
+        return (-1);
+    path = buf + sizeof(hdr);
+    idx_len = hdr.idx_len;
+    if (idx_len >= sizeof(rp->idx_id))
+        idx_len = sizeof(rp->idx_id) - 1;
+    memcpy(rp->idx_id, path + hdr.path_len, idx_len);
+    rp->idx_id[idx_len] = '\0';
+    rp->data = path + hdr.path_len + hdr.idx_len;
+    rp->len = len - sizeof(hdr) - hdr.path_len - hdr.idx_len;
+    if (opath != NULL)
+        rp->file = collectd_getfile(opath, strlen(opath), now);
+    else
+        rp->file = collectd_getfile(path, hdr.path_len, now);
+    return (rp->file != NULL ? 0 : -1);
+}
+
+/* Write out records [first, last) that all go to the same file */
+static void
+collectd_flush(struct collectd_rec *first, struct collectd_rec *last)
+{
+    struct iovec iov[SIPLOG_COLLECTOR_BATCH];
+    struct collectd_rec *rp;
+    off_t offset, roff;
+    int fd, n;
+
+    fd = first->file->fd;
+    for (n = 0, rp = first; rp < last; rp++, n++) {
+        iov[n].iov_base = rp->data;
+        iov[n].iov_len = rp->len;
+    }
+    offset = siplog_lockf(fd);
+    for (roff = offset, rp = first; rp < last; rp++) {
+        if (rp->idx_id[0] != '\0')
+            siplog_update_index(rp->idx_id, fd, roff, rp->len);
+        roff += rp->len;
+    }
+    if (writev(fd, iov, n) == -1)
+        warn("%s", first->file->path);
+    siplog_unlockf(fd, offset);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct mmsghdr msgs[SIPLOG_COLLECTOR_BATCH];
+    struct iovec iovs[SIPLOG_COLLECTOR_BATCH];
+    struct sockaddr_un sun;
+    struct sigaction sa;
+    const char *spath, *opath;
+    int ch, fd, i, n, nrecs, first;
+    time_t now;
+
+    spath = getenv("SIPLOG_COLLECTOR_SOCK");
+    if (spath == NULL)
+        spath = SIPLOG_COLLECTOR_DEFAULT_SOCK;
+    opath = NULL;
+    while ((ch = getopt(argc, argv, "s:o:")) != -1) {
+        switch (ch) {
+        case 's':
+            spath = optarg;
+            break;
+
+        case 'o':
+            opath = optarg;
+            break;
+
+        default:
+            usage();
+        }
+    }
+    if (optind != argc)
+        usage();
+
+    memset(&sun, '\0', sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(spath) >= sizeof(sun.sun_path))
+        errx(1, "%s: socket path is too long", spath);
+    strcpy(sun.sun_path, spath);
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd == -1)
+        err(1, "socket");
+    unlink(spath);
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+        err(1, "%s", spath);
+
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = collectd_sighandler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (done == 0) {
+        memset(msgs, '\0', sizeof(msgs));
+        for (i = 0; i < SIPLOG_COLLECTOR_BATCH; i++) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = sizeof(bufs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = recvmmsg(fd, msgs, SIPLOG_COLLECTOR_BATCH, MSG_WAITFORONE, NULL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            err(1, "recvmmsg");
+        }
+        now = time(NULL);
+        for (nrecs = 0, i = 0; i < n; i++) {
+            if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0)
+                continue;
+            if (collectd_parse(&recs[nrecs], bufs[i], msgs[i].msg_len,
+              opath, now) == 0)
+                nrecs++;
+        }
+        for (first = 0, i = 1; i <= nrecs; i++) {
+            if (i < nrecs && recs[i].file == recs[first].file)
+                continue;
+            collectd_flush(&recs[first], &recs[i]);
+            first = i;
+        }
+    }
+    close(fd);
+    unlink(spath);
+    for (i = 0; i < nfiles; i++) {
+        if (files[i].fd != -1)
+            close(files[i].fd);
+    }
+    return (0);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Compact the call-id indices of log files, given by name or, for files
+ * that are gone already, by inode number. Meant to be run after rotation,
+ * e.g. from the postrotate script of logrotate(8) on the rotated files,
+ * for writers that don't do it themselves.
+ */
+
+#define _FILE_OFFSET_BITS  64
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "siplog.h"
+#include "internal/_siplog.h"
+#include "internal/siplog_idxcompact.h"
+
+static void
+usage(void)
+{
+
+    fprintf(stderr, "usage: siplog-idxcompact [-x idxdir] file|inode ...\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct stat st;
+    const char *idxdir;
+    unsigned long long ino;
+    char *ep;
+    int ch, i, rval;
+
+    idxdir = NULL;
+    while ((ch = getopt(argc, argv, "x:")) != -1) {
+        switch (ch) {
+        case 'x':
+            idxdir = optarg;
+            break;
+
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc == 0)
+        usage();
+    if (idxdir == NULL)
+        idxdir = siplog_index_dir();
+
+    rval = 0;
+    for (i = 0; i < argc; i++) {
+        if (stat(argv[i], &st) == 0) {
+            ino = st.st_ino;
+        } else {
+            ino = strtoull(argv[i], &ep, 10);
+            if (*ep != '\0' || ino == 0) {
+                warn("%s", argv[i]);
+                rval = 1;
+                continue;
+            }
+        }
+        if (siplog_index_compact(idxdir, ino) != 0) {
+            warn("%s: can't compact %s/%llu", argv[i], idxdir, ino);
+            rval = 1;
+        }
+    }
+    return (rval);
+}
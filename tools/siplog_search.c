@@ -0,0 +1,753 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Search log files for the lines of a given call and/or a given time
+ * range. When there is a call-id index for the file, only the extents
+ * listed in it are read, with the compact one binary searched. Otherwise
+ * the file is mapped into memory, split into newline-aligned chunks and
+ * scanned by a number of threads, looking for "/<call_id>/" with SSE2
+ * where available, and only matches that are the call-id field of a line
+ * count. Time range is checked against the timestamp at the start of the
+ * line, in the siplog_timeToStr() layout "DD Mon HH:MM:SS.mmm", which has
+ * no year, or by time of day only with SIPLOG_DETAILED_DATES, and the time
+ * index of the file, if there is one, tells which part of it to scan.
+ * Lines come out in file order.
+ */
+
+#define _FILE_OFFSET_BITS  64
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "siplog.h"
+#include "internal/_siplog.h"
+
+#define SEARCH_MAXTHREADS	64
+/* Files smaller than this are not worth splitting */
+#define SEARCH_MINCHUNK		(1024 * 1024)
+#define SEARCH_NOTIME		INT64_MIN
+#define SEARCH_MS_PER_DAY	(24 * 3600 * 1000LL)
+/* How late a line can be written after its timestamp has been taken, ms */
+#define SEARCH_SLACK		10000
+
+struct search_match {
+    off_t offset;
+    size_t len;
+};
+
+struct search_ts {
+    int64_t ms;
+    off_t offset;
+};
+
+struct search_chunk {
+    pthread_t tid;
+    const char *start;
+    const char *end;
+    struct search_match *matches;
+    size_t nmatches;
+    size_t size;
+};
+
+static const char *call_id;
+static char *needle;
+static size_t needle_len;
+static int64_t tfrom = SEARCH_NOTIME, tto = SEARCH_NOTIME;
+static int tdated;
+static int64_t slack = SEARCH_SLACK;
+static const char *base;
+
+static void
+usage(void)
+{
+
+    fprintf(stderr, "usage: siplog-search [-c call_id] [-s from] [-e to] "
+      "[-j nthreads] [-n]\n                     [-S slack] [-x idxdir] file ...\n"
+      "       from and to are [DD Mon ]HH:MM[:SS[.mmm]]\n");
+    exit(1);
+}
+
+static int
+search_month(const char *cp)
+{
+    static const char *mons[12] = {"Jan", "Feb", "Mar", "Apr", "May",
+      "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    int i;
+
+    for (i = 0; i < 12; i++) {
+        if (memcmp(cp, mons[i], 3) == 0)
+            return (i);
+    }
+    return (-1);
+}
+
+static int
+search_digits(const char **cpp, const char *ep, int n, int *vp)
+{
+    const char *cp;
+    int v, i;
+
+    cp = *cpp;
+    if (ep - cp < n)
+        return (-1);
+    for (v = 0, i = 0; i < n; i++) {
+        if (cp[i] < '0' || cp[i] > '9')
+            return (-1);
+        v = v * 10 + cp[i] - '0';
+    }
+    *cpp = cp + n;
+    *vp = v;
+    return (v);
+}
+
+/*
+ * Parse "[DD Mon ]HH:MM[:SS[.mmm]]" out of [cp, ep) into milliseconds,
+ * since midnight or, if there is a date, since midnight of "00 Jan". The
+ * precision is stored into unitp. Returns pointer past the time or NULL.
+ */
+static const char *
+search_parse_time(const char *cp, const char *ep, int64_t *tp, int *datedp,
+  int64_t *unitp)
+{
+    int day, mon, hh, mm, ss, ms;
+    int64_t unit;
+
+    day = mon = 0;
+    *datedp = 0;
+    if (ep - cp > 4 && (cp[1] == ' ' || cp[2] == ' ')) {
+        if (search_digits(&cp, ep, (cp[1] == ' ') ? 1 : 2, &day) < 0 ||
+          ep - cp < 5 || *cp++ != ' ' || (mon = search_month(cp)) < 0 ||
+          cp[3] != ' ')
+            return (NULL);
+        cp += 4;
+        *datedp = 1;
+    }
+    if (search_digits(&cp, ep, 2, &hh) < 0 || cp >= ep || *cp++ != ':' ||
+      search_digits(&cp, ep, 2, &mm) < 0)
+        return (NULL);
+    ss = ms = 0;
+    unit = 60 * 1000;
+    if (cp < ep && *cp == ':') {
+        cp++;
+        if (search_digits(&cp, ep, 2, &ss) < 0)
+            return (NULL);
+        unit = 1000;
+        if (cp < ep && *cp == '.') {
+            cp++;
+            if (search_digits(&cp, ep, 3, &ms) < 0)
+                return (NULL);
+            unit = 1;
+        }
+    }
+    *tp = ((int64_t)hh * 3600 + mm * 60 + ss) * 1000 + ms;
+    if (*datedp)
+        *tp += (mon * 32 + day) * SEARCH_MS_PER_DAY;
+    if (unitp != NULL)
+        *unitp = unit;
+    return (cp);
+}
+
+/* Check the timestamp the line starts with against the range */
+static int
+search_time_ok(const char *cp, const char *ep)
+{
+    int64_t t;
+    int dated;
+
+    if (tfrom == SEARCH_NOTIME && tto == SEARCH_NOTIME)
+        return (1);
+    if (search_parse_time(cp, ep, &t, &dated, NULL) == NULL)
+        return (0);
+    /* SIPLOG_DETAILED_DATES puts the date after the time, it's ignored */
+    if (tdated && dated) {
+        if (tfrom != SEARCH_NOTIME && t < tfrom)
+            return (0);
+        if (tto != SEARCH_NOTIME && t > tto)
+            return (0);
+        return (1);
+    }
+    t %= SEARCH_MS_PER_DAY;
+    if (tfrom != SEARCH_NOTIME && t < tfrom % SEARCH_MS_PER_DAY)
+        return (0);
+    if (tto != SEARCH_NOTIME && t > tto % SEARCH_MS_PER_DAY)
+        return (0);
+    return (1);
+}
+
+static const char *
+search_scalar(const char *hs, const char *ep, const char *nd, size_t n)
+{
+    const char *cp;
+
+    for (cp = hs; (size_t)(ep - cp) >= n; cp++) {
+        cp = memchr(cp, nd[0], ep - cp - n + 1);
+        if (cp == NULL)
+            return (NULL);
+        if (memcmp(cp, nd, n) == 0)
+            return (cp);
+    }
+    return (NULL);
+}
+
+/*
+ * Find the needle in [hs, ep). The SSE2 version compares 16 positions at
+ * a time against the two inner bytes of the needle, which are the first
+ * and the last character of the call-id rather than the slashes around
+ * it, and only does a full comparison where both match.
+ */
+static const char *
+search_find(const char *hs, const char *ep, const char *nd, size_t n)
+{
+#if defined(__SSE2__)
+    __m128i c1, c2, b1, b2;
+    unsigned int mask;
+    size_t i, len;
+    int bit;
+
+    len = ep - hs;
+    if (n < 3)
+        return (search_scalar(hs, ep, nd, n));
+    c1 = _mm_set1_epi8(nd[1]);
+    c2 = _mm_set1_epi8(nd[n - 2]);
+    for (i = 0; i + n + 15 <= len; i += 16) {
+        b1 = _mm_loadu_si128((const __m128i *)(hs + i + 1));
+        b2 = _mm_loadu_si128((const __m128i *)(hs + i + n - 2));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(b1, c1),
+          _mm_cmpeq_epi8(b2, c2)));
+        while (mask != 0) {
+            bit = __builtin_ctz(mask);
+            if (memcmp(hs + i + bit, nd, n) == 0)
+                return (hs + i + bit);
+            mask &= mask - 1;
+        }
+    }
+    return (search_scalar(hs + i, ep, nd, n));
+#else
+    return (search_scalar(hs, ep, nd, n));
+#endif
+}
+
+static void
+search_add(struct search_chunk *scp, const char *cp, const char *nl)
+{
+    struct search_match *mp;
+
+    if (scp->nmatches == scp->size) {
+        scp->size = (scp->size == 0) ? 256 : scp->size * 2;
+        mp = realloc(scp->matches, scp->size * sizeof(*mp));
+        if (mp == NULL)
+            err(1, "realloc");
+        scp->matches = mp;
+    }
+    mp = &scp->matches[scp->nmatches++];
+    mp->offset = cp - base;
+    mp->len = nl - cp;
+}
+
+static void *
+search_chunk_run(void *arg)
+{
+    struct search_chunk *scp;
+    const char *cp, *ls, *nl, *sl;
+
+    scp = (struct search_chunk *)arg;
+    if (call_id == NULL) {
+        for (cp = scp->start; cp < scp->end; cp = nl) {
+            nl = memchr(cp, '\n', scp->end - cp);
+            nl = (nl != NULL) ? nl + 1 : scp->end;
+            if (search_time_ok(cp, nl))
+                search_add(scp, cp, nl);
+        }
+        return (NULL);
+    }
+    for (cp = scp->start; cp < scp->end; cp = nl) {
+        cp = search_find(cp, scp->end, needle, needle_len);
+        if (cp == NULL)
+            break;
+        for (ls = cp; ls > scp->start && ls[-1] != '\n'; ls--)
+            continue;
+        nl = memchr(cp, '\n', scp->end - cp);
+        nl = (nl != NULL) ? nl + 1 : scp->end;
+        /* Has to be the call-id field, i.e. right after the timestamp */
+        sl = memchr(ls, '/', cp - ls + 1);
+        if (sl == cp && search_time_ok(ls, nl))
+            search_add(scp, ls, nl);
+    }
+    return (NULL);
+}
+
+static void
+search_output(const char *fname, const char *data, size_t len)
+{
+
+    if (fname != NULL)
+        printf("%s:", fname);
+    fwrite(data, 1, len, stdout);
+    if (len > 0 && data[len - 1] != '\n')
+        putchar('\n');
+}
+
+static int
+search_offcmp(const void *a, const void *b)
+{
+    const struct search_match *ma, *mb;
+
+    ma = (const struct search_match *)a;
+    mb = (const struct search_match *)b;
+    return ((ma->offset > mb->offset) - (ma->offset < mb->offset));
+}
+
+/* Compare the call-id that the index line at cp starts with to ours */
+static int
+search_idcmp(const char *cp, const char *ep, size_t idlen)
+{
+    const char *sp;
+    size_t len;
+    int r;
+
+    sp = memchr(cp, ' ', ep - cp);
+    len = (sp != NULL) ? (size_t)(sp - cp) : (size_t)(ep - cp);
+    r = memcmp(cp, call_id, MIN(len, idlen));
+    if (r != 0)
+        return (r);
+    return ((len > idlen) - (len < idlen));
+}
+
+/* Add the extent in the index line [cp, ep) if it's of our call */
+static void
+search_idxline(struct search_chunk *scp, const struct stat *stp,
+  const char *cp, const char *ep, size_t idlen)
+{
+    unsigned long long off, len;
+    char tmp[64];
+    size_t n;
+
+    if (search_idcmp(cp, ep, idlen) != 0)
+        return;
+    n = MIN((size_t)(ep - cp - idlen), sizeof(tmp) - 1);
+    memcpy(tmp, cp + idlen, n);
+    tmp[n] = '\0';
+    if (sscanf(tmp, "%llu %llu", &off, &len) != 2 ||
+      off + len > (unsigned long long)stp->st_size)
+        return;
+    search_add(scp, (const char *)(uintptr_t)off,
+      (const char *)(uintptr_t)(off + len));
+}
+
+/*
+ * Add the extents of the call from the index file at ipath, looking it up
+ * with a binary search if it's a compact one, sorted by call-id. Returns
+ * -1 if there is no such file.
+ */
+static int
+search_idxfile(struct search_chunk *scp, const struct stat *stp,
+  const char *ipath, int sorted)
+{
+    struct stat ist;
+    const char *data, *lo, *hi, *mid, *ls, *nl, *ep;
+    size_t idlen;
+    int fd;
+
+    fd = open(ipath, O_RDONLY);
+    if (fd == -1)
+        return (-1);
+    if (fstat(fd, &ist) == -1 || ist.st_size == 0) {
+        close(fd);
+        return (0);
+    }
+    data = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return (0);
+    ep = data + ist.st_size;
+    idlen = strlen(call_id);
+    lo = data;
+    if (sorted) {
+        /* First line with a call-id that is not less than ours */
+        hi = ep;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            for (ls = mid; ls > lo && ls[-1] != '\n'; ls--)
+                continue;
+            nl = memchr(ls, '\n', ep - ls);
+            nl = (nl != NULL) ? nl + 1 : ep;
+            if (search_idcmp(ls, nl, idlen) < 0)
+                lo = nl;
+            else
+                hi = ls;
+        }
+    }
+    for (ls = lo; ls < ep; ls = nl) {
+        nl = memchr(ls, '\n', ep - ls);
+        if (nl == NULL)
+            break;
+        if (sorted && search_idcmp(ls, nl, idlen) != 0)
+            break;
+        search_idxline(scp, stp, ls, nl, idlen);
+        nl++;
+    }
+    munmap((void *)data, ist.st_size);
+    return (0);
+}
+
+/*
+ * Look the call-id up in the index of the file and print the lines it
+ * points at. That is the compact index, if the file has been through
+ * siplog_index_compact(), and whatever is in the raw one. Extents of the
+ * compact one can span several lines. Returns -1 if there is no index to
+ * use.
+ */
+static int
+search_indexed(int fd, const struct stat *stp, const char *idxdir,
+  const char *pfx)
+{
+    static const char *sfx[] = {".cidx", "", ".compacting"};
+    struct search_chunk sc;
+    struct search_match *mp;
+    char ipath[1024], *buf, *cp, *ls, *nl;
+    off_t done, start;
+    size_t i, len;
+    ssize_t r;
+    int found;
+
+    memset(&sc, '\0', sizeof(sc));
+    base = NULL;
+    found = 0;
+    for (i = 0; i < sizeof(sfx) / sizeof(sfx[0]); i++) {
+        snprintf(ipath, sizeof(ipath), "%s/%llu%s", idxdir,
+          (unsigned long long)stp->st_ino, sfx[i]);
+        if (search_idxfile(&sc, stp, ipath, i == 0) == 0)
+            found = 1;
+    }
+    if (!found)
+        return (-1);
+
+    qsort(sc.matches, sc.nmatches, sizeof(*sc.matches), search_offcmp);
+    buf = NULL;
+    done = 0;
+    for (i = 0; i < sc.nmatches; i++) {
+        mp = &sc.matches[i];
+        /* Same line can be in more than one of the indices */
+        if (mp->offset + (off_t)mp->len <= done)
+            continue;
+        start = MAX(mp->offset, done);
+        len = mp->offset + mp->len - start;
+        done = start + len;
+        cp = realloc(buf, len);
+        if (cp == NULL)
+            err(1, "realloc");
+        buf = cp;
+        r = pread(fd, buf, len, start);
+        if (r <= 0)
+            continue;
+        for (ls = buf; ls < buf + r; ls = nl) {
+            nl = memchr(ls, '\n', buf + r - ls);
+            nl = (nl != NULL) ? nl + 1 : buf + r;
+            if (search_time_ok(ls, nl))
+                search_output(pfx, ls, nl - ls);
+        }
+    }
+    free(buf);
+    free(sc.matches);
+    return (0);
+}
+
+/*
+ * Wall clock of a bound of the range, in ms. The timestamps have no year,
+ * so it's the one of ref, unless that makes it too far in the future, and
+ * the bounds without a date are on the same day as ref.
+ */
+static int64_t
+search_epoch(int64_t key, time_t ref)
+{
+    struct tm tm, rtm;
+    int64_t ms;
+    time_t t;
+    int i;
+
+    localtime_r(&ref, &rtm);
+    ms = key % SEARCH_MS_PER_DAY;
+    t = ref;
+    for (i = 0; i < 2; i++) {
+        tm = rtm;
+        tm.tm_year -= i;
+        if (tdated) {
+            tm.tm_mon = key / SEARCH_MS_PER_DAY / 32;
+            tm.tm_mday = key / SEARCH_MS_PER_DAY % 32;
+        }
+        tm.tm_hour = ms / 3600000;
+        tm.tm_min = ms / 60000 % 60;
+        tm.tm_sec = ms / 1000 % 60;
+        tm.tm_isdst = -1;
+        t = mktime(&tm);
+        if (!tdated || t <= ref + SEARCH_MS_PER_DAY / 1000)
+            break;
+    }
+    return ((int64_t)t * 1000 + ms % 1000);
+}
+
+/*
+ * Narrow the part of the file to look at down to [*lop, *hip) using its
+ * time index, if there is one. Lines start at the offsets in there and
+ * everything before one has been written by the time next to it, so the
+ * range starts at the last offset written before the beginning of it and
+ * ends at the first one written later than slack after its end.
+ */
+static void
+search_ts_window(const char *idxdir, const struct stat *stp, off_t *lop,
+  off_t *hip)
+{
+    struct search_ts *tsv, *tp;
+    struct tm tm1, tm2;
+    char ipath[1024], *line, *ep;
+    size_t lsize, n, size, i;
+    int64_t from, to;
+    time_t ref, t;
+    FILE *f;
+
+    snprintf(ipath, sizeof(ipath), "%s/%llu.ts", idxdir,
+      (unsigned long long)stp->st_ino);
+    f = fopen(ipath, "r");
+    if (f == NULL)
+        return;
+    tsv = NULL;
+    n = size = 0;
+    line = NULL;
+    lsize = 0;
+    while (getline(&line, &lsize, f) > 0) {
+        if (n == size) {
+            size = (size == 0) ? 1024 : size * 2;
+            tp = realloc(tsv, size * sizeof(*tp));
+            if (tp == NULL)
+                err(1, "realloc");
+            tsv = tp;
+        }
+        tp = &tsv[n];
+        tp->ms = strtoll(line, &ep, 10);
+        if (*ep != ' ')
+            continue;
+        tp->offset = strtoll(ep + 1, NULL, 10);
+        if (tp->offset > stp->st_size)
+            continue;
+        /* Inode has been reused, what's before is about the old file */
+        if (n > 0 && tp->offset < tsv[n - 1].offset) {
+            tsv[0] = *tp;
+            n = 0;
+        }
+        n++;
+    }
+    free(line);
+    fclose(f);
+    if (n == 0)
+        goto out;
+
+    if (tdated) {
+        ref = stp->st_mtime;
+    } else {
+        /* Time of day alone is ambiguous once the file spans midnight */
+        ref = tsv[0].ms / 1000;
+        t = tsv[n - 1].ms / 1000;
+        localtime_r(&ref, &tm1);
+        localtime_r(&t, &tm2);
+        if (tm1.tm_yday != tm2.tm_yday || tm1.tm_year != tm2.tm_year)
+            goto out;
+    }
+    if (tfrom != SEARCH_NOTIME) {
+        from = search_epoch(tfrom, ref) - slack;
+        for (i = 0; i < n && tsv[i].ms < from; i++)
+            *lop = tsv[i].offset;
+    }
+    if (tto != SEARCH_NOTIME) {
+        to = search_epoch(tto, ref) + slack;
+        for (i = 0; i < n; i++) {
+            if (tsv[i].ms > to) {
+                *hip = tsv[i].offset;
+                break;
+            }
+        }
+    }
+out:
+    free(tsv);
+}
+
+static void
+search_file(const char *path, int nthreads, const char *idxdir,
+  const char *pfx)
+{
+    struct search_chunk chunks[SEARCH_MAXTHREADS];
+    struct search_match *mp;
+    struct stat st;
+    const char *cp, *ep;
+    off_t lo, hi;
+    size_t csize, i;
+    int fd, n, j;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        warn("%s", path);
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    if (call_id != NULL && idxdir != NULL &&
+      search_indexed(fd, &st, idxdir, pfx) == 0) {
+        close(fd);
+        return;
+    }
+    lo = 0;
+    hi = st.st_size;
+    if (idxdir != NULL && (tfrom != SEARCH_NOTIME || tto != SEARCH_NOTIME))
+        search_ts_window(idxdir, &st, &lo, &hi);
+    if (lo >= hi) {
+        close(fd);
+        return;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        warn("%s: mmap", path);
+        return;
+    }
+    madvise((void *)base, st.st_size, MADV_SEQUENTIAL);
+
+    /* Chop the file into chunks that end right after a newline */
+    n = (hi - lo) / SEARCH_MINCHUNK + 1;
+    if (n > nthreads)
+        n = nthreads;
+    csize = (hi - lo) / n;
+    ep = base + hi;
+    memset(chunks, '\0', sizeof(chunks));
+    for (cp = base + lo, j = 0; j < n && cp < ep; j++) {
+        chunks[j].start = cp;
+        if (j == n - 1 || (size_t)(ep - cp) <= csize) {
+            chunks[j].end = ep;
+        } else {
+            chunks[j].end = memchr(cp + csize, '\n', ep - cp - csize);
+            chunks[j].end = (chunks[j].end != NULL) ? chunks[j].end + 1 : ep;
+        }
+        cp = chunks[j].end;
+    }
+    n = j;
+    for (j = 1; j < n; j++) {
+        if (pthread_create(&chunks[j].tid, NULL, search_chunk_run,
+          &chunks[j]) != 0)
+            errx(1, "pthread_create failed");
+    }
+    search_chunk_run(&chunks[0]);
+    for (j = 1; j < n; j++)
+        pthread_join(chunks[j].tid, NULL);
+
+    for (j = 0; j < n; j++) {
+        for (i = 0; i < chunks[j].nmatches; i++) {
+            mp = &chunks[j].matches[i];
+            search_output(pfx, base + mp->offset, mp->len);
+        }
+        free(chunks[j].matches);
+    }
+    munmap((void *)base, st.st_size);
+}
+
+static void
+search_range(const char *arg, int64_t *tp, int end)
+{
+    const char *ep;
+    int64_t t, unit;
+    int dated;
+
+    ep = arg + strlen(arg);
+    if (search_parse_time(arg, ep, &t, &dated, &unit) != ep)
+        errx(1, "%s: bad time, expected [DD Mon ]HH:MM[:SS[.mmm]]", arg);
+    if (tfrom != SEARCH_NOTIME || tto != SEARCH_NOTIME) {
+        if (dated != tdated)
+            errx(1, "either both or none of the times have to be dated");
+    }
+    tdated = dated;
+    /* End of the range includes all of the minute/second given */
+    *tp = end ? t + unit - 1 : t;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *idxdir;
+    int ch, i, nthreads, noindex;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    noindex = 0;
+    idxdir = NULL;
+    while ((ch = getopt(argc, argv, "c:s:e:j:nS:x:")) != -1) {
+        switch (ch) {
+        case 'c':
+            call_id = optarg;
+            break;
+
+        case 's':
+            search_range(optarg, &tfrom, 0);
+            break;
+
+        case 'e':
+            search_range(optarg, &tto, 1);
+            break;
+
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+
+        case 'n':
+            noindex = 1;
+            break;
+
+        case 'S':
+            slack = atoi(optarg) * 1000LL;
+            break;
+
+        case 'x':
+            idxdir = optarg;
+            break;
+
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc == 0 || (call_id == NULL && tfrom == SEARCH_NOTIME &&
+      tto == SEARCH_NOTIME))
+        usage();
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > SEARCH_MAXTHREADS)
+        nthreads = SEARCH_MAXTHREADS;
+    if (idxdir == NULL)
+        idxdir = siplog_index_dir();
+    if (noindex)
+        idxdir = NULL;
+    if (call_id != NULL) {
+        if (asprintf(&needle, "/%s/", call_id) == -1)
+            err(1, "asprintf");
+        needle_len = strlen(needle);
+    }
+
+    for (i = 0; i < argc; i++)
+        search_file(argv[i], nthreads, idxdir, (argc > 1) ? argv[i] : NULL);
+    return (0);
+}
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2006-2016 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ */
+
+/*
+ * Top-like view of the live counters that the processes running with
+ * SIPLOG_STATS set publish in shared memory. Segments are found in
+ * /dev/shm, or given by pid on the command line on systems where POSIX
+ * shared memory is not visible in the file system. Rates are computed
+ * between two consecutive snapshots of the same process, latencies are
+ * for the last interval, except for the maximums that are since start.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "siplog.h"
+#include "internal/_siplog.h"
+#include "internal/siplog_stats.h"
+
+#define STAT_SHM_DIR		"/dev/shm"
+#define STAT_MAXPROCS		256
+#define STAT_MAXTRIES		100
+
+struct stat_proc {
+    pid_t pid;
+    const struct siplog_stats_shm *shm;
+    struct siplog_stats_shm prev;
+    int have_prev;
+};
+
+static struct stat_proc procs[STAT_MAXPROCS];
+static int nprocs;
+static volatile sig_atomic_t done;
+
+static void
+usage(void)
+{
+
+    fprintf(stderr, "usage: siplog-stat [-i interval] [-n count] "
+      "[pid ...]\n");
+    exit(1);
+}
+
+static void
+stat_sighandler(int sig __attribute__ ((unused)))
+{
+
+    done = 1;
+}
+
+static struct stat_proc *
+stat_attach(pid_t pid)
+{
+    struct stat_proc *spp;
+    struct siplog_stats_shm *shm;
+    char name[64];
+    int fd, i;
+
+    for (i = 0; i < nprocs; i++) {
+        if (procs[i].pid == pid)
+            return (&procs[i]);
+    }
+    if (nprocs == STAT_MAXPROCS)
+        return (NULL);
+    snprintf(name, sizeof(name), "/" SIPLOG_STATS_PREFIX "%d", (int)pid);
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+        return (NULL);
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return (NULL);
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SIPLOG_STATS_MAGIC ||
+      shm->version != SIPLOG_STATS_VERSION) {
+        munmap((void *)shm, sizeof(*shm));
+        return (NULL);
+    }
+    spp = &procs[nprocs++];
+    memset(spp, '\0', sizeof(*spp));
+    spp->pid = pid;
+    spp->shm = shm;
+    return (spp);
+}
+
+static void
+stat_detach(struct stat_proc *spp)
+{
+
+    munmap((void *)spp->shm, sizeof(*spp->shm));
+    *spp = procs[--nprocs];
+}
+
+/* Find the segments of all running processes */
+static void
+stat_scan(void)
+{
+    struct dirent *dep;
+    DIR *dp;
+    size_t plen;
+    char *ep;
+    long pid;
+
+    dp = opendir(STAT_SHM_DIR);
+    if (dp == NULL)
+        return;
+    plen = strlen(SIPLOG_STATS_PREFIX);
+    while ((dep = readdir(dp)) != NULL) {
+        if (strncmp(dep->d_name, SIPLOG_STATS_PREFIX, plen) != 0)
+            continue;
+        pid = strtol(dep->d_name + plen, &ep, 10);
+        if (*ep != '\0' || pid <= 0)
+            continue;
+        stat_attach(pid);
+    }
+    closedir(dp);
+}
+
+/* Copy a consistent snapshot out, returns -1 if it is never stable */
+static int
+stat_read(const struct siplog_stats_shm *shm, struct siplog_stats_shm *snap)
+{
+    uint32_t seq;
+    int i;
+
+    for (i = 0; i < STAT_MAXTRIES; i++) {
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) == 0) {
+            memcpy(snap, (const void *)shm, sizeof(*snap));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+                return (0);
+        }
+        sched_yield();
+    }
+    return (-1);
+}
+
+static double
+stat_rate(uint64_t cur, uint64_t prev, double secs)
+{
+
+    if (secs <= 0 || cur < prev)
+        return (0);
+    return ((double)(cur - prev) / secs);
+}
+
+static void
+stat_show_one(struct stat_proc *spp, const struct siplog_stats_shm *cur)
+{
+    const struct siplog_stats_shm *prev;
+    uint64_t lines, plines, drops, pdrops, napp;
+    double secs, idx_avg;
+    int i;
+
+    prev = &spp->prev;
+    lines = plines = drops = pdrops = 0;
+    for (i = 0; i < SIPLOG_NLEVELS; i++) {
+        lines += cur->lines[i];
+        plines += prev->lines[i];
+        drops += cur->drops[i];
+        pdrops += prev->drops[i];
+    }
+    secs = (double)(cur->updated - prev->updated) / 1e9;
+    printf("%6d %-12.12s", (int)cur->pid, cur->app);
+    if (spp->have_prev == 0) {
+        printf(" %9s\n", "-");
+        return;
+    }
+    printf(" %9.0f", stat_rate(lines, plines, secs));
+    for (i = 0; i < SIPLOG_NLEVELS; i++)
+        printf(" %7.0f", stat_rate(cur->lines[i], prev->lines[i], secs));
+    printf(" %8.1f %7.0f", stat_rate(cur->bytes, prev->bytes, secs) / 1024,
+      stat_rate(drops, pdrops, secs));
+    printf(" %5lld %7.2f %7.2f", (long long)cur->qdepth,
+      (double)cur->lag_last / 1e6, (double)cur->lag_max / 1e6);
+    napp = cur->idx_appends - prev->idx_appends;
+    idx_avg = (napp > 0) ? (double)(cur->idx_ns_total -
+      prev->idx_ns_total) / napp / 1e3 : 0;
+    printf(" %7.1f %7.1f", idx_avg, (double)cur->idx_ns_max / 1e3);
+    if (cur->memdeb_live >= 0)
+        printf(" %9lld", (long long)(cur->memdeb_live / 1024));
+    else
+        printf(" %9s", "-");
+    printf("\n");
+}
+
+/* Take a snapshot of every process, printing the rates unless priming */
+static void
+stat_sample(int print, int clear)
+{
+    struct siplog_stats_shm cur;
+    struct stat_proc *spp;
+    char tbuf[64];
+    time_t now;
+    int i;
+
+    if (print) {
+        now = time(NULL);
+        strftime(tbuf, sizeof(tbuf), "%H:%M:%S", localtime(&now));
+        if (clear)
+            printf("\033[H\033[2J");
+        printf("siplog-stat - %s, %d process(es)\n\n", tbuf, nprocs);
+        printf("%6s %-12s %9s %7s %7s %7s %7s %7s %8s %7s %5s %7s %7s %7s "
+          "%7s %9s\n", "PID", "APP", "LINES/s", "DBUG", "INFO", "WARN",
+          "ERR", "CRIT", "KB/s", "DROP/s", "QUEUE", "LAG ms", "MAX ms",
+          "IDX us", "MAX us", "MEMDEB KB");
+    }
+    for (i = 0; i < nprocs;) {
+        spp = &procs[i];
+        /* Segments of processes that died without cleaning up are skipped */
+        if ((kill(spp->pid, 0) == -1 && errno == ESRCH) ||
+          stat_read(spp->shm, &cur) != 0) {
+            stat_detach(spp);
+            continue;
+        }
+        if (print)
+            stat_show_one(spp, &cur);
+        spp->prev = cur;
+        spp->have_prev = 1;
+        i++;
+    }
+    fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct sigaction sa;
+    struct timespec ts;
+    double interval;
+    int ch, count, i, scan, clear;
+    long pid;
+    char *ep;
+
+    interval = 1;
+    count = -1;
+    while ((ch = getopt(argc, argv, "i:n:")) != -1) {
+        switch (ch) {
+        case 'i':
+            interval = strtod(optarg, &ep);
+            if (*ep != '\0' || interval <= 0)
+                usage();
+            break;
+
+        case 'n':
+            count = atoi(optarg);
+            if (count <= 0)
+                usage();
+            break;
+
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    scan = (argc == 0);
+    for (i = 0; i < argc; i++) {
+        pid = strtol(argv[i], &ep, 10);
+        if (*ep != '\0' || pid <= 0)
+            usage();
+        if (stat_attach(pid) == NULL)
+            warnx("%ld: no counters published", pid);
+    }
+    if (!scan && nprocs == 0)
+        return (1);
+    clear = isatty(STDOUT_FILENO);
+
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = stat_sighandler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    ts.tv_sec = (time_t)interval;
+    ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
+    if (scan)
+        stat_scan();
+    stat_sample(0, 0);
+    while (done == 0 && count != 0) {
+        nanosleep(&ts, NULL);
+        if (done != 0)
+            break;
+        if (scan)
+            stat_scan();
+        stat_sample(1, clear);
+        if (count > 0)
+            count--;
+    }
+    while (nprocs > 0)
+        stat_detach(&procs[0]);
+    return (0);
+}